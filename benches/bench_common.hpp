@@ -0,0 +1,155 @@
+// Pieces shared by jalloc_bench and jalloc_replay: the allocators under
+// test, the clock, RSS readings and running a measurement in a child.
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <dlfcn.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#ifdef __APPLE__
+    #include <mach/mach.h>
+#endif
+#include "jalloc.hpp"
+
+struct allocator_ops
+{
+    const char* name;
+    void* (*allocate)(size_t);
+    void (*deallocate)(void*);
+    void* (*reallocate)(void*, size_t);
+    void* (*callocate)(size_t, size_t);
+    void* (*allocate_aligned)(size_t alignment, size_t size);
+};
+
+static std::vector<allocator_ops> available_allocators()
+{
+    std::vector<allocator_ops> list;
+    list.push_back({
+        "jalloc",
+        [](const size_t size) { return Jallocator::allocate(size); },
+        [](void* ptr) { Jallocator::deallocate(ptr); },
+        [](void* ptr, const size_t size) { return Jallocator::reallocate(ptr, size); },
+        [](const size_t num, const size_t size) { return Jallocator::callocate(num, size); },
+        [](const size_t alignment, const size_t size) { return Jallocator::allocate_aligned(size, alignment); }
+    });
+    list.push_back({
+        "system", std::malloc, std::free, std::realloc, std::calloc,
+        [](const size_t alignment, const size_t size)
+        {
+            void* ptr = nullptr;
+            return posix_memalign(&ptr, alignment < sizeof(void*) ? sizeof(void*) : alignment, size) == 0
+                       ? ptr : nullptr;
+        }
+    });
+
+    // The handle scope finds the library's own malloc, not the one in libc
+    const auto load = [&list](const char* name, const std::vector<const char*>& files,
+                              const std::vector<const char*>& prefixes)
+    {
+        for (const char* file : files)
+        {
+            void* handle = dlopen(file, RTLD_NOW | RTLD_LOCAL);
+            if (!handle)
+                continue;
+            for (const char* prefix : prefixes)
+            {
+                const auto find = [handle, prefix](const char* function)
+                {
+                    char symbol[64];
+                    std::snprintf(symbol, sizeof(symbol), "%s%s", prefix, function);
+                    return dlsym(handle, symbol);
+                };
+                allocator_ops ops{
+                    name,
+                    reinterpret_cast<void* (*)(size_t)>(find("malloc")),
+                    reinterpret_cast<void (*)(void*)>(find("free")),
+                    reinterpret_cast<void* (*)(void*, size_t)>(find("realloc")),
+                    reinterpret_cast<void* (*)(size_t, size_t)>(find("calloc")),
+                    reinterpret_cast<void* (*)(size_t, size_t)>(find("aligned_alloc"))
+                };
+                if (ops.allocate && ops.deallocate && ops.reallocate && ops.callocate &&
+                    ops.allocate_aligned && ops.allocate != &std::malloc)
+                {
+                    list.push_back(ops);
+                    return;
+                }
+            }
+            dlclose(handle);
+        }
+    };
+    load("jemalloc", {"libjemalloc.so.2", "libjemalloc.so", "libjemalloc.2.dylib", "libjemalloc.dylib"},
+         {"je_", ""});
+    load("mimalloc", {"libmimalloc.so.2", "libmimalloc.so", "libmimalloc.2.dylib", "libmimalloc.dylib"},
+         {"mi_"});
+    return list;
+}
+
+static uint64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static size_t resident_bytes()
+{
+#if defined(__linux__)
+    FILE* statm = std::fopen("/proc/self/statm", "r");
+    if (!statm)
+        return 0;
+    size_t total = 0, resident = 0;
+    const int read = std::fscanf(statm, "%zu %zu", &total, &resident);
+    std::fclose(statm);
+    return read == 2 ? resident * static_cast<size_t>(sysconf(_SC_PAGESIZE)) : 0;
+#elif defined(__APPLE__)
+    mach_task_basic_info_data_t info{};
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+    if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, reinterpret_cast<task_info_t>(&info), &count) != KERN_SUCCESS)
+        return 0;
+    return info.resident_size;
+#else
+    return 0;
+#endif
+}
+
+static size_t peak_resident_bytes()
+{
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return static_cast<size_t>(usage.ru_maxrss);
+#else
+    return static_cast<size_t>(usage.ru_maxrss) * 1024;
+#endif
+}
+
+// Runs `measure()` in a child process, so every allocator starts from a
+// clean heap and a crash fails only its own row. False when the child
+// did not hand back a result.
+template<typename Result, typename Measure>
+static bool run_isolated(Measure measure, Result& result)
+{
+    int channel[2];
+    if (pipe(channel) != 0)
+        return false;
+    const pid_t child = fork();
+    if (child < 0)
+        return false;
+    if (child == 0)
+    {
+        close(channel[0]);
+        const Result measured = measure();
+        const ssize_t written = write(channel[1], &measured, sizeof(measured));
+        _exit(written == static_cast<ssize_t>(sizeof(measured)) ? 0 : 1);
+    }
+
+    close(channel[1]);
+    const ssize_t got = read(channel[0], &result, sizeof(result));
+    close(channel[0]);
+    int status = 0;
+    waitpid(child, &status, 0);
+    return got == static_cast<ssize_t>(sizeof(result)) && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
@@ -0,0 +1,531 @@
+// Allocator workloads after the usual suites (larson, xmalloc-test,
+// cache-scratch, mstress) plus random size mixes and realloc growth.
+// Every allocator, workload and thread count runs in a child process of
+// its own, so RSS is measured from a clean heap each time.
+//
+//   jalloc_bench [--threads N] [--scale X] [--workload NAME] [--allocator NAME] [--quick]
+//
+// jemalloc and mimalloc are compared when their shared libraries can be
+// dlopen'ed, glibc (or the platform's) malloc always.
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include "bench_common.hpp"
+
+//--------------------------------------------------------------------------
+// Measurement
+//--------------------------------------------------------------------------
+// xorshift64*, one per thread
+struct rng
+{
+    uint64_t state;
+
+    explicit rng(const uint64_t seed) : state(seed * 0x9E3779B97F4A7C15ULL | 1) {}
+
+    uint64_t next()
+    {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 0x2545F4914F6CDD1DULL;
+    }
+
+    size_t below(const size_t n)
+    {
+        return static_cast<size_t>(next() % n);
+    }
+
+    // log-uniform in [low, high], most requests are small as in real heaps
+    size_t log_uniform(const size_t low, const size_t high)
+    {
+        const double span = std::log2(static_cast<double>(high) / static_cast<double>(low));
+        const double u = static_cast<double>(next() >> 11) * 0x1.0p-53;
+        return static_cast<size_t>(static_cast<double>(low) * std::exp2(u * span));
+    }
+};
+
+// Per-thread view of the allocator. Every 8th call is timed, which keeps
+// the clock out of the throughput while still filling the percentiles.
+struct worker
+{
+    static constexpr size_t MAX_SAMPLES = 1 << 18;
+
+    const allocator_ops* ops;
+    rng random;
+    uint64_t calls{0};
+    std::vector<uint32_t> latencies;
+
+    worker(const allocator_ops& allocator, const uint64_t seed) : ops(&allocator), random(seed)
+    {
+        latencies.reserve(MAX_SAMPLES);
+    }
+
+    template<typename Call>
+    auto timed(Call call)
+    {
+        if ((++calls & 7) != 0 || latencies.size() == MAX_SAMPLES)
+            return call();
+        const uint64_t start = now_ns();
+        auto result = call();
+        const uint64_t elapsed = now_ns() - start;
+        latencies.push_back(static_cast<uint32_t>(elapsed < UINT32_MAX ? elapsed : UINT32_MAX));
+        return result;
+    }
+
+    void* allocate(const size_t size)
+    {
+        auto* ptr = static_cast<char*>(timed([&] { return ops->allocate(size); }));
+        ptr[0] = 1; // touch it, untouched memory costs nothing
+        return ptr;
+    }
+
+    void deallocate(void* ptr)
+    {
+        timed([&] { ops->deallocate(ptr); return 0; });
+    }
+
+    void* reallocate(void* ptr, const size_t size)
+    {
+        auto* grown = static_cast<char*>(timed([&] { return ops->reallocate(ptr, size); }));
+        grown[size - 1] = 1;
+        return grown;
+    }
+};
+
+struct run_result
+{
+    double seconds;
+    uint64_t calls;
+    uint32_t p50, p99, p999;
+    size_t peak_rss;
+    size_t steady_rss;
+};
+
+// Runs `body(worker, index)` on `threads` threads released together and
+// returns the wall time from release to the last join
+template<typename Body>
+static double parallel(std::vector<worker>& workers, const size_t threads, Body body)
+{
+    std::atomic<size_t> ready{0};
+    std::atomic<bool> go{false};
+    std::vector<std::thread> pool;
+    pool.reserve(threads);
+    for (size_t t = 0; t < threads; ++t)
+    {
+        pool.emplace_back([&, t]
+        {
+            ready.fetch_add(1);
+            while (!go.load(std::memory_order_acquire))
+                std::this_thread::yield();
+            body(workers[t], t);
+        });
+    }
+    while (ready.load() != threads)
+        std::this_thread::yield();
+
+    const uint64_t start = now_ns();
+    go.store(true, std::memory_order_release);
+    for (auto& thread : pool)
+        thread.join();
+    return static_cast<double>(now_ns() - start) / 1e9;
+}
+
+//--------------------------------------------------------------------------
+// Workloads. Each returns the wall time of its measured part, `scale`
+// multiplies the amount of work.
+//--------------------------------------------------------------------------
+
+// Larson: each thread replaces random blocks in a slot array, and the
+// arrays move on to a fresh set of threads every round, so most frees hit
+// blocks another thread allocated
+static double larson(std::vector<worker>& workers, const size_t threads, const double scale)
+{
+    constexpr size_t SLOTS = 1000;
+    constexpr size_t ROUNDS = 4;
+    const size_t steps = static_cast<size_t>(250000 * scale) + 1;
+
+    std::vector<std::vector<void*>> sets(threads, std::vector<void*>(SLOTS));
+    for (auto& set : sets)
+        for (auto& slot : set)
+            slot = workers[0].allocate(16 + workers[0].random.below(1008));
+
+    double seconds = 0;
+    for (size_t round = 0; round < ROUNDS; ++round)
+    {
+        seconds += parallel(workers, threads, [&](worker& w, const size_t t)
+        {
+            auto& set = sets[(t + round) % threads];
+            for (size_t i = 0; i < steps; ++i)
+            {
+                void*& slot = set[w.random.below(SLOTS)];
+                w.deallocate(slot);
+                slot = w.allocate(16 + w.random.below(1008));
+            }
+        });
+    }
+
+    for (auto& set : sets)
+        for (void* slot : set)
+            workers[0].deallocate(slot);
+    return seconds;
+}
+
+// Single producer, single consumer queue of blocks
+struct ring
+{
+    static constexpr size_t CAPACITY = 4096;
+    alignas(64) std::atomic<size_t> head{0};
+    alignas(64) std::atomic<size_t> tail{0};
+    alignas(64) std::atomic<bool> done{false};
+    void* slots[CAPACITY];
+};
+
+// xmalloc-test: producers allocate, consumers free, every block crosses
+// threads. One thread frees its own batches instead.
+static double xmalloc(std::vector<worker>& workers, const size_t threads, const double scale)
+{
+    const size_t blocks = static_cast<size_t>(1000000 * scale) + 64;
+    if (threads == 1)
+    {
+        return parallel(workers, 1, [&](worker& w, size_t)
+        {
+            void* batch[64];
+            for (size_t done = 0; done < blocks; done += 64)
+            {
+                for (auto& ptr : batch)
+                    ptr = w.allocate(16 + w.random.below(240));
+                for (void* ptr : batch)
+                    w.deallocate(ptr);
+            }
+        });
+    }
+
+    // one ring per producer, consumers serve theirs round robin
+    const size_t producers = (threads + 1) / 2;
+    const size_t consumers = threads / 2;
+    std::vector<ring> rings(producers);
+
+    return parallel(workers, threads, [&](worker& w, const size_t t)
+    {
+        if (t < producers)
+        {
+            ring& r = rings[t];
+            for (size_t i = 0; i < blocks; ++i)
+            {
+                void* ptr = w.allocate(16 + w.random.below(240));
+                const size_t head = r.head.load(std::memory_order_relaxed);
+                while (head - r.tail.load(std::memory_order_acquire) == ring::CAPACITY)
+                    std::this_thread::yield();
+                r.slots[head % ring::CAPACITY] = ptr;
+                r.head.store(head + 1, std::memory_order_release);
+            }
+            r.done.store(true, std::memory_order_release);
+            return;
+        }
+
+        const size_t consumer = t - producers;
+        for (bool busy = true; busy;)
+        {
+            busy = false;
+            for (size_t p = consumer; p < producers; p += consumers)
+            {
+                ring& r = rings[p];
+                const bool finished = r.done.load(std::memory_order_acquire);
+                const size_t head = r.head.load(std::memory_order_acquire);
+                size_t tail = r.tail.load(std::memory_order_relaxed);
+                for (; tail != head; ++tail)
+                    w.deallocate(r.slots[tail % ring::CAPACITY]);
+                r.tail.store(tail, std::memory_order_release);
+                busy |= !finished || head != r.head.load(std::memory_order_acquire);
+            }
+            if (busy)
+                std::this_thread::yield();
+        }
+    });
+}
+
+// cache-scratch: the main thread hands out neighbouring small objects, each
+// thread frees its own and then keeps allocating and writing one of the
+// same size. An allocator that reuses the freed neighbour shares the line.
+static double cache_scratch(std::vector<worker>& workers, const size_t threads, const double scale)
+{
+    constexpr size_t OBJECT = 8;
+    constexpr size_t WRITES = 500;
+    const size_t iterations = static_cast<size_t>(20000 * scale) + 1;
+
+    std::vector<void*> handed(threads);
+    for (auto& ptr : handed)
+        ptr = workers[0].allocate(OBJECT);
+
+    return parallel(workers, threads, [&](worker& w, const size_t t)
+    {
+        w.deallocate(handed[t]);
+        for (size_t i = 0; i < iterations; ++i)
+        {
+            auto* object = static_cast<volatile char*>(w.allocate(OBJECT));
+            for (size_t write = 0; write < WRITES; ++write)
+                object[write % OBJECT] = static_cast<char>(write);
+            w.deallocate(const_cast<char*>(object));
+        }
+    });
+}
+
+// mstress: long-lived random blocks, mostly small with a tail up to
+// 256 KB, where one replacement in eight swaps the block with whatever
+// another thread left in a shared exchange array
+static double mstress(std::vector<worker>& workers, const size_t threads, const double scale)
+{
+    constexpr size_t SLOTS = 2000;
+    constexpr size_t EXCHANGE = 256;
+    const size_t steps = static_cast<size_t>(400000 * scale) + 1;
+    std::vector<std::atomic<void*>> exchange(EXCHANGE);
+
+    const auto pick = [](worker& w)
+    {
+        const size_t roll = w.random.below(100);
+        return roll < 90 ? 8 + w.random.below(249)
+             : roll < 99 ? w.random.log_uniform(257, 4096)
+             : w.random.log_uniform(4097, 256 * 1024);
+    };
+
+    const double seconds = parallel(workers, threads, [&](worker& w, size_t)
+    {
+        std::vector<void*> live(SLOTS);
+        for (auto& slot : live)
+            slot = w.allocate(pick(w));
+        for (size_t i = 0; i < steps; ++i)
+        {
+            void*& slot = live[w.random.below(SLOTS)];
+            void* victim = slot;
+            if (w.random.below(8) == 0)
+                victim = exchange[w.random.below(EXCHANGE)].exchange(victim);
+            if (victim)
+                w.deallocate(victim);
+            slot = w.allocate(pick(w));
+        }
+        for (void* slot : live)
+            w.deallocate(slot);
+    });
+
+    for (auto& slot : exchange)
+        if (void* ptr = slot.load())
+            workers[0].deallocate(ptr);
+    return seconds;
+}
+
+// Random replacement in a live set of 4096 blocks
+template<size_t Low, size_t High>
+static double random_sizes(std::vector<worker>& workers, const size_t threads, const double scale)
+{
+    constexpr size_t LIVE = 4096;
+    const size_t steps = static_cast<size_t>(1000000 * scale) + 1;
+    return parallel(workers, threads, [&](worker& w, size_t)
+    {
+        std::vector<void*> live(LIVE);
+        for (auto& slot : live)
+            slot = w.allocate(w.random.log_uniform(Low, High));
+        for (size_t i = 0; i < steps; ++i)
+        {
+            void*& slot = live[w.random.below(LIVE)];
+            w.deallocate(slot);
+            slot = w.allocate(w.random.log_uniform(Low, High));
+        }
+        for (void* slot : live)
+            w.deallocate(slot);
+    });
+}
+
+// Buffers grown by about 1.5x up to 8 MB, and strings appended a few
+// bytes at a time, as vectors and string builders do
+static double realloc_growth(std::vector<worker>& workers, const size_t threads, const double scale)
+{
+    const size_t repeats = static_cast<size_t>(40 * scale) + 1;
+    return parallel(workers, threads, [&](worker& w, size_t)
+    {
+        for (size_t r = 0; r < repeats; ++r)
+        {
+            void* buffer = nullptr;
+            for (size_t size = 16; size < 8 * 1024 * 1024; size += size / 2 + w.random.below(64))
+                buffer = w.reallocate(buffer, size);
+            w.deallocate(buffer);
+
+            void* strings[64] = {};
+            for (size_t size = 8; size <= 4096; size += 8 + w.random.below(24))
+                for (auto& s : strings)
+                    s = w.reallocate(s, size);
+            for (void* s : strings)
+                w.deallocate(s);
+        }
+    });
+}
+
+struct workload
+{
+    const char* name;
+    double (*run)(std::vector<worker>&, size_t, double);
+};
+
+static const workload workloads[] = {
+    {"larson", larson},
+    {"xmalloc", xmalloc},
+    {"cache-scratch", cache_scratch},
+    {"mstress", mstress},
+    {"random-small", random_sizes<8, 512>},
+    {"random-mixed", random_sizes<8, 64 * 1024>},
+    {"realloc", realloc_growth},
+};
+
+//--------------------------------------------------------------------------
+// Driver
+//--------------------------------------------------------------------------
+static run_result measure(const allocator_ops& ops, const workload& load, const size_t threads, const double scale)
+{
+    std::vector<worker> workers;
+    workers.reserve(threads);
+    for (size_t t = 0; t < threads; ++t)
+        workers.emplace_back(ops, t + 1);
+
+    // warm up page tables, thread caches and lazy initialisation
+    load.run(workers, threads, scale / 10);
+    for (auto& w : workers)
+    {
+        w.latencies.clear();
+        w.calls = 0;
+    }
+
+    // RSS over the run, the second half counts as steady state
+    std::vector<size_t> rss;
+    rss.reserve(1 << 16);
+    std::atomic<bool> sampling{true};
+    std::thread sampler([&]
+    {
+        while (sampling.load(std::memory_order_relaxed))
+        {
+            if (rss.size() < rss.capacity())
+                rss.push_back(resident_bytes());
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+    });
+    const double seconds = load.run(workers, threads, scale);
+    sampling.store(false);
+    sampler.join();
+
+    run_result result{};
+    result.seconds = seconds;
+    std::vector<uint32_t> latencies;
+    for (auto& w : workers)
+    {
+        result.calls += w.calls;
+        latencies.insert(latencies.end(), w.latencies.begin(), w.latencies.end());
+    }
+    const auto percentile = [&latencies](const double q) -> uint32_t
+    {
+        if (latencies.empty())
+            return 0;
+        const auto at = latencies.begin() + static_cast<ptrdiff_t>(q * static_cast<double>(latencies.size() - 1));
+        std::nth_element(latencies.begin(), at, latencies.end());
+        return *at;
+    };
+    result.p50 = percentile(0.5);
+    result.p99 = percentile(0.99);
+    result.p999 = percentile(0.999);
+    result.peak_rss = peak_resident_bytes();
+    if (!rss.empty())
+    {
+        std::vector<size_t> steady(rss.begin() + static_cast<ptrdiff_t>(rss.size() / 2), rss.end());
+        std::nth_element(steady.begin(), steady.begin() + static_cast<ptrdiff_t>(steady.size() / 2), steady.end());
+        result.steady_rss = steady[steady.size() / 2];
+    }
+    return result;
+}
+
+// One child per run: a fresh heap for the RSS figures, and a crash in one
+// allocator does not take the rest of the table with it
+static bool measure_isolated(const allocator_ops& ops, const workload& load, const size_t threads,
+                             const double scale, run_result& result)
+{
+    return run_isolated([&] { return measure(ops, load, threads, scale); }, result);
+}
+
+int main(const int argc, char** argv)
+{
+    size_t max_threads = std::max<size_t>(1, std::thread::hardware_concurrency());
+    double scale = 1.0;
+    const char* only_workload = nullptr;
+    const char* only_allocator = nullptr;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const bool has_value = i + 1 < argc;
+        if (!std::strcmp(argv[i], "--threads") && has_value)
+            max_threads = std::max<size_t>(1, std::strtoul(argv[++i], nullptr, 10));
+        else if (!std::strcmp(argv[i], "--scale") && has_value)
+            scale = std::strtod(argv[++i], nullptr);
+        else if (!std::strcmp(argv[i], "--workload") && has_value)
+            only_workload = argv[++i];
+        else if (!std::strcmp(argv[i], "--allocator") && has_value)
+            only_allocator = argv[++i];
+        else if (!std::strcmp(argv[i], "--quick"))
+        {
+            scale = 0.02;
+            max_threads = std::min<size_t>(max_threads, 2);
+        }
+        else
+        {
+            std::fprintf(stderr, "usage: %s [--threads N] [--scale X] [--workload NAME] [--allocator NAME] [--quick]\n",
+                         argv[0]);
+            return 2;
+        }
+    }
+
+    // 1, 2, 4, ... and the maximum itself
+    std::vector<size_t> thread_counts;
+    for (size_t t = 1; t < max_threads; t *= 2)
+        thread_counts.push_back(t);
+    thread_counts.push_back(max_threads);
+
+    const std::vector<allocator_ops> allocators = available_allocators();
+    std::printf("allocators:");
+    for (const auto& ops : allocators)
+        std::printf(" %s", ops.name);
+    std::printf("\nscale %.3g, up to %zu threads, latency of every 8th call\n", scale, max_threads);
+
+    bool failed = false;
+    for (const auto& load : workloads)
+    {
+        if (only_workload && std::strcmp(only_workload, load.name) != 0)
+            continue;
+
+        std::printf("\n%s\n", load.name);
+        std::printf("%-10s %7s %10s %9s %9s %9s %10s %10s\n",
+                    "allocator", "threads", "Mops/s", "p50 ns", "p99 ns", "p999 ns", "peak MB", "steady MB");
+        std::printf("%s\n", std::string(80, '-').c_str());
+        for (const size_t threads : thread_counts)
+        {
+            for (const auto& ops : allocators)
+            {
+                if (only_allocator && std::strcmp(only_allocator, ops.name) != 0)
+                    continue;
+
+                run_result r{};
+                if (!measure_isolated(ops, load, threads, scale, r))
+                {
+                    std::printf("%-10s %7zu   failed\n", ops.name, threads);
+                    failed = true;
+                    continue;
+                }
+                std::printf("%-10s %7zu %10.2f %9u %9u %9u %10.1f %10.1f\n",
+                            ops.name, threads, static_cast<double>(r.calls) / r.seconds / 1e6,
+                            r.p50, r.p99, r.p999,
+                            static_cast<double>(r.peak_rss) / (1 << 20),
+                            static_cast<double>(r.steady_rss) / (1 << 20));
+                std::fflush(stdout);
+            }
+        }
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,367 @@
+// Runs a trace recorded by a JALLOC_TRACE build (see Jallocator::start_trace)
+// again against every allocator, each in a child process of its own.
+//
+//   jalloc_replay TRACE [--serial] [--allocator NAME]
+//
+// By default every recorded thread gets a replay thread that issues its
+// calls in order, waiting only where it frees or resizes a block another
+// thread has not handed out yet. --serial issues all calls on one thread
+// in timestamp order instead, which takes scheduling out of the numbers.
+//
+// Recorded addresses are only names for blocks: each allocation gets a
+// slot and later calls on the same address refer to that slot. Frees of
+// addresses the trace never saw allocated are dropped.
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "bench_common.hpp"
+
+enum trace_op : uint8_t
+{
+    ALLOCATE,
+    ALLOCATE_ALIGNED,
+    CALLOCATE,
+    REALLOCATE,
+    DEALLOCATE,
+    DEALLOCATE_SIZED,
+};
+
+// As written by the recorder, see Jallocator::trace_recorder
+struct trace_event
+{
+    uint64_t time;
+    uint64_t ptr;
+    uint64_t result;
+    uint64_t size;
+};
+
+struct trace_chunk_header
+{
+    uint32_t magic;
+    uint32_t count;
+    uint64_t thread;
+};
+
+static constexpr uint32_t NO_SLOT = UINT32_MAX;
+
+struct replay_op
+{
+    uint64_t time;
+    uint64_t size;
+    uint64_t alignment;
+    uint32_t thread;
+    uint32_t source; // slot freed or resized, NO_SLOT when none
+    uint32_t target; // slot the result goes to, NO_SLOT when none
+    trace_op op;
+};
+
+struct trace
+{
+    std::vector<replay_op> ops;  // timestamp order
+    std::vector<std::vector<uint32_t>> threads; // indices into ops per thread
+    uint32_t slots{0};
+    size_t events{0};
+    size_t dropped{0};
+    uint64_t ticks_per_ms{0};
+};
+
+static bool load_trace(const char* path, trace& out)
+{
+    FILE* file = std::fopen(path, "rb");
+    if (!file)
+        return false;
+
+    uint64_t header[2];
+    if (std::fread(header, sizeof(header), 1, file) != 1 || header[0] != TRACE_FILE_MAGIC)
+    {
+        std::fclose(file);
+        return false;
+    }
+    out.ticks_per_ms = header[1];
+
+    struct raw_event
+    {
+        trace_event event;
+        uint64_t thread;
+    };
+    std::vector<raw_event> raw;
+    std::vector<trace_event> chunk;
+    trace_chunk_header chunk_header{};
+    while (std::fread(&chunk_header, sizeof(chunk_header), 1, file) == 1)
+    {
+        if (chunk_header.magic != TRACE_CHUNK_MAGIC || chunk_header.count > TRACE_CHUNK_EVENTS)
+            break;
+        chunk.resize(chunk_header.count);
+        if (std::fread(chunk.data(), sizeof(trace_event), chunk.size(), file) != chunk.size())
+            break;
+        for (const trace_event& event : chunk)
+            raw.push_back({event, chunk_header.thread});
+    }
+    std::fclose(file);
+
+    // chunks of one thread are in order, so a stable sort keeps the order
+    // of calls whose timestamps tie
+    std::stable_sort(raw.begin(), raw.end(), [](const raw_event& a, const raw_event& b)
+    {
+        return a.event.time < b.event.time;
+    });
+    out.events = raw.size();
+
+    std::unordered_map<uint64_t, uint32_t> live;
+    std::unordered_map<uint64_t, uint32_t> thread_index;
+    live.reserve(raw.size() / 2 + 1);
+    const auto take = [&live](const uint64_t address)
+    {
+        const auto found = live.find(address);
+        if (found == live.end())
+            return NO_SLOT;
+        const uint32_t slot = found->second;
+        live.erase(found);
+        return slot;
+    };
+
+    for (const raw_event& entry : raw)
+    {
+        const trace_event& event = entry.event;
+        replay_op op{};
+        op.time = event.time;
+        op.op = static_cast<trace_op>(event.size >> 56);
+        op.size = event.size & ((1ULL << 56) - 1);
+        op.source = NO_SLOT;
+        op.target = NO_SLOT;
+
+        switch (op.op)
+        {
+            case ALLOCATE_ALIGNED:
+                op.alignment = event.ptr;
+                [[fallthrough]];
+            case ALLOCATE:
+            case CALLOCATE:
+                if (!event.result)
+                    continue;
+                break;
+            case REALLOCATE:
+                op.source = take(event.ptr);
+                if (!event.result)
+                {
+                    // a failed resize keeps the block, a resize to zero frees it
+                    if (op.size != 0 && op.source != NO_SLOT)
+                        live[event.ptr] = op.source;
+                    if (op.size != 0 || op.source == NO_SLOT)
+                        continue;
+                    op.op = DEALLOCATE;
+                }
+                else if (op.source == NO_SLOT)
+                {
+                    op.op = ALLOCATE;
+                }
+                break;
+            case DEALLOCATE:
+            case DEALLOCATE_SIZED:
+                op.source = take(event.ptr);
+                if (op.source == NO_SLOT)
+                {
+                    ++out.dropped;
+                    continue;
+                }
+                break;
+            default:
+                ++out.dropped;
+                continue;
+        }
+
+        if (event.result && op.op != DEALLOCATE)
+        {
+            // the address may still be live if the free raced its record,
+            // the older block then just stays allocated
+            op.target = out.slots++;
+            live[event.result] = op.target;
+        }
+
+        const auto [index, added] = thread_index.try_emplace(entry.thread, static_cast<uint32_t>(out.threads.size()));
+        if (added)
+            out.threads.emplace_back();
+        op.thread = index->second;
+        out.threads[op.thread].push_back(static_cast<uint32_t>(out.ops.size()));
+        out.ops.push_back(op);
+    }
+    return true;
+}
+
+struct replay_result
+{
+    double seconds;
+    size_t peak_rss;
+    size_t final_rss;
+};
+
+// Stands in for an allocation that failed on replay, so no thread waits on it
+static char failed_block;
+
+// Issues one call. `slots` holds the block of every allocation so far,
+// null until it is handed out.
+static void replay(const allocator_ops& ops, const replay_op& op, std::atomic<void*>* slots, const bool wait)
+{
+    void* source = nullptr;
+    if (op.source != NO_SLOT)
+    {
+        source = slots[op.source].load(std::memory_order_acquire);
+        while (wait && !source)
+        {
+            std::this_thread::yield();
+            source = slots[op.source].load(std::memory_order_acquire);
+        }
+        if (source == &failed_block)
+            source = nullptr;
+    }
+
+    void* result = nullptr;
+    switch (op.op)
+    {
+        case ALLOCATE:
+            result = ops.allocate(op.size);
+            break;
+        case ALLOCATE_ALIGNED:
+            result = ops.allocate_aligned(op.alignment, op.size);
+            break;
+        case CALLOCATE:
+            result = ops.callocate(1, op.size);
+            break;
+        case REALLOCATE:
+            result = ops.reallocate(source, op.size);
+            break;
+        case DEALLOCATE:
+        case DEALLOCATE_SIZED:
+            ops.deallocate(source);
+            break;
+    }
+    if (op.target != NO_SLOT)
+    {
+        // touch it, untouched memory costs nothing
+        if (result && op.op != REALLOCATE)
+            static_cast<char*>(result)[0] = 1;
+        slots[op.target].store(result ? result : &failed_block, std::memory_order_release);
+    }
+}
+
+static replay_result measure(const allocator_ops& ops, const trace& recorded, const bool serial)
+{
+    const size_t baseline = resident_bytes();
+    std::vector<std::atomic<void*>> slots(recorded.slots);
+    std::atomic<void*>* const slot = slots.data();
+
+    uint64_t start = 0, end = 0;
+    if (serial)
+    {
+        start = now_ns();
+        for (const replay_op& op : recorded.ops)
+            replay(ops, op, slot, false);
+        end = now_ns();
+    }
+    else
+    {
+        std::atomic<size_t> ready{0};
+        std::atomic<bool> go{false};
+        std::vector<std::thread> pool;
+        pool.reserve(recorded.threads.size());
+        for (const auto& calls : recorded.threads)
+        {
+            pool.emplace_back([&, calls = &calls]
+            {
+                ready.fetch_add(1);
+                while (!go.load(std::memory_order_acquire))
+                    std::this_thread::yield();
+                for (const uint32_t index : *calls)
+                    replay(ops, recorded.ops[index], slot, true);
+            });
+        }
+        while (ready.load() != pool.size())
+            std::this_thread::yield();
+
+        start = now_ns();
+        go.store(true, std::memory_order_release);
+        for (auto& thread : pool)
+            thread.join();
+        end = now_ns();
+    }
+
+    replay_result result{};
+    result.seconds = static_cast<double>(end - start) / 1e9;
+    result.final_rss = resident_bytes() - std::min(baseline, resident_bytes());
+    const size_t peak = peak_resident_bytes();
+    result.peak_rss = peak > baseline ? peak - baseline : 0;
+
+    // whatever the program never freed, outside the timing
+    std::vector<bool> freed(recorded.slots);
+    for (const replay_op& op : recorded.ops)
+        if (op.source != NO_SLOT)
+            freed[op.source] = true;
+    for (uint32_t s = 0; s < recorded.slots; ++s)
+        if (!freed[s] && slot[s].load(std::memory_order_relaxed) != &failed_block)
+            ops.deallocate(slot[s].load(std::memory_order_relaxed));
+    return result;
+}
+
+int main(const int argc, char** argv)
+{
+    const char* path = nullptr;
+    const char* only_allocator = nullptr;
+    bool serial = false;
+    bool usage = false;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const bool has_value = i + 1 < argc;
+        if (!std::strcmp(argv[i], "--serial"))
+            serial = true;
+        else if (!std::strcmp(argv[i], "--allocator") && has_value)
+            only_allocator = argv[++i];
+        else if (argv[i][0] != '-' && !path)
+            path = argv[i];
+        else
+            usage = true;
+    }
+    if (usage || !path)
+    {
+        std::fprintf(stderr, "usage: %s TRACE [--serial] [--allocator NAME]\n", argv[0]);
+        return 2;
+    }
+
+    trace recorded;
+    if (!load_trace(path, recorded))
+    {
+        std::fprintf(stderr, "%s: not a jalloc trace\n", path);
+        return 1;
+    }
+    const double recorded_ms = recorded.ops.empty() || !recorded.ticks_per_ms
+                                   ? 0.0
+                                   : static_cast<double>(recorded.ops.back().time - recorded.ops.front().time) /
+                                     static_cast<double>(recorded.ticks_per_ms);
+    std::printf("%s: %zu events, %zu replayed, %zu dropped, %zu threads, %.1f ms recorded\n",
+                path, recorded.events, recorded.ops.size(), recorded.dropped, recorded.threads.size(), recorded_ms);
+    std::printf("%-10s %10s %10s %10s %10s\n", "allocator", "ms", "Mops/s", "peak MB", "final MB");
+    std::printf("%s\n", std::string(54, '-').c_str());
+
+    bool failed = false;
+    for (const allocator_ops& ops : available_allocators())
+    {
+        if (only_allocator && std::strcmp(only_allocator, ops.name) != 0)
+            continue;
+        replay_result r{};
+        if (!run_isolated([&] { return measure(ops, recorded, serial); }, r))
+        {
+            std::printf("%-10s   failed\n", ops.name);
+            failed = true;
+            continue;
+        }
+        std::printf("%-10s %10.2f %10.2f %10.1f %10.1f\n",
+                    ops.name, r.seconds * 1e3, static_cast<double>(recorded.ops.size()) / r.seconds / 1e6,
+                    static_cast<double>(r.peak_rss) / (1 << 20), static_cast<double>(r.final_rss) / (1 << 20));
+        std::fflush(stdout);
+    }
+    return failed ? 1 : 0;
+}
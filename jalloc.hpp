@@ -21,11 +21,57 @@
 #pragma once
 
 #include <array>
+#include <cerrno>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstddef>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#if __has_include(<memory_resource>)
+    #include <memory_resource>
+#endif
 #include <mutex>
 #include <new>
+#include <thread>
+#include <utility>
+
+// Compiler-specific optimizations and attributes
+#if defined(__GNUC__) || defined(__clang__)
+    // GCC/Clang specific optimizations
+    #define LIKELY(x) __builtin_expect(!!(x), 1)
+    #define UNLIKELY(x) __builtin_expect(!!(x), 0)
+    #define ALWAYS_INLINE [[gnu::always_inline]] inline
+    #define ALIGN_TO(x) __attribute__((aligned(x)))
+
+    #if defined(__clang__)
+        // Clang-specific optimizations
+        #define HAVE_BUILTIN_ASSUME(x) __builtin_assume(x)
+        #define HAVE_BUILTIN_ASSUME_ALIGNED(x, a) __builtin_assume_aligned(x, a)
+        #define NO_SANITIZE_ADDRESS __attribute__((no_sanitize("address")))
+        #define VECTORIZE_LOOP _Pragma("clang loop vectorize(enable) interleave(enable)")
+#define UNROLL_LOOP _Pragma("clang loop unroll(full)")
+#else
+        // GCC-specific fallbacks
+        #define HAVE_BUILTIN_ASSUME(x) ((void)0)
+        #define HAVE_BUILTIN_ASSUME_ALIGNED(x, a) (x)
+        #define NO_SANITIZE_ADDRESS
+        #define VECTORIZE_LOOP _Pragma("GCC ivdep")
+        #define UNROLL_LOOP _Pragma("GCC unroll 8")
+#endif
+#else
+    // Generic fallbacks for other compilers
+    #define LIKELY(x) (x)
+    #define UNLIKELY(x) (x)
+    #define ALWAYS_INLINE inline
+    #define ALIGN_TO(x)
+    #define HAVE_BUILTIN_ASSUME(x) ((void)0)
+    #define HAVE_BUILTIN_ASSUME_ALIGNED(x, a) (x)
+    #define NO_SANITIZE_ADDRESS
+    #define VECTORIZE_LOOP
+    #define CUSTOM_PREFETCH(addr) ((void)0)
+#endif
 
 #if defined(__x86_64__)
     #include <immintrin.h>
@@ -33,12 +79,6 @@
     #include <xmmintrin.h>
     #include <smmintrin.h>
     #include <tmmintrin.h>
-    #ifdef __AVX2__
-        #include <avx2intrin.h>
-    #endif
-    #ifdef __AVX512F__
-        #include <avx512fintrin.h>
-    #endif
 
     #ifdef _MSC_VER
         #include <intrin.h>
@@ -54,16 +94,38 @@
         ALWAYS_INLINE static bool cpu_has_avx2()
         {
             unsigned int eax, ebx, ecx, edx;
-            __get_cpuid(7, &eax, &ebx, &ecx, &edx);
+            if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+                return false;
             return (ebx & bit_AVX2) != 0;
         }
 
         ALWAYS_INLINE static bool cpu_has_avx512f()
         {
             unsigned int eax, ebx, ecx, edx;
-            __get_cpuid(7, &eax, &ebx, &ecx, &edx);
+            if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+                return false;
             return (ebx & bit_AVX512F) != 0;
         }
+
+        // Enhanced rep movsb/stosb
+        ALWAYS_INLINE static bool cpu_has_erms()
+        {
+            unsigned int eax, ebx, ecx, edx;
+            if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+                return false;
+            return (ebx & (1u << 9)) != 0;
+        }
+
+        // XCR0, which register states the OS saves on a context switch
+        ALWAYS_INLINE static uint64_t os_saved_state()
+        {
+            unsigned int eax, ebx, ecx, edx;
+            if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_OSXSAVE))
+                return 0;
+            unsigned int lo, hi;
+            __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+            return static_cast<uint64_t>(hi) << 32 | lo;
+        }
     #elif defined(_MSC_VER)
         ALWAYS_INLINE static bool cpu_has_avx2()
         {
@@ -78,6 +140,20 @@
             __cpuid(cpuInfo, 7);
             return (cpuInfo[1] & (1 << 16)) != 0;
         }
+
+        ALWAYS_INLINE static bool cpu_has_erms()
+        {
+            int cpuInfo[4];
+            __cpuid(cpuInfo, 7);
+            return (cpuInfo[1] & (1 << 9)) != 0;
+        }
+
+        ALWAYS_INLINE static uint64_t os_saved_state()
+        {
+            int cpuInfo[4];
+            __cpuid(cpuInfo, 1);
+            return (cpuInfo[2] & (1 << 27)) ? _xgetbv(0) : 0;
+        }
     #endif
 
     //--------------------------------------------------------------------------
@@ -108,7 +184,7 @@
     #endif
 
     // Common operations available across all x86_64 platforms
-    #define STREAM_STORE_64(addr, val) _mm_stream_si64((__int64*)(addr), val)
+    #define STREAM_STORE_64(addr, val) _mm_stream_si64((long long*)(addr), val)
     #define CPU_PAUSE() _mm_pause()
     #define MEMORY_FENCE() _mm_sfence()
     #define CUSTOM_PREFETCH(addr) _mm_prefetch(reinterpret_cast<const char*>(addr), _MM_HINT_T0)
@@ -169,42 +245,6 @@
     #define PREFETCH_READ(addr) ((void)0)
 #endif
 
-// Compiler-specific optimizations and attributes
-#if defined(__GNUC__) || defined(__clang__)
-    // GCC/Clang specific optimizations
-    #define LIKELY(x) __builtin_expect(!!(x), 1)
-    #define UNLIKELY(x) __builtin_expect(!!(x), 0)
-    #define ALWAYS_INLINE [[gnu::always_inline]] inline
-    #define ALIGN_TO(x) __attribute__((aligned(x)))
-
-    #if defined(__clang__)
-        // Clang-specific optimizations
-        #define HAVE_BUILTIN_ASSUME(x) __builtin_assume(x)
-        #define HAVE_BUILTIN_ASSUME_ALIGNED(x, a) __builtin_assume_aligned(x, a)
-        #define NO_SANITIZE_ADDRESS __attribute__((no_sanitize("address")))
-        #define VECTORIZE_LOOP _Pragma("clang loop vectorize(enable) interleave(enable)")
-#define UNROLL_LOOP _Pragma("clang loop unroll(full)")
-#else
-        // GCC-specific fallbacks
-        #define HAVE_BUILTIN_ASSUME(x) ((void)0)
-        #define HAVE_BUILTIN_ASSUME_ALIGNED(x, a) (x)
-        #define NO_SANITIZE_ADDRESS
-        #define VECTORIZE_LOOP _Pragma("GCC ivdep")
-        #define UNROLL_LOOP _Pragma("GCC unroll 8")
-#endif
-#else
-    // Generic fallbacks for other compilers
-    #define LIKELY(x) (x)
-    #define UNLIKELY(x) (x)
-    #define ALWAYS_INLINE inline
-    #define ALIGN_TO(x)
-    #define HAVE_BUILTIN_ASSUME(x) ((void)0)
-    #define HAVE_BUILTIN_ASSUME_ALIGNED(x, a) (x)
-    #define NO_SANITIZE_ADDRESS
-    #define VECTORIZE_LOOP
-    #define CUSTOM_PREFETCH(addr) ((void)0)
-#endif
-
 // Platform-specific memory management operations
 #ifdef _WIN32
     #include <malloc.h>
@@ -220,6 +260,7 @@
     #define ALIGNED_FREE(ptr) _aligned_free(ptr)
 #elif defined(__APPLE__)
     #include <mach/mach.h>
+    #include <pthread.h>
 #include <sys/mman.h>
 
 #define MAP_MEMORY(size) \
@@ -230,9 +271,14 @@
 
 #else
     // POSIX-compliant systems (Linux, BSD, etc.)
+    #include <fcntl.h>
+    #include <pthread.h>
     #include <sched.h>
     #include <unistd.h>
     #include <sys/mman.h>
+    #ifdef __linux__
+        #include <sys/syscall.h>
+    #endif
     #include <thread>
 
     #define MAP_MEMORY(size) \
@@ -247,32 +293,100 @@
 // Hardware constants
 static constexpr size_t CACHE_LINE_SIZE = 64; //Changable to 32 | 64
 static constexpr size_t PG_SIZE = 4096;
+static constexpr size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
 
 // Block header
 static constexpr size_t TINY_LARGE_THRESHOLD = 64;
 static constexpr size_t SMALL_LARGE_THRESHOLD = 256;
+static constexpr size_t MEDIUM_LARGE_THRESHOLD = 2048;
 static constexpr size_t ALIGNMENT = CACHE_LINE_SIZE;
 static constexpr size_t LARGE_THRESHOLD = 1024 * 1024;
 static constexpr size_t MAX_CACHED_BLOCKS = 32;
 static constexpr size_t MAX_CACHE_SIZE = 64 * 1024 * 1024;
 static constexpr size_t MIN_CACHE_BLOCK = 4 * 1024;
 static constexpr size_t MAX_CACHE_BLOCK = 16 * 1024 * 1024;
-static constexpr auto MAX_SIZE_RATIO = 1.25;
-
-static constexpr size_t CACHE_SIZE = 32;
-static constexpr size_t SIZE_CLASSES = 32;
-static constexpr size_t TINY_CLASSES = 8;
-static constexpr size_t MAX_POOLS = 8;
+static constexpr size_t LARGE_CACHE_DEPTH = 8;
+// Idle time before a cached mapping is returned, in get_timestamp() ticks
+static constexpr uint64_t LARGE_CACHE_DECAY_TICKS = 4'000'000'000ULL;
+
+// Thread cache: slots per class, of which only `limit` are used at a time
+static constexpr size_t CACHE_SIZE = 128;
+static constexpr size_t CACHE_BATCH = 32;
+static constexpr size_t CACHE_MAX_OVERFLOWS = 3;
+static constexpr size_t THREAD_CACHE_BUDGET = 512 * 1024;
+static constexpr size_t TINY_CLASSES = TINY_LARGE_THRESHOLD / 8;
+static constexpr size_t SMALL_CLASSES = SMALL_LARGE_THRESHOLD / 8;
+static constexpr size_t MEDIUM_CLASSES = 9; // 320 .. 2K, see medium_sizes
+static constexpr size_t SIZE_CLASSES = SMALL_CLASSES + MEDIUM_CLASSES;
+
+// Segments are reserved from the OS in one piece and carved into spans
+static constexpr size_t SEGMENT_SIZE = 4 * 1024 * 1024;
+static constexpr size_t SEGMENT_PAGES = SEGMENT_SIZE / PG_SIZE;
+static_assert(SEGMENT_SIZE % HUGE_PAGE_SIZE == 0);
+
+// Heaps of exited threads: segments kept for adoption while fewer than this
+// many wait (ones with live blocks are always kept), and cached mappings
+static constexpr size_t ORPHAN_SEGMENT_LIMIT = 8;
+static constexpr size_t ORPHAN_LARGE_BLOCKS = 32;
+
+// Nodes with their own transfer cache and orphan list. Segments of higher
+// ids are still bound to their node but share these, as node % 4.
+static constexpr size_t NUMA_MAX_NODES = 4;
+// Span allocations between two checks of which node the thread runs on
+static constexpr size_t NUMA_RECHECK_INTERVAL = 64;
+
+// Mid-size blocks are whole page spans from the segments, only bigger
+// ones are mapped on their own
+static constexpr size_t MID_LARGE_THRESHOLD = 256 * 1024;
+static constexpr size_t MID_MAX_PAGES = (MID_LARGE_THRESHOLD + 64 + PG_SIZE - 1) / PG_SIZE;
+static constexpr size_t SPAN_CACHE_DEPTH = 4;
+
+// Arena chunks start at this many bytes, pages included, and double up to
+// the largest span. Requests above a quarter of that get a block of their own.
+static constexpr size_t ARENA_MIN_CHUNK = 16 * 1024;
+static constexpr size_t ARENA_MAX_CHUNK = MID_LARGE_THRESHOLD;
+
+// Heap profiler: mean bytes between two samples, and the table sizes
+static constexpr size_t PROFILE_SAMPLE_RATE = 512 * 1024;
+static constexpr size_t PROFILE_MAX_DEPTH = 32;
+static constexpr size_t PROFILE_SAMPLE_SLOTS = 1 << 15;
+static constexpr size_t PROFILE_STACK_SLOTS = 1 << 12;
+// Bytes between two looks at the rate while sampling is off
+static constexpr int64_t PROFILE_IDLE_INTERVAL = 16 * 1024 * 1024;
+
+// Allocation trace: events in the 32 KB chunk a thread fills before the
+// writer gets it, and how often the writer looks for full chunks
+static constexpr size_t TRACE_CHUNK_EVENTS = 1023;
+static constexpr uint32_t TRACE_CHUNK_MAGIC = 0x4B484354; // "TCHK"
+static constexpr uint64_t TRACE_FILE_MAGIC = 0x3130435254414A4AULL; // "JJATRC01"
+static constexpr std::chrono::milliseconds TRACE_FLUSH_INTERVAL{50};
+// block_header size class of a span block, 255 is a mapped block
+static constexpr uint8_t SPAN_CLASS = 254;
+// Offset header in front of an over-aligned block, prev_physical points
+// at the header of the span or mapping the block was cut from
+static constexpr uint8_t ALIGNED_CLASS = 253;
+
+// Pool page layout: page_owner + bitmap, then slots
+static constexpr size_t POOL_HEADER_SIZE = 2 * CACHE_LINE_SIZE;
+static constexpr size_t POOL_CAPACITY = PG_SIZE - POOL_HEADER_SIZE;
+static constexpr size_t BLOCK_HEADER_SIZE = CACHE_LINE_SIZE;
 
 // Safety flags
 static constexpr uint64_t SIZE_MASK = 0x0000FFFFFFFFFFFF;
 static constexpr uint64_t CLASS_MASK = 0x00FF000000000000;
 static constexpr uint64_t MMAP_FLAG = 1ULL << 62;
 static constexpr uint64_t COALESCED_FLAG = 1ULL << 61;
+// Block was picked by the heap profiler, only ever on spans and mappings
+static constexpr uint64_t SAMPLED_FLAG = 1ULL << 60;
 static constexpr uint64_t HEADER_MAGIC = 0xDEADBEEF12345678;
-static constexpr uint64_t MAGIC_MASK = 0xF000000000000000;
-static constexpr uint64_t MAGIC_VALUE = 0xA000000000000000;
+// Bits [59-56] are the only ones not taken by the flags or the size class
+static constexpr uint64_t MAGIC_MASK = 0x0F00000000000000;
+static constexpr uint64_t MAGIC_VALUE = 0x0A00000000000000;
 static constexpr uint64_t THREAD_OWNER_MASK = 0xFFFF000000000000;
+static constexpr size_t THREAD_OWNER_SHIFT = 48;
+// First word of every pool page. Bits [59-56] are not MAGIC_VALUE so it
+// can never be mistaken for the block_header of a mapped block.
+static constexpr uint64_t POOL_SIGNATURE = 0x504F4F4C4A414C4C;
 
 struct size_class
 {
@@ -291,48 +405,150 @@ static constexpr size_t get_alignment_for_size(const size_t size) noexcept
                      : 1ULL << (64 - __builtin_clzll(size - 1));
 }
 
-constexpr std::array<size_class, 32> size_classes = []
+// Medium blocks keep a block_header in front and share a pool page, so
+// what a class costs is the page divided by its block count. Each size is
+// the largest that still fits 10, 8, 7, 6, 5, 4, 3, 2 or 1 blocks: any
+// class in between would hold as few blocks as the next one up and save
+// nothing. That is about three classes per doubling.
+//
+// There are no classes between 2048 and 4096: past MEDIUM_LARGE_THRESHOLD
+// a block takes a page span with its header in front, one page up to
+// 4032 bytes and two from 4033. Classes there would need pool runs longer
+// than a page, and pool_page_of() finds the pool from the block address
+// by masking it to its page.
+static constexpr uint16_t medium_sizes[MEDIUM_CLASSES] = {320, 384, 448, 576, 704, 896, 1216, 1920, 2048};
+
+// Classes [0, SMALL_CLASSES) step by 8 bytes and are headerless: the slot
+// is exactly the block, and size class and owner come from the pool page.
+// Slots start on a 64-byte boundary and follow each other, so a block is
+// only as aligned as its size: the odd multiples of 8 (24, 40, ... 248)
+// land on 8 bytes, the rest on at least 16. Medium blocks sit behind a
+// 64-byte header in 64-byte slots and are all 64-byte aligned.
+constexpr std::array<size_class, SIZE_CLASSES> size_classes = []
 {
-    std::array<size_class, 32> classes{};
-    for (size_t i = 0; i < 32; ++i)
+    std::array<size_class, SIZE_CLASSES> classes{};
+    for (size_t i = 0; i < SIZE_CLASSES; ++i)
     {
-        const size_t size = 1ULL << (i + 3);
-        const size_t alignment = get_alignment_for_size(size); // Use new function
-        const size_t slot = (size + alignment - 1) & ~(alignment - 1);
+        const size_t size = i < SMALL_CLASSES
+                                ? (i + 1) << 3
+                                : medium_sizes[i - SMALL_CLASSES];
+        const size_t slot = i < SMALL_CLASSES
+                                ? size
+                                : (size + BLOCK_HEADER_SIZE + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1);
         classes[i] = {
             static_cast<uint16_t>(size),
             static_cast<uint16_t>(slot),
-            static_cast<uint16_t>(PG_SIZE / slot),
+            static_cast<uint16_t>(POOL_CAPACITY / slot),
             static_cast<uint16_t>(slot - size)
         };
     }
     return classes;
 }();
 
-struct thread_cache_t
+static_assert(size_classes[SIZE_CLASSES - 1].size == MEDIUM_LARGE_THRESHOLD);
+static_assert(size_classes[SIZE_CLASSES - 1].blocks > 0);
+static_assert(size_classes[0].blocks <= PG_SIZE / 8, "bitmap holds 512 slots");
+static_assert(POOL_HEADER_SIZE % CACHE_LINE_SIZE == 0, "headerless slots start on a cache line");
+static_assert([]
 {
-    struct cached_block
+    for (size_t i = SMALL_CLASSES; i + 1 < SIZE_CLASSES; ++i)
+        if (size_classes[i].size % CACHE_LINE_SIZE || size_classes[i].blocks <= size_classes[i + 1].blocks)
+            return false;
+    return true;
+}(), "every medium class is a multiple of 64 and holds more blocks than the next");
+
+// Medium class by 64-byte step of the size, the medium sizes are all
+// multiples of 64 so the step decides the class exactly
+constexpr std::array<uint8_t, MEDIUM_LARGE_THRESHOLD / 64> medium_class_table = []
+{
+    std::array<uint8_t, MEDIUM_LARGE_THRESHOLD / 64> table{};
+    size_t size_class = SMALL_CLASSES;
+    for (size_t step = 0; step < table.size(); ++step)
     {
-        void* ptr;
-        uint8_t size_class;
-    };
+        while (size_classes[size_class].size < (step + 1) * 64)
+            ++size_class;
+        table[step] = static_cast<uint8_t>(size_class);
+    }
+    return table;
+}();
+
+// Blocks moved between a pool and the thread cache at once. Big classes
+// only fit a handful per page, so they move fewer.
+static constexpr size_t batch_for(const uint8_t size_class) noexcept
+{
+    const size_t half = size_classes[size_class].blocks / 2;
+    return half == 0 ? 1 : half < CACHE_BATCH ? half : CACHE_BATCH;
+}
+
+ALWAYS_INLINE
+static constexpr uint8_t medium_class_for(const size_t size) noexcept
+{
+    // SMALL_LARGE_THRESHOLD < size <= MEDIUM_LARGE_THRESHOLD
+    return medium_class_table[(size - 1) >> 6];
+}
+
+// Knobs the caches read at runtime. The constants above are the defaults
+// and the upper bounds; JALLOC_* environment variables and
+// Jallocator::control() change them. Every field is read with a single
+// relaxed load, and the defaults are in place before any constructor runs.
+struct tuning
+{
+    std::atomic<size_t> thread_cache_depth{CACHE_SIZE};
+    std::atomic<size_t> thread_cache_budget{THREAD_CACHE_BUDGET};
+    std::atomic<size_t> span_cache_depth{SPAN_CACHE_DEPTH};
+    std::atomic<size_t> large_cache_depth{LARGE_CACHE_DEPTH};
+    std::atomic<size_t> large_cache_bytes{MAX_CACHE_SIZE};
+    std::atomic<uint64_t> large_cache_decay_ticks{LARGE_CACHE_DECAY_TICKS};
+
+    // one instance for the whole program, whichever unit asks
+    ALWAYS_INLINE
+    static tuning& get() noexcept
+    {
+        alignas(CACHE_LINE_SIZE) static tuning values;
+        return values;
+    }
+
+    ALWAYS_INLINE
+    static size_t read(const std::atomic<size_t>& field) noexcept
+    {
+        return field.load(std::memory_order_relaxed);
+    }
+};
 
+// Each class starts with a limit of one block and grows while it keeps
+// missing (slow start). Repeated overflows shrink it again, so only hot
+// classes keep deep caches. The whole cache is held to the byte budget in
+// tuning, and no class grows past its depth.
+struct thread_cache_t
+{
     struct size_class_cache
     {
-        cached_block blocks[CACHE_SIZE];
-        size_t count;
+        void* blocks[CACHE_SIZE];
+        uint16_t count;
+        uint16_t limit;
+        uint16_t overflows;
     };
 
     alignas(CACHE_LINE_SIZE) size_class_cache caches[SIZE_CLASSES]{};
+    size_t bytes{0};
+
+    thread_cache_t() noexcept
+    {
+        for (auto& cache : caches)
+            cache.limit = 1;
+    }
 
     ALWAYS_INLINE
     void *get(const uint8_t size_class) noexcept
     {
-        auto &[blocks, count] = caches[size_class];
-        if (LIKELY(count > 0))
+        auto &cache = caches[size_class];
+        if (LIKELY(cache.count > 0))
         {
-            PREFETCH_READ(&blocks[count - 2]);
-            return blocks[--count].ptr;
+            // the last block has no next one to warm up
+            if (cache.count > 1)
+                PREFETCH_READ(&cache.blocks[cache.count - 2]);
+            bytes -= size_classes[size_class].size;
+            return cache.blocks[--cache.count];
         }
         return nullptr;
     }
@@ -341,21 +557,98 @@ struct thread_cache_t
     bool put(void *ptr, const uint8_t size_class) noexcept
     {
         auto &cache = caches[size_class];
-        if (LIKELY(cache.count < CACHE_SIZE))
+        const size_t size = size_classes[size_class].size;
+        if (LIKELY(cache.count < cache.limit && bytes + size <= tuning::read(tuning::get().thread_cache_budget)))
         {
-            cache.blocks[cache.count].ptr = ptr;
-            cache.blocks[cache.count].size_class = size_class;
-            ++cache.count;
+            cache.blocks[cache.count++] = ptr;
+            bytes += size;
             return true;
         }
         return false;
     }
 
+    // How many blocks a refill may hand to this class right now
+    ALWAYS_INLINE
+    size_t room(const uint8_t size_class) const noexcept
+    {
+        const auto &cache = caches[size_class];
+        const size_t size = size_classes[size_class].size;
+        const size_t budget = tuning::read(tuning::get().thread_cache_budget);
+        const size_t by_budget = bytes < budget ? (budget - bytes) / size : 0;
+        // a depth lowered at runtime leaves the limits already grown above it
+        const size_t by_limit = cache.limit > cache.count ? cache.limit - cache.count : 0;
+        return by_limit < by_budget ? by_limit : by_budget;
+    }
+
+    // The class ran dry: let it hold more next time
+    ALWAYS_INLINE
+    void on_miss(const uint8_t size_class, const size_t batch) noexcept
+    {
+        auto &cache = caches[size_class];
+        const size_t grown = cache.limit < batch ? cache.limit + 1 : cache.limit + batch;
+        const size_t depth = tuning::read(tuning::get().thread_cache_depth);
+        cache.limit = static_cast<uint16_t>(grown < depth ? grown : depth);
+    }
+
+    // The class hit its limit: grow while still ramping up, shrink after
+    // it keeps overflowing
+    ALWAYS_INLINE
+    void on_overflow(const uint8_t size_class, const size_t batch) noexcept
+    {
+        auto &cache = caches[size_class];
+        if (cache.limit < batch)
+        {
+            if (cache.limit < tuning::read(tuning::get().thread_cache_depth))
+                ++cache.limit;
+            return;
+        }
+        if (++cache.overflows > CACHE_MAX_OVERFLOWS)
+        {
+            cache.overflows = 0;
+            cache.limit = static_cast<uint16_t>(cache.limit > batch ? cache.limit - batch : 1);
+        }
+    }
+
+    ALWAYS_INLINE
+    bool over_budget(const uint8_t size_class) const noexcept
+    {
+        return bytes + size_classes[size_class].size > tuning::read(tuning::get().thread_cache_budget);
+    }
+
+    // Pushes a batch pulled from a pool, returns how many fit
+    ALWAYS_INLINE
+    size_t fill(const uint8_t size_class, void* const* ptrs, const size_t n) noexcept
+    {
+        auto &cache = caches[size_class];
+        const size_t free_slots = CACHE_SIZE - cache.count;
+        const size_t take = n < free_slots ? n : free_slots;
+        for (size_t i = 0; i < take; ++i)
+            cache.blocks[cache.count++] = ptrs[i];
+        bytes += take * size_classes[size_class].size;
+        return take;
+    }
+
+    // Pops up to `n` blocks, oldest first, so the hot ones stay cached
+    ALWAYS_INLINE
+    size_t drain(const uint8_t size_class, void** out, const size_t n) noexcept
+    {
+        auto &cache = caches[size_class];
+        const size_t take = n < cache.count ? n : cache.count;
+        for (size_t i = 0; i < take; ++i)
+            out[i] = cache.blocks[i];
+        for (size_t i = take; i < cache.count; ++i)
+            cache.blocks[i - take] = cache.blocks[i];
+        cache.count = static_cast<uint16_t>(cache.count - take);
+        bytes -= take * size_classes[size_class].size;
+        return take;
+    }
+
     ALWAYS_INLINE
     void clear() noexcept
     {
-        for (auto&[blocks, count] : caches)
-            count = 0;
+        for (auto& cache : caches)
+            cache.count = 0;
+        bytes = 0;
     }
 };
 
@@ -383,7 +676,7 @@ static void stream_store(void* dst, const T& value) noexcept
 }
 
 #if defined(__x86_64__)
-    static ALWAYS_INLINE size_t count_trailing_zeros(uint64_t x)
+    ALWAYS_INLINE static size_t count_trailing_zeros(uint64_t x)
     {
         #ifdef _MSC_VER
             return _tzcnt_u64(x);
@@ -392,12 +685,12 @@ static void stream_store(void* dst, const T& value) noexcept
         #endif
     }
 
-    static ALWAYS_INLINE void memory_fence()
+    ALWAYS_INLINE static void memory_fence()
     {
     _mm_mfence();
     }
 
-    static ALWAYS_INLINE void prefetch(const void* addr)
+    ALWAYS_INLINE static void prefetch(const void* addr)
     {
     _mm_prefetch(static_cast<const char*>(addr), _MM_HINT_T0);
     }
@@ -418,149 +711,445 @@ static void stream_store(void* dst, const T& value) noexcept
         prefetch_for_read(addr);
     }
 #else
-    static ALWAYS_INLINE size_t count_trailing_zeros(uint64_t x)
+    ALWAYS_INLINE static size_t count_trailing_zeros(uint64_t x)
     {
         return __builtin_ctzll(x);
     }
 
-    static ALWAYS_INLINE void memory_fence()
+    ALWAYS_INLINE static void memory_fence()
     {
         std::atomic_thread_fence(std::memory_order_seq_cst);
     }
 
-    static ALWAYS_INLINE void prefetch(const void*) {}
+    ALWAYS_INLINE static void prefetch(const void*) {}
 #endif
 
+//--------------------------------------------------------------------------
+// Copy engine used by reallocate. Short copies are left to memcpy, copies
+// from 8 KB use rep movsb where the CPU has fast strings, and copies too
+// big for the last level cache stream around it so that moving a block does
+// not evict the working set. The vector width is picked at runtime, see
+// simd_kernels below.
+//--------------------------------------------------------------------------
+static constexpr size_t COPY_REP_MOVSB_THRESHOLD = 8192;
+static constexpr size_t COPY_STREAM_MIN_THRESHOLD = 1024 * 1024;
+static constexpr size_t COPY_STREAM_MAX_THRESHOLD = 8 * 1024 * 1024;
+
+// Three quarters of one core's share of the LLC, copies past it would
+// only push out other data
 ALWAYS_INLINE
-static bool is_base_aligned(const void *ptr) noexcept
+static size_t stream_copy_threshold() noexcept
 {
-    return (reinterpret_cast<uintptr_t>(ptr) & (ALIGNMENT - 1)) == 0;
+    static const size_t threshold = []
+    {
+        size_t share = COPY_STREAM_MAX_THRESHOLD;
+        #if defined(_SC_LEVEL3_CACHE_SIZE) && defined(_SC_NPROCESSORS_ONLN)
+            const long llc = sysconf(_SC_LEVEL3_CACHE_SIZE);
+            const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+            if (llc > 0 && cpus > 0)
+                share = static_cast<size_t>(llc) / static_cast<size_t>(cpus) / 4 * 3;
+        #endif
+        return share < COPY_STREAM_MIN_THRESHOLD ? COPY_STREAM_MIN_THRESHOLD
+             : share > COPY_STREAM_MAX_THRESHOLD ? COPY_STREAM_MAX_THRESHOLD
+             : share;
+    }();
+    return threshold;
 }
 
-class Jallocator
+//--------------------------------------------------------------------------
+// SIMD kernels. Every variant is compiled into the binary with a target
+// attribute and the table is resolved once against the running CPU, so a
+// baseline x86-64 build still uses AVX-512 where it is there.
+//--------------------------------------------------------------------------
+struct simd_kernels
 {
-    struct bitmap
+    // Non-temporal copy and zeroing: `dst` is 64-byte aligned, `size` a
+    // multiple of 64, and the caller fences
+    void (*stream_copy)(char* dst, const char* src, size_t size) noexcept;
+    void (*stream_zero)(char* dst, size_t size) noexcept;
+};
+
+#if defined(__x86_64__)
+    struct cpu_features
     {
-        static constexpr size_t bits_per_word = 64;
-        static constexpr size_t words_per_bitmap = PG_SIZE / (CACHE_LINE_SIZE * 8);
+        bool avx2;
+        bool avx512f;
+        bool erms;
+    };
+
+    // The CPUID bits only count if the OS also saves the wider registers
+    ALWAYS_INLINE
+    static const cpu_features& cpu() noexcept
+    {
+        static const cpu_features features = []
+        {
+            const uint64_t state = os_saved_state();
+            return cpu_features{
+                (state & 0x6) == 0x6 && cpu_has_avx2(),
+                (state & 0xE6) == 0xE6 && cpu_has_avx512f(),
+                cpu_has_erms()
+            };
+        }();
+        return features;
+    }
+
+    #if defined(__GNUC__) || defined(__clang__)
+        #define TARGET_AVX2 __attribute__((target("avx2")))
+        #define TARGET_AVX512F __attribute__((target("avx512f")))
+    #else
+        #define TARGET_AVX2
+        #define TARGET_AVX512F
+    #endif
 
-        alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> words[words_per_bitmap];
+    TARGET_AVX512F
+    static void stream_copy_avx512(char* dst, const char* src, const size_t size) noexcept
+    {
+        for (size_t i = 0; i < size; i += 64)
+            _mm512_stream_si512(reinterpret_cast<__m512i*>(dst + i),
+                                _mm512_loadu_si512(reinterpret_cast<const void*>(src + i)));
+    }
 
-        bitmap() noexcept
+    TARGET_AVX2
+    static void stream_copy_avx2(char* dst, const char* src, const size_t size) noexcept
+    {
+        for (size_t i = 0; i < size; i += 64)
         {
-            for (auto& word : words)
-                word = ~0ULL;
+            const __m256i lo = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+            const __m256i hi = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i + 32));
+            _mm256_stream_si256(reinterpret_cast<__m256i*>(dst + i), lo);
+            _mm256_stream_si256(reinterpret_cast<__m256i*>(dst + i + 32), hi);
         }
+    }
 
-        ALWAYS_INLINE
-        size_t find_free_block(const size_t size) noexcept
+    static void stream_copy_sse2(char* dst, const char* src, const size_t size) noexcept
+    {
+        for (size_t i = 0; i < size; i += 64)
         {
-            const size_t alignment = get_alignment_for_size(size);
-            const size_t align_mask = (alignment / bits_per_word) - 1;
-            #if defined(__AVX512F__)
-                for (size_t i = 0; i < words_per_bitmap; i += 8)
-                {
-                    if ((i & align_mask) != 0)
-                        continue;
+            for (size_t j = 0; j < 64; j += 16)
+                _mm_stream_si128(reinterpret_cast<__m128i*>(dst + i + j),
+                                 _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i + j)));
+        }
+    }
 
-                    __m512i v = _mm512_loadu_si512((__m512i*)(words + i));
-                    __mmask8 mask = _mm512_movepi64_mask(v);
-                    if (mask)
-                    {
-                        const int lane = __builtin_ctz(mask);
-                        const uint64_t word = words[i + lane].load(std::memory_order_relaxed);
-                        const size_t bit = count_trailing_zeros(word);
-                        const size_t block_offset = (i + lane) * 64 + bit;
-                        if (block_offset * CACHE_LINE_SIZE % alignment == 0)
-                            return block_offset;
-                    }
-                }
-            #elif defined(__AVX2__)
-                for (size_t i = 0; i < words_per_bitmap; i += 4)
-                {
-                    __m256i v = _mm256_loadu_si256((__m256i*)(words + i));
-                    __m256i zero = _mm256_setzero_si256();
-                    __m256i cmp = _mm256_cmpeq_epi64(v, zero);
-                    uint32_t mask = ~_mm256_movemask_epi8(cmp);
-                    if (mask != 0)
-                        return i * 64 + __builtin_ctzll(mask);
-                }
-            #elif defined(__aarch64__)
-                for (size_t i = 0; i < words_per_bitmap; i += 2)
-                {
-                    uint64x2_t v = vld1q_u64(reinterpret_cast<const uint64_t *>(words + i));
-                    uint64x2_t zero = vdupq_n_u64(0);
-                    if (vgetq_lane_u64(vceqq_u64(v, zero), 0) != -1ULL)
-                        return i * 64 + __builtin_ctzll(words[i].load(std::memory_order_relaxed));
-                    if (vgetq_lane_u64(vceqq_u64(v, zero), 1) != -1ULL)
-                        return (i + 1) * 64 + __builtin_ctzll(words[i+1].load(std::memory_order_relaxed));
-                }
-            #endif
+    TARGET_AVX512F
+    static void stream_zero_avx512(char* dst, const size_t size) noexcept
+    {
+        const __m512i zero = _mm512_setzero_si512();
+        for (size_t i = 0; i < size; i += 64)
+            _mm512_stream_si512(reinterpret_cast<__m512i*>(dst + i), zero);
+    }
 
-            VECTORIZE_LOOP
-            for (size_t i = 0; i < words_per_bitmap; ++i)
-            {
-                if ((i & align_mask) != 0)
-                    continue;
+    TARGET_AVX2
+    static void stream_zero_avx2(char* dst, const size_t size) noexcept
+    {
+        const __m256i zero = _mm256_setzero_si256();
+        for (size_t i = 0; i < size; i += 32)
+            _mm256_stream_si256(reinterpret_cast<__m256i*>(dst + i), zero);
+    }
 
-                if (i + 1 < words_per_bitmap)
-                    prefetch(&words[i + 1]);
+    static void stream_zero_sse2(char* dst, const size_t size) noexcept
+    {
+        const __m128i zero = _mm_setzero_si128();
+        for (size_t i = 0; i < size; i += 16)
+            _mm_stream_si128(reinterpret_cast<__m128i*>(dst + i), zero);
+    }
 
-                uint64_t expected = words[i].load(std::memory_order_relaxed);
-                while (expected != 0)
-                {
-                    const size_t bit = count_trailing_zeros(expected);
-                    const size_t block_offset = i * bits_per_word + bit;
-
-                    if (const uint64_t desired = expected & ~(1ULL << bit);
-                        words[i].compare_exchange_weak(
-                            expected, desired,
-                            std::memory_order_acquire,
-                            std::memory_order_relaxed))
-                    {
-                        memory_fence();
-                        return block_offset;
-                    }
-                }
-            }
-            return ~static_cast<size_t>(0);
-        }
+    static simd_kernels resolve_kernels() noexcept
+    {
+        const cpu_features& features = cpu();
+        if (features.avx512f)
+            return {stream_copy_avx512, stream_zero_avx512};
+        if (features.avx2)
+            return {stream_copy_avx2, stream_zero_avx2};
+        return {stream_copy_sse2, stream_zero_sse2};
+    }
+#else
+    // libc's memcpy and memset already switch to non-temporal pairs here
+    static void stream_copy_libc(char* dst, const char* src, const size_t size) noexcept
+    {
+        std::memcpy(dst, src, size);
+    }
 
-        ALWAYS_INLINE
-        void mark_free(const size_t index) noexcept
-        {
-            const size_t word_idx = index / bits_per_word;
-            const size_t bit_idx = index % bits_per_word;
-            prefetch(&words[word_idx]);
-            words[word_idx].fetch_or(1ULL << bit_idx, std::memory_order_release);
-        }
+    static void stream_zero_libc(char* dst, const size_t size) noexcept
+    {
+        std::memset(dst, 0, size);
+    }
 
-        ALWAYS_INLINE
-        bool is_completely_free() const noexcept
+    static simd_kernels resolve_kernels() noexcept
+    {
+        return {stream_copy_libc, stream_zero_libc};
+    }
+#endif
+
+ALWAYS_INLINE
+static const simd_kernels& kernels() noexcept
+{
+    static const simd_kernels table = resolve_kernels();
+    return table;
+}
+
+// Copies `size` bytes between buffers that do not overlap
+ALWAYS_INLINE
+static void copy_memory(void* dst, const void* src, size_t size) noexcept
+{
+    auto* to = static_cast<char*>(dst);
+    auto* from = static_cast<const char*>(src);
+
+    if (size >= stream_copy_threshold())
+    {
+        // align the destination for the streaming stores, the ragged
+        // ends go through the cache
+        const size_t head = -reinterpret_cast<uintptr_t>(to) & 63;
+        std::memcpy(to, from, head);
+        to += head;
+        from += head;
+        size -= head;
+
+        const size_t body = size & ~static_cast<size_t>(63);
+        kernels().stream_copy(to, from, body);
+        MEMORY_FENCE();
+
+        std::memcpy(to + body, from + body, size - body);
+        return;
+    }
+
+    #if defined(__x86_64__)
+        if (size >= COPY_REP_MOVSB_THRESHOLD && cpu().erms)
         {
-            for (size_t i = 0; i < words_per_bitmap; ++i)
-            {
-                if (i + 1 < words_per_bitmap)
-                    prefetch(&words[i + 1]);
-                if (words[i].load(std::memory_order_relaxed) != ~0ULL)
-                    return false;
-            }
-            return true;
+            #ifdef _MSC_VER
+                __movsb(reinterpret_cast<unsigned char*>(to),
+                        reinterpret_cast<const unsigned char*>(from), size);
+            #else
+                __asm__ volatile("rep movsb" : "+D"(to), "+S"(from), "+c"(size) : : "memory");
+            #endif
+            return;
         }
-    };
+    #endif
+    std::memcpy(to, from, size);
+}
 
-    struct alignas(ALIGNMENT) block_header
-    {
+// Zeroes `size` bytes, bypassing the cache for the same sizes copy_memory does
+ALWAYS_INLINE
+static void zero_memory(void* dst, size_t size) noexcept
+{
+    auto* to = static_cast<char*>(dst);
+    if (size < stream_copy_threshold())
+    {
+        std::memset(to, 0, size);
+        return;
+    }
+
+    const size_t head = -reinterpret_cast<uintptr_t>(to) & 63;
+    std::memset(to, 0, head);
+    to += head;
+    size -= head;
+
+    const size_t body = size & ~static_cast<size_t>(63);
+    kernels().stream_zero(to, body);
+    MEMORY_FENCE();
+
+    std::memset(to + body, 0, size - body);
+}
+
+ALWAYS_INLINE
+static bool is_base_aligned(const void *ptr) noexcept
+{
+    return (reinterpret_cast<uintptr_t>(ptr) & (ALIGNMENT - 1)) == 0;
+}
+
+// Build with JALLOC_STATS defined to count what the allocator does. Each
+// thread bumps its own counters with plain stores, stats() sums them up
+// on demand. Without the flag every counter compiles away.
+#ifdef JALLOC_STATS
+    #define JALLOC_STAT(...) __VA_ARGS__
+#else
+    #define JALLOC_STAT(...)
+#endif
+
+// Build with JALLOC_PROFILE defined for the sampling heap profiler. An
+// unsampled allocate pays one thread-local subtraction, an unsampled
+// free nothing at all. POSIX only, it writes the profile with write(2).
+#if defined(JALLOC_PROFILE) && !defined(_WIN32)
+    #define JALLOC_PROFILING 1
+    #define JALLOC_SAMPLE(...) __VA_ARGS__
+    #include <cmath>
+    #include <fcntl.h>
+    #include <unistd.h>
+    #if __has_include(<execinfo.h>)
+        #include <execinfo.h>
+        #define JALLOC_HAVE_BACKTRACE 1
+    #endif
+#else
+    #define JALLOC_SAMPLE(...)
+#endif
+
+// Build with JALLOC_TRACE defined to record every call into the public
+// entry points while a trace is running, see start_trace(). Without a
+// trace each call pays one relaxed load. POSIX only, like the profiler.
+#if defined(JALLOC_TRACE) && !defined(_WIN32)
+    #define JALLOC_TRACING 1
+    #define JALLOC_RECORD(...) __VA_ARGS__
+    #include <fcntl.h>
+    #include <pthread.h>
+    #include <unistd.h>
+#else
+    #define JALLOC_RECORD(...)
+#endif
+
+namespace jalloc
+{
+    // One class in a stats() snapshot. The counts run from start-up, the
+    // byte figures are what the class holds at the time of the snapshot.
+    struct class_stats
+    {
+        size_t size;              // largest block the class serves
+        uint64_t allocations;
+        uint64_t deallocations;
+        uint64_t cache_hits;      // thread cache, span cache or large block cache
+        size_t allocated_bytes;   // handed out and not yet freed
+        size_t cached_bytes;      // free, held by a thread for reuse
+        size_t mapped_bytes;      // pool pages, spans or mappings the class holds
+        size_t returned_bytes;    // pages or mappings given back, cumulative
+    };
+
+    struct stats_snapshot
+    {
+        bool enabled;                // false when built without JALLOC_STATS
+        class_stats classes[SIZE_CLASSES];
+        class_stats spans;           // mid-size spans up to MID_LARGE_THRESHOLD
+        class_stats large;           // blocks with a mapping of their own
+        uint64_t map_calls;          // mmap and mremap, segments included
+        uint64_t unmap_calls;
+        uint64_t purge_calls;        // madvise calls of the scavenger
+        size_t purged_bytes;
+        size_t segment_bytes[NUMA_MAX_NODES]; // reserved per node slot, always counted
+    };
+}
+
+class Jallocator
+{
+    // Free slots of one pool page, 1 = free. Only the owning thread touches
+    // it (see page_owner), so a claim is a plain read and write of one word.
+    // `summary` has a bit per word that still has free bits, which makes
+    // finding a slot two tzcnts however many slots the page holds, and
+    // `cursor` keeps claims moving forward through the page rather than
+    // refilling the first hole freed.
+    struct bitmap
+    {
+        static constexpr size_t bits_per_word = 64;
+        static constexpr size_t words_per_bitmap = PG_SIZE / (CACHE_LINE_SIZE * 8);
+        static_assert(words_per_bitmap <= 8, "summary is one byte");
+
+        uint64_t words[words_per_bitmap];
+        uint8_t summary;
+        uint8_t cursor;
+        uint16_t blocks;
+
+        // Only the first `blocks` bits describe real slots
+        ALWAYS_INLINE
+        void reset(const size_t count) noexcept
+        {
+            summary = 0;
+            cursor = 0;
+            blocks = static_cast<uint16_t>(count);
+            for (size_t i = 0; i < words_per_bitmap; ++i)
+            {
+                const size_t first = i * bits_per_word;
+                words[i] = count >= first + bits_per_word
+                               ? ~0ULL
+                               : count > first
+                                     ? (1ULL << (count - first)) - 1
+                                     : 0;
+                if (words[i])
+                    summary |= 1U << i;
+            }
+        }
+
+        // First word with a free bit at or after the cursor, wrapping
+        // around; words_per_bitmap when the page is full
+        ALWAYS_INLINE
+        size_t next_word() const noexcept
+        {
+            if (UNLIKELY(summary == 0))
+                return words_per_bitmap;
+            const unsigned ahead = summary & (~0U << cursor);
+            return count_trailing_zeros(ahead ? ahead : summary);
+        }
+
+        ALWAYS_INLINE
+        void store(const size_t word, const uint64_t bits) noexcept
+        {
+            words[word] = bits;
+            if (!bits)
+                summary &= static_cast<uint8_t>(~(1U << word));
+            cursor = static_cast<uint8_t>(word);
+        }
+
+        // Index of a slot just taken, ~0 when the page is full
+        ALWAYS_INLINE
+        size_t find_free_block() noexcept
+        {
+            const size_t word = next_word();
+            if (UNLIKELY(word == words_per_bitmap))
+                return ~static_cast<size_t>(0);
+
+            const uint64_t bits = words[word];
+            store(word, bits & (bits - 1));
+            return word * bits_per_word + count_trailing_zeros(bits);
+        }
+
+        // Takes the lowest `max` free slots of one word in a single store.
+        // Returns the claimed bits, `word` receives the word index.
+        ALWAYS_INLINE
+        uint64_t claim_batch(const size_t max, size_t& word) noexcept
+        {
+            word = next_word();
+            if (UNLIKELY(word == words_per_bitmap))
+                return 0;
+
+            const uint64_t bits = words[word];
+            uint64_t rest = bits;
+            for (size_t n = 0; n < max && rest; ++n)
+                rest &= rest - 1;
+            store(word, rest);
+            return bits & ~rest;
+        }
+
+        ALWAYS_INLINE
+        void mark_free(const size_t index) noexcept
+        {
+            const size_t word = index / bits_per_word;
+            words[word] |= 1ULL << (index % bits_per_word);
+            summary |= static_cast<uint8_t>(1U << word);
+        }
+
+        ALWAYS_INLINE
+        bool is_completely_free() const noexcept
+        {
+            size_t free = 0;
+            for (const uint64_t word : words)
+                free += __builtin_popcountll(word);
+            return free == blocks;
+        }
+    };
+
+    struct alignas(ALIGNMENT) block_header
+    {
         // Bit field layout:
         // [63]    - Free flag
         // [62]    - Memory mapped flag
         // [61]    - Coalesced flag
-        // [56-48] - Size class
+        // [60]    - Sampled flag
+        // [59-56] - Magic
+        // [55-48] - Size class
         // [47-0]  - Block size
         uint64_t data;
         uint64_t magic;
         block_header* prev_physical;
         block_header* next_physical;
+        // Spans and mapped blocks only: bytes past the header that may
+        // not read as zero. Survives free, so recycled blocks keep it.
+        uint64_t dirty;
 
         void init(const size_t sz, const uint8_t size_class, const bool is_free,
                   block_header *prev = nullptr, block_header *next = nullptr) noexcept
@@ -595,7 +1184,7 @@ class Jallocator
                 (data & MAGIC_MASK) == MAGIC_VALUE))
             {
                 return size() <= (1ULL << 47) &&
-                       (size_class() < SIZE_CLASSES || size_class() == 255);
+                       (size_class() < SIZE_CLASSES || size_class() >= ALIGNED_CLASS);
             }
             return false;
         }
@@ -629,14 +1218,22 @@ class Jallocator
             return data & MMAP_FLAG;
         }
 
+        // The caller may now write up to `size` bytes
+        ALWAYS_INLINE
+        void mark_dirty(const size_t size) noexcept
+        {
+            if (size > dirty)
+                dirty = size;
+        }
+
         // Check if the block is perfectly aligned to the cache line size (64B)
         // and verify if the pointer is corrupted or not
         // The performance trade-offs are worth it
         // Please note in mind that this DOES NOT check
         // 1. Perfectly-aligned corrupted pointers
         // 2. Maliciously-aligned pointers
-        // 3.
-        // Modified alignment check
+        // Only meaningful for blocks that carry a header (medium and mapped),
+        // headerless blocks are identified by their pool page instead
         static bool is_aligned(const void *ptr) noexcept
         {
             if (!is_base_aligned(ptr))
@@ -648,16 +1245,12 @@ class Jallocator
             if (!is_base_aligned(header))
                 return false;
 
-            if (header->magic != HEADER_MAGIC)
-                return false;
-
-            const size_t size_alignment = get_alignment_for_size(header->size());
-            return (reinterpret_cast<uintptr_t>(ptr) & (size_alignment - 1)) == 0;
+            return header->magic == HEADER_MAGIC;
         }
 
         bool try_coalesce() noexcept
         {
-            if (is_memory_mapped() || size_class() < TINY_CLASSES)
+            if (is_memory_mapped() || size_class() < SMALL_CLASSES)
                 return false;
 
             auto coalesced = false;
@@ -697,1236 +1290,4672 @@ class Jallocator
         {
             return data & COALESCED_FLAG;
         }
-    };
-
-    struct alignas(PG_SIZE) pool
-    {
-        static constexpr size_t MIN_RETURN_SIZE = 64 * 1024;
-        static constexpr auto MEM_USAGE_THRESHOLD = 0.2;
-        bitmap bitmap;
-        uint8_t memory[PG_SIZE - sizeof(bitmap)]{};
-
-        ALWAYS_INLINE
-        void *allocate(const size_class &sc) noexcept
-        {
-            if (const size_t index = bitmap.find_free_block(sc.size);
-                index != ~static_cast<size_t>(0))
-            {
-                return memory + index * sc.slot_size;
-            }
-            return nullptr;
-        }
 
         ALWAYS_INLINE
-        void deallocate(void* ptr, const size_class& sc) noexcept
+        void set_sampled(const bool is_sampled) noexcept
         {
-            const size_t offset = static_cast<uint8_t*>(ptr) - memory;
-            bitmap.mark_free(offset / sc.slot_size);
+            data = (data & ~SAMPLED_FLAG) | static_cast<uint64_t>(is_sampled) << 60;
         }
 
         ALWAYS_INLINE
-        bool is_completely_free() const noexcept
+        bool is_sampled() const noexcept
         {
-            return bitmap.is_completely_free();
+            return data & SAMPLED_FLAG;
         }
+    };
 
-        ALWAYS_INLINE
-        void return_memory() noexcept
-        {
-            size_t free_space = 0;
-            #if defined(__AVX512F__)
-                const auto* current = reinterpret_cast<block_header*>(memory);
-                __m512i sum = _mm512_setzero_si512();
-
-                while (current)
-                {
-                    if (current->is_free())
-                        sum = _mm512_add_epi64(sum, _mm512_set1_epi64(current->size()));
-                    current = current->next_physical;
-                }
-                free_space = _mm512_reduce_add_epi64(sum);
-
-            #elif defined(__AVX2__)
-                const auto* current = reinterpret_cast<block_header*>(memory);
-                // 4 accumulators gives the best throughput here
-                __m256i sum1 = _mm256_setzero_si256();
-                __m256i sum2 = _mm256_setzero_si256();
-                __m256i sum3 = _mm256_setzero_si256();
-                __m256i sum4 = _mm256_setzero_si256();
-
-                while (current)
-                {
-                    block_header* next = current->next_physical;
-                    if (next)
-                        _mm_prefetch(reinterpret_cast<const char*>(next), _MM_HINT_T0);
-                    // this is to reduce depend on chains
-                    if (current->is_free())
-                    {
-                        __m256i size_vec = _mm256_set1_epi64x(current->size());
-                        sum1 = _mm256_add_epi64(sum1, size_vec);
-                        size_vec = _mm256_set1_epi64x(current->size() >> 1);
-                        sum2 = _mm256_add_epi64(sum2, size_vec);
-                        size_vec = _mm256_set1_epi64x(current->size() >> 2);
-                        sum3 = _mm256_add_epi64(sum3, size_vec);
-                        size_vec = _mm256_set1_epi64x(current->size() >> 3);
-                        sum4 = _mm256_add_epi64(sum4, size_vec);
-                    }
-                    current = next;
-                }
-
-                // mash the accumulators together
-                sum1 = _mm256_add_epi64(sum1, _mm256_slli_epi64(sum2, 1));
-                sum3 = _mm256_add_epi64(sum3, _mm256_slli_epi64(sum4, 3));
-                sum1 = _mm256_add_epi64(sum1, _mm256_slli_epi64(sum3, 2));
-
-                // caclulate the total horizontal sum with the least possible instructions
-                __m128i sum_low = _mm256_extracti128_si256(sum1, 0);
-                __m128i sum_high = _mm256_extracti128_si256(sum1, 1);
-                __m128i sum = _mm_add_epi64(sum_low, sum_high);
-                sum = _mm_add_epi64(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1,0,3,2)));
-                free_space = _mm_cvtsi128_si64(sum);
-
-            #elif defined(__aarch64__)
-                auto* current = reinterpret_cast<block_header*>(memory);
-                uint64x2_t sum1 = vdupq_n_u64(0);
-                uint64x2_t sum2 = vdupq_n_u64(0);
-                uint64x2_t sum3 = vdupq_n_u64(0);
-                uint64x2_t sum4 = vdupq_n_u64(0);
-
-                while (current)
-                {
-                    block_header* next = current->next_physical;
-                    if (next)
-                    {
-                       prefetch(next);
-                    }
-
-                    if (current->is_free())
-                    {
-                        const uint64_t size = current->size();
-                        sum1 = vaddq_u64(sum1, vdupq_n_u64(size));
-                        sum2 = vaddq_u64(sum2, vdupq_n_u64(size >> 1));
-                        sum3 = vaddq_u64(sum3, vdupq_n_u64(size >> 2));
-                        sum4 = vaddq_u64(sum4, vdupq_n_u64(size >> 3));
-                    }
-                    current = next;
-                }
-
-                const uint64x2_t sum_12 = vaddq_u64(sum1, vshlq_n_u64(sum2, 1));
-                const uint64x2_t sum_34 = vaddq_u64(sum3, vshlq_n_u64(sum4, 3));
-                const uint64x2_t final_sum = vaddq_u64(sum_12, vshlq_n_u64(sum_34, 2));
-
-                free_space = vgetq_lane_u64(final_sum, 0) + vgetq_lane_u64(final_sum, 1);
+    // Hands out the 16-bit owner ids that go into THREAD_OWNER_MASK.
+    // Id 0 is never handed out so a zero tag always means "nobody".
+    struct owner_registry
+    {
+        static constexpr size_t max_owners = (THREAD_OWNER_MASK >> THREAD_OWNER_SHIFT) + 1;
+        static constexpr size_t words = max_owners / 64;
 
-            #else
-                const auto* current = reinterpret_cast<block_header*>(memory);
-                while (current)
-                {
-                    if (current->is_free())
-                        free_space += current->size();
-                    current = current->next_physical;
-                }
-            #endif
+        std::atomic<uint64_t> used[words]{};
+        std::atomic<size_t> hint{0};
 
-            if (free_space >= MIN_RETURN_SIZE &&
-                static_cast<double>(free_space) / PG_SIZE >= (1.0 - MEM_USAGE_THRESHOLD))
+        uint64_t acquire() noexcept
+        {
+            for (;;)
             {
-
-                current = reinterpret_cast<block_header*>(memory);
-                while (current)
+                const size_t start = hint.load(std::memory_order_relaxed);
+                for (size_t n = 0; n < words; ++n)
                 {
-                    if (current->is_free() && current->is_coalesced())
+                    const size_t i = (start + n) % words;
+                    // keep id 0 reserved
+                    const uint64_t reserved = i == 0 ? 1 : 0;
+                    uint64_t expected = used[i].load(std::memory_order_relaxed);
+                    while ((expected | reserved) != ~0ULL)
                     {
-                        void* block_start = current + 1;
-                        auto page_start = reinterpret_cast<void*>(
-                            (reinterpret_cast<uintptr_t>(block_start) + PG_SIZE - 1) & ~(PG_SIZE - 1));
-                        auto page_end = reinterpret_cast<void*>(
-                            reinterpret_cast<uintptr_t>(block_start) + current->size() & ~(PG_SIZE - 1));
-
-                        if (page_end > page_start)
+                        const size_t bit = count_trailing_zeros(~(expected | reserved));
+                        if (used[i].compare_exchange_weak(expected, expected | 1ULL << bit,
+                                                          std::memory_order_acquire,
+                                                          std::memory_order_relaxed))
                         {
-                            #ifdef _WIN32
-                                VirtualAlloc(page_start,
-                                           reinterpret_cast<char*>(page_end) -
-                                           reinterpret_cast<char*>(page_start),
-                                           MEM_RESET,
-                                           PAGE_READWRITE);
-                            #elif defined(__APPLE__)
-                                madvise(page_start,
-                                       static_cast<char*>(page_end) -
-                                       static_cast<char*>(page_start),
-                                       MADV_FREE);
-                            #else
-                                madvise(page_start,
-                                       reinterpret_cast<char*>(page_end) -
-                                       reinterpret_cast<char*>(page_start),
-                                       MADV_DONTNEED);
-                            #endif
+                            hint.store(i, std::memory_order_relaxed);
+                            return static_cast<uint64_t>(i * 64 + bit) << THREAD_OWNER_SHIFT;
                         }
                     }
-                    current = current->next_physical;
                 }
+                // every id belongs to a live thread, wait for one to exit
+                std::this_thread::yield();
             }
         }
+
+        void release(const uint64_t tag) noexcept
+        {
+            const size_t id = tag >> THREAD_OWNER_SHIFT;
+            if (id == 0)
+                return;
+            used[id / 64].fetch_and(~(1ULL << id % 64), std::memory_order_release);
+        }
     };
 
-    struct tiny_block_manager
+    // Test-and-test-and-set lock for short critical sections that are shared
+    // between threads. Works with std::lock_guard.
+    struct spin_lock
     {
-        struct alignas(PG_SIZE) tiny_pool
-        {
-            bitmap bitmap;
-            alignas(ALIGNMENT) uint8_t memory[PG_SIZE - sizeof(bitmap)]{};
+        std::atomic<bool> locked{false};
 
-            ALWAYS_INLINE
-            void* allocate_tiny(const uint8_t size_class) noexcept
+        ALWAYS_INLINE
+        void lock() noexcept
+        {
+            while (locked.exchange(true, std::memory_order_acquire))
             {
-                const size_t size = (size_class + 1) << 3;
-                const size_t slot_size = (size + sizeof(block_header) + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
-                const size_t max_blocks = (PG_SIZE - sizeof(bitmap)) / slot_size;
-
-                if (const size_t index = bitmap.find_free_block(size);
-                    index != ~static_cast<size_t>(0) && index < max_blocks)
-                {
-                    uint8_t *block = memory + index * slot_size;
-                    if (block + slot_size <= memory + (PG_SIZE - sizeof(bitmap)))
-                        return block;
-                }
-                return nullptr;
+                while (locked.load(std::memory_order_relaxed))
+                    CPU_PAUSE();
             }
+        }
 
-            ALWAYS_INLINE
-            void deallocate_tiny(void *ptr, const uint8_t size_class) noexcept
-            {
-                const size_t size = (size_class + 1) << 3;
-                const size_t slot_size = (size + sizeof(block_header) + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
-                const size_t offset = static_cast<uint8_t *>(ptr) - memory;
-                const size_t index = offset / slot_size;
-
-                if (index * slot_size < PG_SIZE - sizeof(bitmap))
-                    bitmap.mark_free(index);
-            }
-        };
+        ALWAYS_INLINE
+        void unlock() noexcept
+        {
+            locked.store(false, std::memory_order_release);
+        }
     };
 
-    struct pool_manager
+    // Process-wide surplus of small and medium blocks, one stack per class.
+    // Thread caches spill into it when they overflow and take from it before
+    // going to their pools, so memory one thread frees can serve another.
+    // Blocks keep their owning page, a thread freeing a block it got from
+    // here sends it back to the owner like any other remote free.
+    struct transfer_cache
     {
-        struct pool_entry
+        static constexpr size_t capacity = 512;
+
+        struct alignas(CACHE_LINE_SIZE) class_stack
         {
-            pool* p;
-            size_t used_blocks;
+            spin_lock lock;
+            std::atomic<size_t> count{0};
+            void* blocks[capacity]{};
         };
 
-        alignas(CACHE_LINE_SIZE) pool_entry pools[SIZE_CLASSES][MAX_POOLS]{};
-        size_t pool_count[SIZE_CLASSES]{};
+        class_stack classes[SIZE_CLASSES]{};
+
+        // Returns how many were taken, the caller keeps the rest
+        size_t insert(const uint8_t size_class, void* const* ptrs, const size_t n) noexcept
+        {
+            auto& stack = classes[size_class];
+            std::lock_guard guard(stack.lock);
+            size_t count = stack.count.load(std::memory_order_relaxed);
+            const size_t take = n < capacity - count ? n : capacity - count;
+            for (size_t i = 0; i < take; ++i)
+                stack.blocks[count++] = ptrs[i];
+            stack.count.store(count, std::memory_order_relaxed);
+            return take;
+        }
 
         ALWAYS_INLINE
-        void* allocate(const uint8_t size_class) noexcept
+        size_t remove(const uint8_t size_class, void** out, const size_t n) noexcept
         {
-            const auto& sc = size_classes[size_class];
+            auto& stack = classes[size_class];
+            // an empty class should not cost a lock
+            if (stack.count.load(std::memory_order_relaxed) == 0)
+                return 0;
+            std::lock_guard guard(stack.lock);
+            size_t count = stack.count.load(std::memory_order_relaxed);
+            const size_t take = n < count ? n : count;
+            for (size_t i = 0; i < take; ++i)
+                out[i] = stack.blocks[--count];
+            stack.count.store(count, std::memory_order_relaxed);
+            return take;
+        }
 
-            for (size_t i = 0; i < pool_count[size_class]; ++i)
+        // Thread exit: takes back every block that lives on `tag`'s pages
+        template<typename Release>
+        void reclaim_owned(const uint64_t tag, Release&& release) noexcept
+        {
+            for (uint8_t size_class = 0; size_class < SIZE_CLASSES; ++size_class)
             {
-                auto&[p, used_blocks] = pools[size_class][i];
-                if (void* ptr = p->allocate(sc))
+                auto& stack = classes[size_class];
+                if (stack.count.load(std::memory_order_relaxed) == 0)
+                    continue;
+
+                std::lock_guard guard(stack.lock);
+                size_t kept = 0;
+                const size_t count = stack.count.load(std::memory_order_relaxed);
+                for (size_t i = 0; i < count; ++i)
                 {
-                    ++used_blocks;
-                    return ptr;
+                    void* ptr = stack.blocks[i];
+                    if (pool_from<page_owner>(ptr)->tag.load(std::memory_order_acquire) == tag)
+                        release(ptr, size_class);
+                    else
+                        stack.blocks[kept++] = ptr;
                 }
+                stack.count.store(kept, std::memory_order_relaxed);
             }
+        }
+    };
 
-            if (pool_count[size_class] < MAX_POOLS)
-            {
-                auto* new_pool = new (std::align_val_t{PG_SIZE}) pool();
+    // Every pool page starts with this. The bitmap is only ever touched by
+    // the owning thread; a free from any other thread is pushed onto
+    // `remote_free` (the link lives in the first word of the user block)
+    // and the owner takes the whole list in one exchange on its next
+    // allocate from the page.
+    // Headerless blocks get their size class from here as well.
+    // `next`/`prev`/`used`/`list` are the owner's bookkeeping and are never
+    // read by other threads. `tag` is read by every thread that frees into
+    // the page and changes hands at thread exit and adoption, so it is
+    // atomic: relaxed on the free path, release where it is handed over.
+    // The bitmap follows it directly, the two share the page's first
+    // two cache lines.
+    struct page_owner
+    {
+        enum : uint8_t { LIST_NONE, LIST_PARTIAL, LIST_FULL };
 
-                auto&[p, used_blocks] = pools[size_class][pool_count[size_class]];
-                p = new_pool;
-                used_blocks = 1;
+        uint64_t signature{POOL_SIGNATURE};
+        std::atomic<uint64_t> tag{0};
+        std::atomic<void*> remote_free{nullptr};
+        page_owner* next{nullptr};
+        page_owner* prev{nullptr};
+        uint16_t used{0};
+        uint8_t size_class{0};
+        uint8_t list{LIST_NONE};
 
-                if (void* ptr = new_pool->allocate(sc))
-                {
-                    ++pool_count[size_class];
-                    return ptr;
-                }
-                delete new_pool;
-            }
+        page_owner() noexcept = default;
 
-            return nullptr;
+        explicit page_owner(const uint8_t sc) noexcept
+            : tag(current_owner()), size_class(sc)
+        {
         }
 
         ALWAYS_INLINE
-        void deallocate(void* ptr, const uint8_t size_class) noexcept
+        bool is_local() const noexcept
         {
-            if (UNLIKELY((reinterpret_cast<uintptr_t>(ptr) & ~(PG_SIZE-1)) == 0))
-                return;
+            return tag.load(std::memory_order_relaxed) == current_owner();
+        }
 
-            const auto& sc = size_classes[size_class];
-            if (UNLIKELY(size_class >= SIZE_CLASSES))
-                return;
+        ALWAYS_INLINE
+        bool has_remote() const noexcept
+        {
+            return remote_free.load(std::memory_order_relaxed) != nullptr;
+        }
 
-            for (size_t i = 0; i < pool_count[size_class]; ++i)
+        ALWAYS_INLINE
+        void push_remote(void* ptr) noexcept
+        {
+            auto* node = static_cast<void**>(ptr);
+            void* head = remote_free.load(std::memory_order_relaxed);
+            do
             {
-                auto& entry = pools[size_class][i];
-                const auto* pool_start = reinterpret_cast<const char*>(entry.p);
-
-                if (const auto* pool_end = pool_start + PG_SIZE; ptr >= pool_start && ptr < pool_end)
-                {
-                    entry.p->deallocate(ptr, sc);
-                    if (--entry.used_blocks == 0)
-                    {
-                        delete entry.p;
-                        entry = pools[size_class][--pool_count[size_class]];
-                    }
-                    return;
-                }
-            }
+                *node = head;
+            } while (!remote_free.compare_exchange_weak(head, ptr,
+                                                        std::memory_order_release,
+                                                        std::memory_order_relaxed));
         }
 
-        ~pool_manager()
+        ALWAYS_INLINE
+        void* take_remote() noexcept
         {
-            for (size_t sc = 0; sc < SIZE_CLASSES; ++sc)
-            {
-                const size_t count = pool_count[sc];
-                VECTORIZE_LOOP
-                for (size_t i = 0; i < count; ++i)
-                    delete pools[sc][i].p;
-            }
+            return remote_free.exchange(nullptr, std::memory_order_acquire);
         }
     };
 
-    struct alignas(CACHE_LINE_SIZE) large_block_cache_t
+    // Intrusive list of pool pages, linked through page_owner. Owner only.
+    struct page_list
     {
-        struct alignas(CACHE_LINE_SIZE) cache_entry
-        {
-            std::atomic<void *> ptr{nullptr};
-            size_t size{0};
-            uint64_t last_use{0};
-        };
-
-        struct alignas(CACHE_LINE_SIZE) size_bucket
-        {
-            static constexpr size_t BUCKET_SIZE = 4;
-            std::atomic<size_t> count{0};
-            cache_entry entries[BUCKET_SIZE];
-        };
-
-        static constexpr size_t NUM_BUCKETS = 8; // 4KB to 512KB
-        alignas(CACHE_LINE_SIZE) size_bucket buckets[NUM_BUCKETS];
-        alignas(CACHE_LINE_SIZE) std::atomic<size_t> total_cached{0};
+        page_owner* head{nullptr};
+        page_owner* tail{nullptr};
+        size_t count{0};
 
         ALWAYS_INLINE
-        static uint64_t get_timestamp() noexcept
+        void push_front(page_owner* page) noexcept
         {
-#if defined(__x86_64__)
-#if defined(_MSC_VER)
-                    return __rdtsc();
-#else
-                    unsigned int aux;
-                    return __rdtscp(&aux);
-#endif
-#elif defined(__aarch64__)
-            // Use CNTVCT_EL0 (Virtual Count Register) for ARM64
-            uint64_t timestamp;
-#if defined(_MSC_VER)
-                    timestamp = _ReadStatusReg(ARM64_CNTVCT_EL0);
-#else
-            asm volatile("mrs %0, cntvct_el0" : "=r"(timestamp));
-#endif
-            return timestamp;
-#else
-                // Fallback for other architectures
-                return std::chrono::steady_clock::now().time_since_epoch().count();
-#endif
+            page->prev = nullptr;
+            page->next = head;
+            if (head)
+                head->prev = page;
+            else
+                tail = page;
+            head = page;
+            ++count;
         }
 
         ALWAYS_INLINE
-        static void memory_fence() noexcept
+        void push_back(page_owner* page) noexcept
         {
-#if defined(__x86_64__)
-                _mm_mfence();
-#elif defined(__aarch64__)
-            __asm__ volatile("dmb sy" ::: "memory");
-#else
-                std::atomic_thread_fence(std::memory_order_seq_cst);
-#endif
+            page->next = nullptr;
+            page->prev = tail;
+            if (tail)
+                tail->next = page;
+            else
+                head = page;
+            tail = page;
+            ++count;
         }
 
         ALWAYS_INLINE
-        static void prefetch(const void *ptr) noexcept
+        void remove(page_owner* page) noexcept
         {
-#if defined(__x86_64__)
-                _mm_prefetch(static_cast<const char*>(ptr), _MM_HINT_T0);
-#elif defined(__aarch64__)
-            PREFETCH_READ(ptr); // Read, high temporal locality
-#endif
+            if (page->prev)
+                page->prev->next = page->next;
+            else
+                head = page->next;
+            if (page->next)
+                page->next->prev = page->prev;
+            else
+                tail = page->prev;
+            page->next = page->prev = nullptr;
+            --count;
         }
 
         ALWAYS_INLINE
-        static size_t get_bucket_index(size_t size) noexcept
+        page_owner* pop_front() noexcept
         {
-#if defined(__x86_64__)
-                return (63 - __builtin_clzll(size > MIN_CACHE_BLOCK ? size - 1 : MIN_CACHE_BLOCK)) - 11;
-#elif defined(__aarch64__)
-            return (63 - __builtin_clzll(size > MIN_CACHE_BLOCK ? size - 1 : MIN_CACHE_BLOCK)) - 11;
-#else
-                size_t index = 0;
-                size_t threshold = MIN_CACHE_BLOCK;
-                while (threshold < size && index < NUM_BUCKETS - 1)
-                {
-                    threshold <<= 1;
-                    ++index;
-                }
-                return index;
-#endif
+            page_owner* page = head;
+            if (page)
+                remove(page);
+            return page;
         }
+    };
 
-        ALWAYS_INLINE
-        void *get_cached_block(size_t size) noexcept
-        {
-            if (UNLIKELY(size < MIN_CACHE_BLOCK || size > MAX_CACHE_BLOCK))
-                return nullptr;
+    template<typename Pool>
+    ALWAYS_INLINE
+    static Pool* pool_from(const void* ptr) noexcept
+    {
+        return reinterpret_cast<Pool*>(reinterpret_cast<uintptr_t>(ptr) & ~(PG_SIZE - 1));
+    }
 
-            const size_t bucket_idx = get_bucket_index(size);
-            if (UNLIKELY(bucket_idx >= NUM_BUCKETS))
-                return nullptr;
-
-            auto &bucket = buckets[bucket_idx];
-            const size_t count = bucket.count.load(std::memory_order_acquire);
+    // nullptr if `ptr` does not live in a pool page (i.e. it is a mapped block).
+    // Slots never start a page, so a page aligned pointer is looked up by
+    // its header alone and user data is never taken for a signature.
+    ALWAYS_INLINE
+    static page_owner* pool_page_of(const void* ptr) noexcept
+    {
+        if (UNLIKELY((reinterpret_cast<uintptr_t>(ptr) & (PG_SIZE - 1)) == 0))
+            return nullptr;
+        auto* page = pool_from<page_owner>(ptr);
+        return LIKELY(page->signature == POOL_SIGNATURE) ? page : nullptr;
+    }
 
-            // Prefetch the bucket entries
-#if defined(__x86_64__) || defined(__aarch64__)
-            prefetch(&bucket.entries[0]);
-            if (count > 1) prefetch(&bucket.entries[1]);
-#endif
+    // Node discovery and binding through the raw syscalls, so there is no
+    // libnuma dependency. On single-node machines and outside Linux every
+    // call is a no-op that reports node 0.
+    struct numa
+    {
+        // 0 until first asked, then the number of online nodes
+        static inline std::atomic<size_t> nodes{0};
+        static inline std::atomic<size_t> segment_bytes[NUMA_MAX_NODES]{};
 
-            for (size_t i = 0; i < count; ++i)
-            {
-                auto &entry = bucket.entries[i];
-                void *expected = entry.ptr.load(std::memory_order_relaxed);
+        static size_t node_count() noexcept
+        {
+            size_t count = nodes.load(std::memory_order_relaxed);
+            if (LIKELY(count))
+                return count;
 
-                if (expected && entry.size >= size && entry.size <= size * MAX_SIZE_RATIO)
+            count = 1;
+            #ifdef __linux__
+                // "0" or "0-1" or "0,2-3": the last number is the highest node
+                if (const int fd = open("/sys/devices/system/node/online", O_RDONLY | O_CLOEXEC); fd >= 0)
                 {
-                    if (entry.ptr.compare_exchange_strong(expected, nullptr,
-                                                          std::memory_order_acquire, std::memory_order_relaxed))
+                    char buffer[64];
+                    const ssize_t length = read(fd, buffer, sizeof(buffer) - 1);
+                    close(fd);
+                    size_t highest = 0;
+                    for (ssize_t i = 0; i < length; ++i)
                     {
-                        bucket.count.fetch_sub(1, std::memory_order_release);
-                        total_cached.fetch_sub(entry.size, std::memory_order_relaxed);
-                        memory_fence();
-                        return expected;
+                        if (buffer[i] >= '0' && buffer[i] <= '9')
+                            highest = highest * 10 + (buffer[i] - '0');
+                        else if (buffer[i] != '\n')
+                            highest = 0;
                     }
+                    count = highest + 1;
                 }
-            }
-            return nullptr;
+            #endif
+            nodes.store(count, std::memory_order_relaxed);
+            return count;
         }
 
-        ALWAYS_INLINE bool cache_block(void *ptr, size_t size) noexcept
+        ALWAYS_INLINE
+        static bool enabled() noexcept
         {
-            if (UNLIKELY(size < MIN_CACHE_BLOCK || size > MAX_CACHE_BLOCK))
-                return false;
+            return node_count() > 1;
+        }
 
-            const size_t bucket_idx = get_bucket_index(size);
-            if (UNLIKELY(bucket_idx >= NUM_BUCKETS))
-                return false;
+        // Index into the per-node arrays. Segments keep their real node, so
+        // they are still bound to it, only the bookkeeping is shared.
+        ALWAYS_INLINE
+        static size_t slot(const size_t node) noexcept
+        {
+            return node % NUMA_MAX_NODES;
+        }
 
-            if (const size_t current_total = total_cached.load(std::memory_order_relaxed);
-                current_total + size > MAX_CACHE_SIZE)
-                return false;
+        static size_t current_node() noexcept
+        {
+            #if defined(__linux__) && defined(SYS_getcpu)
+                if (enabled())
+                {
+                    unsigned cpu = 0;
+                    unsigned node = 0;
+                    if (syscall(SYS_getcpu, &cpu, &node, nullptr) == 0)
+                        return node;
+                }
+            #endif
+            return 0;
+        }
 
-            auto &[count2, entries] = buckets[bucket_idx];
+        // Prefer `node` for the pages behind the range, the kernel still
+        // falls back to other nodes when it runs out
+        static void bind(void* ptr, const size_t size, const size_t node) noexcept
+        {
+            #if defined(__linux__) && defined(SYS_mbind)
+                // the kernel's own MAX_NUMNODES tops out at 1024
+                constexpr size_t MASK_BITS = 1024;
+                constexpr size_t WORD_BITS = sizeof(unsigned long) * 8;
+                if (enabled() && node < MASK_BITS)
+                {
+                    constexpr int MPOL_PREFERRED_MODE = 1;
+                    unsigned long mask[MASK_BITS / WORD_BITS]{};
+                    mask[node / WORD_BITS] = 1UL << (node % WORD_BITS);
+                    syscall(SYS_mbind, ptr, size, MPOL_PREFERRED_MODE, mask, MASK_BITS, 0);
+                }
+            #else
+                (void)ptr;
+                (void)size;
+                (void)node;
+            #endif
+        }
+    };
 
-            if (const size_t count = count2.load(std::memory_order_acquire); count < size_bucket::BUCKET_SIZE)
+    // Maps `size` bytes aligned to `alignment`, or nullptr. In huge page
+    // mode the range is backed by large pages where the OS allows it.
+    static void* map_aligned(const size_t size, const size_t alignment) noexcept
+    {
+        const bool huge = huge_pages_.load(std::memory_order_relaxed);
+        #ifdef _WIN32
+            // Windows cannot trim a reservation, so retry at an aligned address
+            for (int attempt = 0; attempt < 8; ++attempt)
             {
-                auto &entry = entries[count];
-
-                if (void *expected = nullptr; entry.ptr.compare_exchange_strong(expected, ptr,
-                    std::memory_order_release, std::memory_order_relaxed))
+                void* probe = VirtualAlloc(nullptr, size + alignment, MEM_RESERVE, PAGE_NOACCESS);
+                if (!probe)
+                    return nullptr;
+                VirtualFree(probe, 0, MEM_RELEASE);
+                auto* aligned = reinterpret_cast<void*>(
+                    (reinterpret_cast<uintptr_t>(probe) + alignment - 1) & ~(alignment - 1));
+                // large pages need SeLockMemoryPrivilege, fall back without it
+                if (huge)
                 {
-                    entry.size = size;
-                    entry.last_use = get_timestamp();
-                    count2.fetch_add(1, std::memory_order_release);
-                    total_cached.fetch_add(size, std::memory_order_relaxed);
-                    return true;
+                    if (void* base = VirtualAlloc(aligned, size, MEM_COMMIT | MEM_RESERVE | MEM_LARGE_PAGES,
+                                                  PAGE_READWRITE))
+                        return base;
                 }
+                if (void* base = VirtualAlloc(aligned, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE))
+                    return base;
             }
+            return nullptr;
+        #else
+            // Over-reserve and trim both ends down to an aligned range
+            void* raw = MAP_MEMORY(size + alignment);
+            if (UNLIKELY(raw == MAP_FAILED || !raw))
+                return nullptr;
 
-            // ReSharper disable once CppDFAUnreadVariable
-            auto oldest_time = UINT64_MAX;
-            size_t oldest_idx = 0;
+            const auto start = reinterpret_cast<uintptr_t>(raw);
+            const uintptr_t aligned = (start + alignment - 1) & ~(alignment - 1);
+            if (aligned > start)
+                UNMAP_MEMORY(raw, aligned - start);
+            if (const size_t tail = start + alignment - aligned)
+                UNMAP_MEMORY(reinterpret_cast<void*>(aligned + size), tail);
 
-#if defined(__x86_64__) || defined(__aarch64__)
-#if defined(__x86_64__) && defined(__AVX2__)
-                    __m256i oldest = _mm256_set1_epi64x(UINT64_MAX);
-                    __m256i indices = _mm256_setr_epi64x(0, 1, 2, 3);
+            #ifdef MADV_HUGEPAGE
+                if (huge)
+                    madvise(reinterpret_cast<void*>(aligned), size, MADV_HUGEPAGE);
+            #endif
+            return reinterpret_cast<void*>(aligned);
+        #endif
+    }
 
-                    for (size_t i = 0; i < BUCKET_SIZE; i += 4)
-                    {
-                        __m256i times = _mm256_setr_epi64x(
-                            bucket.entries[i].last_use,
-                            bucket.entries[i+1].last_use,
-                            bucket.entries[i+2].last_use,
-                            bucket.entries[i+3].last_use
-                        );
-                        __m256i mask = _mm256_cmpgt_epi64(oldest, times);
-                        oldest = _mm256_blendv_epi8(oldest, times, mask);
-                        indices = _mm256_blendv_epi8(indices,
-                                 _mm256_setr_epi64x(i, i+1, i+2, i+3), mask);
-                    }
+    // Drops the physical pages behind a free range, the range stays mapped
+    ALWAYS_INLINE
+    static void purge_pages(void* ptr, const size_t size) noexcept
+    {
+        #ifdef _WIN32
+            VirtualAlloc(ptr, size, MEM_RESET, PAGE_READWRITE);
+        #elif defined(__APPLE__)
+            madvise(ptr, size, MADV_FREE);
+        #else
+            // MADV_FREE pages keep counting towards RSS until the kernel wants them
+            madvise(ptr, size, MADV_DONTNEED);
+        #endif
+    }
 
-                    uint64_t tmp_times[4], tmp_indices[4];
-                    _mm256_storeu_si256((__m256i*)tmp_times, oldest);
-                    _mm256_storeu_si256((__m256i*)tmp_indices, indices);
+    // Whether purged pages read back as zero. MEM_RESET and MADV_FREE pages
+    // keep their contents until the kernel actually needs them.
+    #if defined(_WIN32) || defined(__APPLE__)
+        static constexpr bool PURGE_ZEROES = false;
+    #else
+        static constexpr bool PURGE_ZEROES = true;
+    #endif
 
-                    for (int i = 0; i < 4; i++)
-                    {
-                        if (tmp_times[i] < oldest_time)
-                        {
-                            oldest_time = tmp_times[i];
-                            oldest_idx = tmp_indices[i];
-                        }
-                    }
-#elif defined(__aarch64__)
-            uint64x2_t oldest = vdupq_n_u64(UINT64_MAX);
-            uint64x2_t idx = vdupq_n_u64(0);
-            idx = vsetq_lane_u64(0, idx, 0);
+    // A segment is a SEGMENT_SIZE aligned region owned by one thread. Its
+    // first pages hold the span side table, the rest is handed out as spans
+    // of whole pages. Any page maps back to its segment with a mask.
+    struct span_info
+    {
+        uint16_t pages{0}; // run length, only set on the first page of a span
+        uint8_t size_class{0};
+        uint8_t in_use{0};
+    };
 
-            VECTORIZE_LOOP
-            for (size_t i = 0; i < size_bucket::BUCKET_SIZE; i += 2)
+    struct segment
+    {
+        segment* next{nullptr};
+        segment* prev{nullptr};
+        // Written under `lock` only, by the owner and by threads resizing a
+        // span in place. The owner reads it without the lock, so a read may
+        // be stale, which costs nothing: allocate_span looks for the run
+        // under the lock anyway, and a segment with a span being resized
+        // has that span live and cannot look empty.
+        std::atomic<size_t> free_pages{0};
+        size_t hint{0};
+        std::atomic<uint64_t> tag{0};
+        size_t node{0};
+        // spans freed by other threads, linked through block_header::next_physical
+        std::atomic<block_header*> remote_spans{nullptr};
+        // every segment in the process, for the scavenger
+        segment* all_next{nullptr};
+        segment* all_prev{nullptr};
+        // owner takes it to change free_map, the scavenger to read it
+        spin_lock lock;
+        uint64_t free_map[SEGMENT_PAGES / 64]{}; // 1 = page is free
+        uint64_t dirty_map[SEGMENT_PAGES / 64]{}; // 1 = page may be resident
+        uint64_t zero_map[SEGMENT_PAGES / 64]{}; // 1 = page is known to read as zero
+        span_info spans[SEGMENT_PAGES]{};
+
+        static constexpr size_t META_PAGES = 2;
+        static constexpr size_t USABLE_PAGES = SEGMENT_PAGES - META_PAGES;
+
+        segment() noexcept
+            : free_pages(USABLE_PAGES), hint(META_PAGES)
+        {
+            for (size_t i = META_PAGES; i < SEGMENT_PAGES; ++i)
             {
-                uint64x2_t times = vld1q_u64(&entries[i].last_use);
-                uint64x2_t curr_idx = vdupq_n_u64(0);
-                curr_idx = vsetq_lane_u64(i, curr_idx, 0);
-                uint64x2_t mask = vcltq_u64(times, oldest);
-                oldest = vbslq_u64(mask, times, oldest);
-                idx = vbslq_u64(mask, curr_idx, idx);
+                free_map[i >> 6] |= 1ULL << (i & 63);
+                zero_map[i >> 6] |= 1ULL << (i & 63);
             }
+            dirty_map[0] = (1ULL << META_PAGES) - 1;
+        }
+
+        ALWAYS_INLINE
+        static segment* of(const void* ptr) noexcept
+        {
+            return reinterpret_cast<segment*>(
+                reinterpret_cast<uintptr_t>(ptr) & ~(SEGMENT_SIZE - 1));
+        }
 
-            uint64_t tmp_times[2], tmp_indices[2];
-            vst1q_u64(tmp_times, oldest);
-            vst1q_u64(tmp_indices, idx);
+        ALWAYS_INLINE
+        void* page_address(const size_t index) noexcept
+        {
+            return reinterpret_cast<char*>(this) + index * PG_SIZE;
+        }
 
-            if (tmp_times[0] < tmp_times[1])
-            {
-                // ReSharper disable once CppDFAUnusedValue
-                oldest_time = tmp_times[0];
-                oldest_idx = tmp_indices[0];
-            } else
+        ALWAYS_INLINE
+        size_t page_index(const void* ptr) const noexcept
+        {
+            return (static_cast<const char*>(ptr) -
+                    reinterpret_cast<const char*>(this)) / PG_SIZE;
+        }
+
+        // First page of a run of `count` free pages, or ~0
+        size_t find_run(const size_t count) const noexcept
+        {
+            if (LIKELY(count == 1))
             {
-                // ReSharper disable once CppDFAUnusedValue
-                oldest_time = tmp_times[1];
-                oldest_idx = tmp_indices[1];
-            }
-#endif
-#else
-                VECTORIZE_LOOP
-                for (size_t i = 0; i < BUCKET_SIZE; ++i)
+                for (size_t n = 0, w = hint >> 6; n < SEGMENT_PAGES / 64; ++n)
                 {
-                    if (bucket.entries[i].last_use < oldest_time)
-                    {
-                        oldest_time = bucket.entries[i].last_use;
-                        oldest_idx = i;
-                    }
+                    if (free_map[w])
+                        return (w << 6) + __builtin_ctzll(free_map[w]);
+                    w = (w + 1) & (SEGMENT_PAGES / 64 - 1);
                 }
-#endif
-
-            auto &oldest2 = entries[oldest_idx];
-            void *expected = oldest2.ptr.load(std::memory_order_relaxed);
+                return ~static_cast<size_t>(0);
+            }
 
-            if (expected && size <= oldest2.size * MAX_SIZE_RATIO)
+            size_t run = 0;
+            for (size_t i = META_PAGES; i < SEGMENT_PAGES; ++i)
             {
-                if (oldest2.ptr.compare_exchange_strong(expected, ptr,
-                                                        std::memory_order_release, std::memory_order_relaxed))
+                if ((i & 63) == 0 && free_map[i >> 6] == 0)
+                {
+                    run = 0;
+                    i += 63;
+                    continue;
+                }
+                if (free_map[i >> 6] & 1ULL << (i & 63))
+                {
+                    if (++run == count)
+                        return i + 1 - count;
+                }
+                else
                 {
-                    total_cached.fetch_sub(oldest2.size, std::memory_order_relaxed);
-                    oldest2.size = size;
-                    oldest2.last_use = get_timestamp();
-                    total_cached.fetch_add(size, std::memory_order_relaxed);
-                    return true;
+                    run = 0;
                 }
             }
+            return ~static_cast<size_t>(0);
+        }
 
-            return false;
+        // Both with `lock` held, so no other writer comes in between
+        ALWAYS_INLINE
+        void pages_taken(const size_t count) noexcept
+        {
+            free_pages.store(free_pages.load(std::memory_order_relaxed) - count, std::memory_order_relaxed);
         }
 
         ALWAYS_INLINE
-        void clear() noexcept
+        void pages_freed(const size_t count) noexcept
+        {
+            free_pages.store(free_pages.load(std::memory_order_relaxed) + count, std::memory_order_relaxed);
+        }
+
+        ALWAYS_INLINE
+        void mark(const size_t first, const size_t count, const bool free) noexcept
         {
-            for (auto &bucket: buckets)
+            for (size_t i = first; i < first + count; ++i)
             {
-                const size_t count = bucket.count.load(std::memory_order_acquire);
-                for (size_t i = 0; i < count; ++i)
-                {
-                    auto &[ptr1, size, last_use] = bucket.entries[i];
-                    if (void *ptr = ptr1.exchange(nullptr, std::memory_order_release))
-                    {
-                        const size_t total_size = size + sizeof(block_header);
-                        const size_t alloc_size = total_size <= PG_SIZE
-                                                      ? PG_SIZE
-                                                      : (total_size + PG_SIZE - 1) & ~(PG_SIZE - 1);
+                if (free)
+                    free_map[i >> 6] |= 1ULL << (i & 63);
+                else
+                    free_map[i >> 6] &= ~(1ULL << (i & 63));
+            }
+        }
 
-                        UNMAP_MEMORY(static_cast<char*>(ptr) - sizeof(block_header),
-                                     alloc_size);
-                    }
-                }
-                bucket.count.store(0, std::memory_order_release);
+        // Pages about to be handed out, true if none of them was written since
+        // the OS last zeroed it
+        ALWAYS_INLINE
+        bool touch(const size_t first, const size_t count) noexcept
+        {
+            bool zeroed = true;
+            for (size_t i = first; i < first + count; ++i)
+            {
+                const uint64_t bit = 1ULL << (i & 63);
+                zeroed &= (zero_map[i >> 6] & bit) != 0;
+                zero_map[i >> 6] &= ~bit;
+                dirty_map[i >> 6] |= bit;
             }
-            total_cached.store(0, std::memory_order_release);
+            return zeroed;
         }
-    };
 
-    static thread_local thread_cache_t thread_cache_;
-    static thread_local pool_manager pool_manager_;
-    static thread_local large_block_cache_t large_block_cache_;
-    static thread_local std::array<tiny_block_manager::tiny_pool *,
-        TINY_CLASSES> tiny_pools_;
+        void* allocate_span(const size_t count, const uint8_t size_class, bool* zeroed = nullptr) noexcept
+        {
+            if (free_pages.load(std::memory_order_relaxed) < count)
+                return nullptr;
 
-    ALWAYS_INLINE
-    static void* allocate_tiny(const size_t size) noexcept
-    {
-        if (UNLIKELY(size == 0))
-            return nullptr;
+            std::lock_guard guard(lock);
+            const size_t first = find_run(count);
+            if (first == ~static_cast<size_t>(0))
+                return nullptr;
 
-        const uint8_t size_class = (size - 1) >> 3;
-        if (UNLIKELY(size_class >= TINY_CLASSES))
-            return nullptr;
+            mark(first, count, false);
+            const bool fresh = touch(first, count);
+            if (zeroed)
+                *zeroed = fresh;
+            pages_taken(count);
+            hint = first + count < SEGMENT_PAGES ? first + count : META_PAGES;
+            spans[first] = {static_cast<uint16_t>(count), size_class, 1};
+            return page_address(first);
+        }
 
-        if (auto *tiny_pool = tiny_pools_[size_class])
+        ALWAYS_INLINE
+        void free_span(const void* span) noexcept
         {
-            void *ptr = nullptr;
-            ptr = tiny_pool->allocate_tiny(size_class);
-
-            if (LIKELY(ptr != nullptr))
-            {
-                if (UNLIKELY(!is_base_aligned(ptr)))
-                    return nullptr;
+            std::lock_guard guard(lock);
+            free_span_locked(span);
+        }
 
-                auto *header = new(ptr) block_header();
-                header->init(size, size_class, false);
+        ALWAYS_INLINE
+        void free_span_locked(const void* span) noexcept
+        {
+            const size_t first = page_index(span);
+            const size_t count = spans[first].pages;
+            spans[first] = {};
+            mark(first, count, true);
+            pages_freed(count);
+            if (first < hint)
+                hint = first;
+        }
 
-                void *user_ptr = static_cast<char *>(ptr) + sizeof(block_header);
-                if (UNLIKELY(!is_base_aligned(user_ptr)))
-                    return nullptr;
+        // Extends a span to `count` pages over the free pages that follow
+        // it, false if any of them is taken. `zeroed` tells whether the
+        // added pages are all still zero.
+        bool grow_span(const void* span, const size_t count, bool& zeroed) noexcept
+        {
+            const size_t first = page_index(span);
+            if (first + count > SEGMENT_PAGES)
+                return false;
 
-                return user_ptr;
+            std::lock_guard guard(lock);
+            const size_t current = spans[first].pages;
+            for (size_t i = first + current; i < first + count; ++i)
+            {
+                if (!(free_map[i >> 6] & 1ULL << (i & 63)))
+                    return false;
             }
+
+            mark(first + current, count - current, false);
+            zeroed = touch(first + current, count - current);
+            pages_taken(count - current);
+            spans[first].pages = static_cast<uint16_t>(count);
+            return true;
         }
 
-        static std::mutex init_mutex;
-        std::lock_guard lock(init_mutex);
+        // Cuts a span down to its first `count` pages
+        void shrink_span(const void* span, const size_t count) noexcept
+        {
+            const size_t first = page_index(span);
+            std::lock_guard guard(lock);
+            const size_t current = spans[first].pages;
+            mark(first + count, current - count, true);
+            pages_freed(current - count);
+            spans[first].pages = static_cast<uint16_t>(count);
+            if (first + count < hint)
+                hint = first + count;
+        }
 
-        if (!tiny_pools_[size_class])
+        ALWAYS_INLINE
+        bool is_empty() const noexcept
         {
-            try
-            {
-                tiny_pools_[size_class] = new(std::align_val_t{PG_SIZE})
-                        tiny_block_manager::tiny_pool();
-                return allocate_tiny(size);
-            } catch (...)
-            {
-                return nullptr;
-            }
+            return free_pages.load(std::memory_order_relaxed) == USABLE_PAGES;
         }
 
-        return nullptr;
-    }
+        ALWAYS_INLINE
+        size_t span_pages(const void* span) const noexcept
+        {
+            return spans[page_index(span)].pages;
+        }
 
-    ALWAYS_INLINE
-    static void* allocate_small(const size_t size) noexcept
-    {
-        const uint8_t size_class = (size - 1) >> 3;
+        ALWAYS_INLINE
+        bool is_local() const noexcept
+        {
+            return tag.load(std::memory_order_relaxed) == current_owner();
+        }
 
-        if (void* cached = thread_cache_.get(size_class))
+        ALWAYS_INLINE
+        void push_remote(block_header* span) noexcept
         {
-            auto* header = reinterpret_cast<block_header*>(
-                static_cast<char*>(cached) - sizeof(block_header));
+            block_header* head = remote_spans.load(std::memory_order_relaxed);
+            do
+            {
+                span->next_physical = head;
+            } while (!remote_spans.compare_exchange_weak(head, span,
+                                                         std::memory_order_release,
+                                                         std::memory_order_relaxed));
+        }
 
-            if (LIKELY(header->is_valid()))
+        // Owner only. Emptied segments are picked up by the next free_span.
+        ALWAYS_INLINE
+        void reclaim_remote() noexcept
+        {
+            if (LIKELY(remote_spans.load(std::memory_order_relaxed) == nullptr))
+                return;
+            std::lock_guard guard(lock);
+            for (block_header* span = remote_spans.exchange(nullptr, std::memory_order_acquire); span;)
             {
-                header->set_free(false);
-                return cached;
+                block_header* next = span->next_physical;
+                free_span_locked(span);
+                span = next;
             }
-            return nullptr;
         }
 
-        if (void* ptr = pool_manager_.allocate(size_class); LIKELY(ptr))
+        // Scavenger. Hands free pages that may still be resident back to the
+        // OS, one call per contiguous run. Returns the bytes released.
+        size_t purge() noexcept
         {
-            auto* header = new (ptr) block_header();
-            header->encode(size, size_class, false);
-            return static_cast<char*>(ptr) + sizeof(block_header);
+            std::lock_guard guard(lock);
+            size_t purged = 0;
+            size_t run = 0;
+            for (size_t i = META_PAGES; i <= SEGMENT_PAGES; ++i)
+            {
+                const bool purgeable = i < SEGMENT_PAGES &&
+                                       (free_map[i >> 6] & dirty_map[i >> 6] & 1ULL << (i & 63));
+                if (purgeable)
+                {
+                    ++run;
+                    continue;
+                }
+                if (run)
+                {
+                    size_t first = i - run;
+                    size_t last = i;
+                    // Splitting a huge page costs more than it gives back,
+                    // only purge the huge pages the run covers entirely
+                    if (huge_pages_.load(std::memory_order_relaxed))
+                    {
+                        constexpr size_t per_huge = HUGE_PAGE_SIZE / PG_SIZE;
+                        first = (first + per_huge - 1) & ~(per_huge - 1);
+                        last &= ~(per_huge - 1);
+                    }
+                    if (last > first)
+                    {
+                        purge_pages(page_address(first), (last - first) * PG_SIZE);
+                        JALLOC_STAT(stats_registry::bump(stats_registry_.purge_calls));
+                        JALLOC_STAT(stats_registry::bump(stats_registry_.purged_bytes, (last - first) * PG_SIZE));
+                        for (size_t j = first; j < last; ++j)
+                        {
+                            dirty_map[j >> 6] &= ~(1ULL << (j & 63));
+                            if (PURGE_ZEROES)
+                                zero_map[j >> 6] |= 1ULL << (j & 63);
+                        }
+                        purged += (last - first) * PG_SIZE;
+                    }
+                    run = 0;
+                }
+            }
+            return purged;
         }
 
-        return nullptr;
-    }
-
-    ALWAYS_INLINE
-    static void* allocate_medium(const size_t size, const uint8_t size_class) noexcept
-    {
-        if (void* cached = thread_cache_.get(size_class))
+        static segment* reserve(const size_t node) noexcept
         {
-            auto* header = reinterpret_cast<block_header*>(
-                static_cast<char*>(cached) - sizeof(block_header));
-            header->set_free(false);
-            return cached;
+            void* base = map_aligned(SEGMENT_SIZE, SEGMENT_SIZE);
+            JALLOC_STAT(stats_registry::bump(stats_registry_.map_calls));
+            if (UNLIKELY(!base))
+                return nullptr;
+            numa::bind(base, SEGMENT_SIZE, node);
+            numa::segment_bytes[numa::slot(node)].fetch_add(SEGMENT_SIZE, std::memory_order_relaxed);
+
+            auto* seg = new (base) segment();
+            seg->node = node;
+            return segments_.add(seg);
         }
 
-        if (void* ptr = pool_manager_.allocate(size_class); LIKELY(ptr))
+        static void unreserve(segment* seg) noexcept
         {
-            auto* header = new (ptr) block_header();
-            header->encode(size, size_class, false);
-            return static_cast<char*>(ptr) + sizeof(block_header);
+            segments_.remove(seg);
+            numa::segment_bytes[numa::slot(seg->node)].fetch_sub(SEGMENT_SIZE, std::memory_order_relaxed);
+            JALLOC_STAT(stats_registry::bump(stats_registry_.unmap_calls));
+            UNMAP_MEMORY(seg, SEGMENT_SIZE);
         }
+    };
 
-        return nullptr;
-    }
-    ALWAYS_INLINE
-    static void* allocate_large(const size_t size) noexcept
+    // All live segments, owned or abandoned. Only reserve/unreserve and the
+    // scavenger touch it. Lock order is registry, then segment.
+    struct segment_registry
     {
-        if (void* cached = large_block_cache_.get_cached_block(size))
+        spin_lock lock;
+        segment* head{nullptr};
+
+        segment* add(segment* seg) noexcept
         {
-            auto* header = reinterpret_cast<block_header*>(
-                static_cast<char*>(cached) - sizeof(block_header));
-            header->set_free(false);
-            return cached;
+            std::lock_guard guard(lock);
+            seg->all_prev = nullptr;
+            seg->all_next = head;
+            if (head)
+                head->all_prev = seg;
+            head = seg;
+            return seg;
         }
 
-        constexpr size_t header_size = (sizeof(block_header) + CACHE_LINE_SIZE - 1)
-                                       & ~(CACHE_LINE_SIZE - 1);
-
-        if (size <= PG_SIZE - header_size)
+        void remove(segment* seg) noexcept
         {
-            void *ptr = MAP_MEMORY(PG_SIZE);
-            if (LIKELY(ptr))
-            {
-                auto *header = new(ptr) block_header();
-                header->init(size, 255, false);
-                header->set_memory_mapped(true);
-                return static_cast<char *>(ptr) + header_size;
-            }
-            return nullptr;
+            std::lock_guard guard(lock);
+            if (seg->all_prev)
+                seg->all_prev->all_next = seg->all_next;
+            else
+                head = seg->all_next;
+            if (seg->all_next)
+                seg->all_next->all_prev = seg->all_prev;
         }
 
-        const size_t total_pages = (size + header_size + PG_SIZE - 1) >> 12;
-        const size_t allocation_size = total_pages << 12;
-
-        void *ptr = MAP_MEMORY(allocation_size);
-        if (UNLIKELY(!ptr))
-            return nullptr;
+        size_t purge() noexcept
+        {
+            std::lock_guard guard(lock);
+            size_t purged = 0;
+            for (segment* seg = head; seg; seg = seg->all_next)
+                purged += seg->purge();
+            return purged;
+        }
+    };
 
-        auto* header = new (ptr) block_header();
-        header->init(size, 255, false);
-        header->set_memory_mapped(true);
-        return static_cast<char *>(ptr) + header_size;
-    }
+    static_assert(sizeof(segment) <= segment::META_PAGES * PG_SIZE);
+    static_assert(SEGMENT_PAGES % 64 == 0 && SEGMENT_PAGES <= UINT16_MAX);
 
-    ALWAYS_INLINE
-    static void thread_cleanup()
+    // Per-thread page heap. Pool pages of every class come from here, so a
+    // thread is only bounded by memory. One empty segment is kept around to
+    // absorb churn, the rest go back to the OS as soon as they empty.
+    struct page_heap
     {
-        cleanup();
-    }
+        segment* segments{nullptr};
+        segment* spare{nullptr};
+        size_t node{0};
+        size_t until_recheck{0};
 
-    ALWAYS_INLINE
-    static void register_thread_cleanup()
-    {
-        thread_local struct Cleanup
+        // Which node's segments to carve from, refreshed now and then in
+        // case the thread migrated
+        ALWAYS_INLINE
+        size_t local_node() noexcept
         {
-            ~Cleanup()
+            if (UNLIKELY(until_recheck == 0))
             {
-                cleanup();
+                node = numa::current_node();
+                until_recheck = NUMA_RECHECK_INTERVAL;
             }
-        } cleanup;
-    }
-
-public:
-    ALWAYS_INLINE
-    static void* allocate(const size_t size) noexcept
-    {
-        register_thread_cleanup();
-        if (UNLIKELY(size == 0 || size > (1ULL << 47)))
-            return nullptr;
+            --until_recheck;
+            return node;
+        }
 
-        if (LIKELY(size <= TINY_LARGE_THRESHOLD))
+        void* allocate_span(const size_t count, const uint8_t size_class, bool* zeroed = nullptr) noexcept
         {
-            const uint8_t size_class = (size - 1) >> 3;
-            if (UNLIKELY(size_class >= TINY_CLASSES))
-                return nullptr;
-
-            if (auto *tiny_pool = tiny_pools_[size_class])
+            const size_t local = local_node();
+            do
             {
-                if (void *ptr = tiny_pool->allocate_tiny(size_class))
+                for (segment* seg = segments; seg; seg = seg->next)
                 {
-                    auto *header = new(ptr) block_header();
-                    header->init(size, size_class, false);
-                    return static_cast<char *>(ptr) + sizeof(block_header);
+                    seg->reclaim_remote();
+                    if (seg->node != local)
+                        continue;
+                    if (void* span = seg->allocate_span(count, size_class, zeroed))
+                        return span;
                 }
-            }
+                // out of room: a segment an exited thread left is still warm
+            } while (!spare && adopt(local));
 
-            static std::mutex init_mutex;
-            std::lock_guard lock(init_mutex);
-            if (!tiny_pools_[size_class])
+            if (spare && spare->node != local)
             {
-                try
-                {
-                    tiny_pools_[size_class] = new(std::align_val_t{PG_SIZE})
-                            tiny_block_manager::tiny_pool();
-                    return allocate(size);
-                } catch (...)
+                segment::unreserve(spare);
+                spare = nullptr;
+            }
+            segment* seg = spare ? spare : segment::reserve(local);
+            spare = nullptr;
+            if (UNLIKELY(!seg))
+            {
+                // out of memory locally, any node will do
+                for (seg = segments; seg; seg = seg->next)
                 {
-                    return nullptr;
+                    if (void* span = seg->allocate_span(count, size_class, zeroed))
+                        return span;
                 }
+                return nullptr;
             }
-            return nullptr;
+
+            link(seg);
+            return seg->allocate_span(count, size_class, zeroed);
         }
 
-        if (LIKELY(size >= PG_SIZE))
-            return allocate_large(size);
-
-        if (size <= SMALL_LARGE_THRESHOLD)
+        void link(segment* seg) noexcept
         {
-            const uint8_t size_class = (size - 1) >> 3;
-            if (void *cached = thread_cache_.get(size_class))
-            {
-                auto *header = reinterpret_cast<block_header *>(static_cast<char *>(cached) - sizeof(block_header));
-                header->set_free(false);
-                return cached;
-            }
-            return allocate_small(size);
+            seg->tag.store(current_owner(), std::memory_order_release);
+            seg->prev = nullptr;
+            seg->next = segments;
+            if (segments)
+                segments->prev = seg;
+            segments = seg;
         }
 
-        const size_t size_class = 31 - __builtin_clz(size - 1);
-        return allocate_medium(size, size_class);
-    }
-
-    ALWAYS_INLINE
-    static void deallocate(void* ptr) noexcept
-    {
-        if (!ptr)
-            return;
-        if (UNLIKELY(!block_header::is_aligned(ptr)))
-            return;
-
-        auto* header = reinterpret_cast<block_header*>(
-            static_cast<char*>(ptr) - sizeof(block_header));
+        // Takes over an orphaned segment of `node` together with the pool
+        // pages in it, false when there is none
+        bool adopt(const size_t node) noexcept
+        {
+            segment* seg = orphans_.pop_segment(node);
+            if (!seg)
+                return false;
+            link(seg);
+            adopt_pages(seg);
+            return true;
+        }
 
-        if (UNLIKELY(!header->is_valid()))
-            return;
+        void free_span(void* span) noexcept
+        {
+            segment* seg = segment::of(span);
+            seg->free_span(span);
+            if (LIKELY(!seg->is_empty()))
+                return;
 
-        if (UNLIKELY((reinterpret_cast<uintptr_t>(ptr) & ~(PG_SIZE-1)) == 0))
-            return;
+            if (seg->prev)
+                seg->prev->next = seg->next;
+            else
+                segments = seg->next;
+            if (seg->next)
+                seg->next->prev = seg->prev;
 
-        const uint8_t size_class = header->size_class();
-        if (UNLIKELY(size_class >= SIZE_CLASSES && size_class != 255))
-            return;
+            if (spare)
+                segment::unreserve(spare);
+            spare = seg;
+        }
 
-        if (size_class < TINY_CLASSES)
+        // Thread exit. Segments go to the orphanage with whatever pages
+        // and spans are still live in them, see release_page; frees into
+        // them are parked on their remote lists until a thread adopts them.
+        void release() noexcept
         {
-            if (header->is_free())
-                return;
-
-            if (auto* tiny_pool = tiny_pools_[size_class])
+            for (segment* seg = segments; seg;)
             {
-                header->set_free(true);
-                tiny_pool->deallocate_tiny(
-                    static_cast<char*>(ptr) - sizeof(block_header),
-                    size_class
-                );
+                segment* next = seg->next;
+                orphans_.push_segment(seg);
+                seg = next;
             }
-            return;
+            segments = nullptr;
+            if (spare)
+                orphans_.push_segment(spare);
+            spare = nullptr;
         }
+    };
 
-        if (UNLIKELY(size_class == 255))
+    // Recently freed mid-size spans, binned by page count, so a block of the
+    // same size is reused without touching the segment bitmap. Linked
+    // through block_header::next_physical.
+    struct span_cache_t
+    {
+        struct bin
         {
-            if (large_block_cache_.cache_block(ptr, header->size()))
-                return;
-            void* block = static_cast<char*>(ptr) - sizeof(block_header);
-            if (header->is_memory_mapped())
-            {
-                const size_t total_size = header->size() + sizeof(block_header);
-                // Determine if we need one or more pages
-                const size_t allocation_size = total_size <= PG_SIZE
-                                                   ? PG_SIZE
-                                                   : (total_size + PG_SIZE - 1) & ~(PG_SIZE - 1);
-                UNMAP_MEMORY(block, allocation_size);
-            } else
+            block_header* head{nullptr};
+            size_t count{0};
+        };
+
+        bin bins[MID_MAX_PAGES + 1]{};
+
+        ALWAYS_INLINE
+        block_header* get(const size_t pages) noexcept
+        {
+            auto& b = bins[pages];
+            block_header* span = b.head;
+            if (span)
             {
-                free(block);
+                b.head = span->next_physical;
+                --b.count;
             }
-            return;
+            return span;
         }
 
-        if (header->is_free())
-            return;
-
-        if (thread_cache_.put(ptr, size_class))
+        ALWAYS_INLINE
+        bool put(block_header* span, const size_t pages) noexcept
         {
-            header->set_free(true);
-            return;
+            auto& b = bins[pages];
+            if (b.count >= tuning::read(tuning::get().span_cache_depth))
+                return false;
+            span->next_physical = b.head;
+            b.head = span;
+            ++b.count;
+            return true;
         }
 
-        header->set_free(true);
-        if (header->try_coalesce())
+        void release() noexcept
         {
-            auto* pool_start = reinterpret_cast<void*>(
-                reinterpret_cast<uintptr_t>(header) & ~(PG_SIZE - 1));
-            static_cast<pool*>(pool_start)->return_memory();
+            for (auto& b : bins)
+            {
+                for (block_header* span = b.head; span;)
+                {
+                    block_header* next = span->next_physical;
+                    JALLOC_STAT(stat(STAT_SPANS).cached_bytes.sub(segment::of(span)->span_pages(span) * PG_SIZE));
+                    JALLOC_STAT(stat_return(STAT_SPANS, segment::of(span)->span_pages(span) * PG_SIZE));
+                    page_heap_.free_span(span);
+                    span = next;
+                }
+                b = bin{};
+            }
         }
+    };
 
-        void* block = static_cast<char*>(ptr) - sizeof(block_header);
-        pool_manager_.deallocate(block, size_class);
+    // Thread exit. A page that other threads still hold blocks in stays mapped
+    // and loses its owner tag, so later frees into it are parked on its
+    // remote list instead of touching the dead thread's bookkeeping. The
+    // thread that adopts its segment takes it over, see adopt_pages.
+    ALWAYS_INLINE
+    static void release_page(page_owner* page) noexcept
+    {
+        if (page->used == 0)
+        {
+            JALLOC_STAT(stat_return(page->size_class, PG_SIZE));
+            page_heap_.free_span(page);
+            return;
+        }
+        page->tag.store(0, std::memory_order_release);
+        page->list = page_owner::LIST_NONE;
     }
 
-    ALWAYS_INLINE NO_SANITIZE_ADDRESS
-    static void* reallocate(void* ptr, const size_t new_size) noexcept
+    struct alignas(PG_SIZE) pool
     {
-        if (UNLIKELY(!ptr))
-            return allocate(new_size);
-
-        if (UNLIKELY(!block_header::is_aligned(ptr)))
-            return nullptr;
+        page_owner owner;
+        Jallocator::bitmap bitmap;
+        alignas(CACHE_LINE_SIZE) uint8_t memory[POOL_CAPACITY]{};
 
-        if (UNLIKELY(new_size == 0))
+        explicit pool(const uint8_t size_class) noexcept
+            : owner(size_class)
         {
-            deallocate(ptr);
-            return nullptr;
+            bitmap.reset(size_classes[size_class].blocks);
         }
-        // cool thing I just learned
-        // header is 100% not null if the ptr is aligned!
-        const auto* header = reinterpret_cast<block_header*>(
-            static_cast<char*>(ptr) - sizeof(block_header));
-
-        if (UNLIKELY(!header))
-            return nullptr;
-
-        if (UNLIKELY(!header->is_valid()))
-            return nullptr;
-
-        if (UNLIKELY(header->size() > (1ULL << 47)))
-            return nullptr;
-
-        const size_t old_size = header->size();
-        const uint8_t old_class = header->size_class();
 
-#if defined(__clang__)
-        HAVE_BUILTIN_ASSUME(old_class <= SIZE_CLASSES);
-#endif
-
-        if (old_class < TINY_CLASSES)
+        // Fills `out` with up to `max` slots, a bitmap word at a time
+        ALWAYS_INLINE
+        size_t allocate_batch(const size_class &sc, void** out, const size_t max) noexcept
         {
-            if (const size_t max_tiny_size = (old_class + 1) << 3; new_size <= max_tiny_size)
-                return ptr;
+            size_t count = 0;
+            size_t word = 0;
+            while (count < max)
+            {
+                uint64_t bits = bitmap.claim_batch(max - count, word);
+                if (!bits)
+                    break;
+                for (; bits; bits &= bits - 1)
+                {
+                    const size_t index = word * bitmap::bits_per_word + count_trailing_zeros(bits);
+                    out[count++] = memory + index * sc.slot_size;
+                }
+            }
+            owner.used += static_cast<uint16_t>(count);
+            return count;
         }
-        else if (old_class < SIZE_CLASSES)
+
+        ALWAYS_INLINE
+        void deallocate(void* ptr, const size_class& sc) noexcept
         {
-            if (const size_t max_size = size_classes[old_class].size; new_size <= max_size)
-                return ptr;
+            const size_t offset = static_cast<uint8_t*>(ptr) - memory;
+            bitmap.mark_free(offset / sc.slot_size);
+            --owner.used;
         }
 
-        if (UNLIKELY(header->is_memory_mapped()))
+        // Owner only. Returns how many blocks other threads had handed back.
+        ALWAYS_INLINE
+        size_t reclaim_remote(const size_class& sc) noexcept
         {
-            #ifdef __linux__
-            void* block = static_cast<char*>(ptr) - sizeof(block_header);
-            const size_t new_total = new_size + sizeof(block_header);
-            const size_t old_total = old_size + sizeof(block_header);
-            void* new_block = mremap(block, old_total, new_total, MREMAP_MAYMOVE);
-            if (new_block != MAP_FAILED)
+            size_t reclaimed = 0;
+            for (void* ptr = owner.take_remote(); ptr; ++reclaimed)
             {
-                auto* new_header = reinterpret_cast<block_header*>(new_block);
-                new_header->encode(new_size, 255, false);
-                new_header->set_memory_mapped(true);
-                return static_cast<char*>(new_block) + sizeof(block_header);
+                void* next = *static_cast<void**>(ptr);
+                deallocate(ptr, sc);
+                ptr = next;
             }
-            #endif
+            return reclaimed;
         }
 
-        void* new_ptr = allocate(new_size);
-        if (UNLIKELY(!new_ptr))
-            return nullptr;
-
-        if (const size_t copy_size = old_size < new_size ? old_size : new_size; copy_size <= 32)
+        ALWAYS_INLINE
+        bool is_completely_free() const noexcept
         {
-            std::memcpy(new_ptr, ptr, copy_size);
+            return bitmap.is_completely_free();
         }
-        else if (copy_size >= 4096)
+    };
+
+    struct tiny_block_manager
+    {
+        struct alignas(PG_SIZE) tiny_pool
         {
-            prefetch_range(ptr, copy_size);
-            prefetch_range(new_ptr, copy_size);
+            page_owner owner;
+            Jallocator::bitmap bitmap;
+            alignas(ALIGNMENT) uint8_t memory[POOL_CAPACITY]{};
 
-            const auto dst = static_cast<char*>(new_ptr);
-            const auto src = static_cast<const char*>(ptr);
+            explicit tiny_pool(const uint8_t size_class) noexcept
+                : owner(size_class)
+            {
+                bitmap.reset(size_classes[size_class].blocks);
+            }
 
-            #if defined(__AVX512F__)
-                for (size_t i = 0; i < copy_size; i += 64)
-                {
-                    __m512i v = _mm512_loadu_si512((const __m512i*)(src + i));
-                    _mm512_stream_si512((__m512i*)(dst + i), v);
-                }
-            #elif defined(__AVX2__)
-                for (size_t i = 0; i < copy_size; i += 32)
+            ALWAYS_INLINE
+            void* allocate_tiny(const uint8_t size_class) noexcept
+            {
+                if (void* block = claim_tiny(size_class))
+                    return block;
+
+                if (UNLIKELY(owner.has_remote()))
                 {
-                    __m256i v = _mm256_loadu_si256((const __m256i*)(src + i));
-                    _mm256_stream_si256((__m256i*)(dst + i), v);
+                    reclaim_remote(size_class);
+                    return claim_tiny(size_class);
                 }
-            #elif defined(__aarch64__)
-                for (size_t i = 0; i < copy_size; i += 64)
+                return nullptr;
+            }
+
+            ALWAYS_INLINE
+            void* claim_tiny(const uint8_t size_class) noexcept
+            {
+                const auto& sc = size_classes[size_class];
+                if (const size_t index = bitmap.find_free_block();
+                    index != ~static_cast<size_t>(0) && index < sc.blocks)
                 {
-                    auto src_bytes = reinterpret_cast<const uint8_t*>(src + i);
-                    auto dst_bytes = reinterpret_cast<uint8_t*>(dst + i);
-                    uint8x16x4_t v = vld4q_u8(src_bytes);
-                    vst4q_u8(dst_bytes, v);
+                    ++owner.used;
+                    return memory + index * sc.slot_size;
                 }
-            #endif
-            memory_fence();
+                return nullptr;
+            }
 
-            for (size_t i = 0; i < copy_size; i += 8)
-                stream_store(dst + i,
-                    *reinterpret_cast<const int64_t*>(src + i));
-            memory_fence();
-        }
-        else
-        {
-            #if defined(__GLIBC__) && defined(__GLIBC_PREREQ)
-                #if __GLIBC_PREREQ(2, 14)
-                    __memcpy_chk(new_ptr, ptr, copy_size, copy_size);
-                #else
-                    std::memcpy(new_ptr, ptr, copy_size);
-                #endif
-            #else
-                std::memcpy(new_ptr, ptr, copy_size);
-            #endif
-        }
+            ALWAYS_INLINE
+            void deallocate_tiny(void *ptr, const uint8_t size_class) noexcept
+            {
+                const size_t slot_size = size_classes[size_class].slot_size;
+                const size_t offset = static_cast<uint8_t *>(ptr) - memory;
+                const size_t index = offset / slot_size;
 
-        deallocate(ptr);
-        return new_ptr;
-    }
+                if (index * slot_size < sizeof(memory))
+                {
+                    bitmap.mark_free(index);
+                    --owner.used;
+                }
+            }
 
-    ALWAYS_INLINE NO_SANITIZE_ADDRESS
-    static void* callocate(const size_t num, const size_t size) noexcept
-    {
-        if (UNLIKELY(num == 0 || size == 0))
-            return nullptr;
+            // Owner only
+            ALWAYS_INLINE
+            void reclaim_remote(const uint8_t size_class) noexcept
+            {
+                for (void* ptr = owner.take_remote(); ptr;)
+                {
+                    void* next = *static_cast<void**>(ptr);
+                    deallocate_tiny(ptr, size_class);
+                    ptr = next;
+                }
+            }
+        };
 
-        if (UNLIKELY(num > SIZE_MAX / size))
-            return nullptr;
+        // Pages of one class: `current` serves allocations, exhausted pages
+        // park on `full`, pages that got blocks back wait on `partial`.
+        struct class_pages
+        {
+            tiny_pool* current{nullptr};
+            page_list partial;
+            page_list full;
+        };
 
-        size_t total_size = num * size;
-        void* ptr = allocate(total_size);
+        // How many full pages refill() looks at for pending remote frees
+        // before it gives up and maps a new page.
+        static constexpr size_t REMOTE_SCAN_LIMIT = 16;
 
-        if (UNLIKELY(!ptr))
-            return nullptr;
+        std::array<class_pages, TINY_CLASSES> classes{};
 
-        if (total_size <= 32)
+        ALWAYS_INLINE
+        void* allocate(const uint8_t size_class) noexcept
         {
-            std::memset(ptr, 0, total_size);
-            return ptr;
+            if (tiny_pool* current = classes[size_class].current; LIKELY(current))
+            {
+                if (void* block = current->allocate_tiny(size_class))
+                    return block;
+            }
+            return refill(size_class);
         }
 
-        #ifdef __linux__
-            if (total_size >= 4096)
+        // Retire the exhausted current page and find another one with room
+        void* refill(const uint8_t size_class) noexcept
+        {
+            auto& cls = classes[size_class];
+            if (cls.current)
             {
-                char* page_aligned = reinterpret_cast<char*>(
-                    (reinterpret_cast<uintptr_t>(ptr) + 4095) & ~4095ULL);
-                size_t prefix = page_aligned - static_cast<char*>(ptr);
-                size_t suffix = (total_size - prefix) & 4095;
-                size_t middle = total_size - prefix - suffix;
-
-                auto zero_range = [](void* dst, size_t size)
-                {
-                    #if defined(__AVX512F__)
-                        auto* aligned_dst = reinterpret_cast<__m512i*>((reinterpret_cast<uintptr_t>(dst) + 63) & ~63ULL);
-                        size_t pre = reinterpret_cast<char*>(aligned_dst) - static_cast<char*>(dst);
-                        if (pre) std::memset(dst, 0, pre);
-
-                        __m512i zero = _mm512_setzero_si512();
-                        for (size_t i = 0; i < (size - pre) / 64; ++i)
-                            _mm512_stream_si512(aligned_dst + i, zero);
-
-                        size_t post = (size - pre) & 63;
-                        if (post) std::memset(reinterpret_cast<char*>(aligned_dst + (size - pre) / 64), 0, post);
-
-                    #elif defined(__AVX2__)
-                        auto* aligned_dst = reinterpret_cast<__m256i*>((reinterpret_cast<uintptr_t>(dst) + 31) & ~31ULL);
-                        size_t pre = reinterpret_cast<char*>(aligned_dst) - static_cast<char*>(dst);
-                        if (pre) std::memset(dst, 0, pre);
-
-                        __m256i zero = _mm256_setzero_si256();
-                        for (size_t i = 0; i < (size - pre) / 32; ++i)
-                            _mm256_stream_si256(aligned_dst + i, zero);
-
-                        size_t post = (size - pre) & 31;
-                        if (post) std::memset(reinterpret_cast<char*>(aligned_dst + (size - pre) / 32), 0, post);
-
-                    #elif defined(__aarch64__)
-                        auto* aligned_dst = reinterpret_cast<uint8_t*>((reinterpret_cast<uintptr_t>(dst) + 15) & ~15ULL);
-                        size_t pre = aligned_dst - static_cast<uint8_t*>(dst);
-                        if (pre) std::memset(dst, 0, pre);
-
-                        uint8x16x4_t zero = { vdupq_n_u8(0), vdupq_n_u8(0), vdupq_n_u8(0), vdupq_n_u8(0) };
-                        for (size_t i = 0; i < (size - pre) / 64; ++i)
-                            vst4q_u8(aligned_dst + i * 64, zero);
-
-                        size_t post = (size - pre) & 63;
-                        if (post) std::memset(aligned_dst + ((size - pre) / 64) * 64, 0, post);
-                    #else
-                        std::memset(dst, 0, size);
-                    #endif
-                };
-
-                if (prefix)
-                    zero_range(ptr, prefix);
+                cls.current->owner.list = page_owner::LIST_FULL;
+                cls.full.push_front(&cls.current->owner);
+                cls.current = nullptr;
+            }
 
-                if (middle)
+            page_owner* page = cls.partial.pop_front();
+            if (!page)
+            {
+                // Full pages only become usable again through remote frees
+                for (size_t i = 0; i < REMOTE_SCAN_LIMIT && cls.full.head; ++i)
                 {
-                    if (madvise(page_aligned, middle, MADV_DONTNEED) == 0)
+                    page_owner* candidate = cls.full.tail;
+                    cls.full.remove(candidate);
+                    if (candidate->has_remote())
                     {
-                        if (suffix)
-                            zero_range(page_aligned + middle, suffix);
-                        memory_fence();
-                        return ptr;
+                        page = candidate;
+                        break;
                     }
+                    cls.full.push_front(candidate);
                 }
             }
-        #endif
 
-        auto dst = static_cast<char*>(ptr);
-        #if defined(__AVX512F__)
-            __m512i zero = _mm512_setzero_si512();
-            auto* aligned_dst = reinterpret_cast<__m512i*>((reinterpret_cast<uintptr_t>(dst) + 63) & ~63ULL);
-            size_t pre = reinterpret_cast<char*>(aligned_dst) - dst;
-            if (pre) std::memset(dst, 0, pre);
-
-            size_t blocks = (total_size - pre) / 64;
-            for (size_t i = 0; i < blocks; ++i)
-                _mm512_stream_si512(aligned_dst + i, zero);
-
-            size_t remain = (total_size - pre) & 63;
-            if (remain)
-                std::memset(reinterpret_cast<char*>(aligned_dst + blocks), 0, remain);
-
-        #elif defined(__AVX2__)
-            __m256i zero = _mm256_setzero_si256();
-            auto* aligned_dst = reinterpret_cast<__m256i*>((reinterpret_cast<uintptr_t>(dst) + 31) & ~31ULL);
-            size_t pre = reinterpret_cast<char*>(aligned_dst) - dst;
-            if (pre) std::memset(dst, 0, pre);
-
-            size_t blocks = (total_size - pre) / 32;
-            for (size_t i = 0; i < blocks; ++i)
-                _mm256_stream_si256(aligned_dst + i, zero);
-
-            size_t remain = (total_size - pre) & 31;
-            if (remain)
-                std::memset(reinterpret_cast<char*>(aligned_dst + blocks), 0, remain);
-
-        #elif defined(__aarch64__)
-            uint8x16x4_t zero = { vdupq_n_u8(0), vdupq_n_u8(0), vdupq_n_u8(0), vdupq_n_u8(0) };
-            auto* dst_bytes = reinterpret_cast<uint8_t*>(dst);
-            auto* aligned_dst = reinterpret_cast<uint8_t*>((reinterpret_cast<uintptr_t>(dst_bytes) + 15) & ~15ULL);
-            size_t pre = aligned_dst - dst_bytes;
-            if (pre) std::memset(dst_bytes, 0, pre);
-
-            size_t blocks = (total_size - pre) / 64;
-            for (size_t i = 0; i < blocks; ++i)
-                vst4q_u8(aligned_dst + i * 64, zero);
-
-        if (size_t remain = (total_size - pre) & 63)
-                std::memset(aligned_dst + blocks * 64, 0, remain);
-
-        #else
-            if (const size_t align = reinterpret_cast<uintptr_t>(dst) & 7)
+            tiny_pool* next = reinterpret_cast<tiny_pool*>(page);
+            if (!next)
             {
-                std::memset(dst, 0, align);
-                dst += align;
-                total_size -= align;
+                void* span = page_heap_.allocate_span(1, size_class);
+                if (UNLIKELY(!span))
+                    return nullptr;
+                JALLOC_STAT(stat(size_class).mapped_bytes.add(PG_SIZE));
+                next = new (span) tiny_pool(size_class);
             }
 
-            const size_t blocks = total_size >> 3;
-            for (size_t i = 0; i < blocks; ++i)
-                stream_store(dst + (i << 3), 0LL);
+            next->owner.list = page_owner::LIST_NONE;
+            cls.current = next;
+            return next->allocate_tiny(size_class);
+        }
 
-            if (const size_t remain = total_size & 7)
-                std::memset(dst + (blocks << 3), 0, remain);
-        #endif
+        ALWAYS_INLINE
+        void deallocate(void* ptr, const uint8_t size_class) noexcept
+        {
+            auto* page = pool_from<tiny_pool>(ptr);
+            page->deallocate_tiny(ptr, size_class);
 
-        memory_fence();
-        return ptr;
-    }
+            if (page->owner.list == page_owner::LIST_NONE)
+                return;
 
-    ALWAYS_INLINE
-    static void cleanup() noexcept
-    {
-        large_block_cache_.clear();
-        thread_cache_.clear();
+            auto& cls = classes[size_class];
+            if (page->owner.list == page_owner::LIST_FULL)
+            {
+                cls.full.remove(&page->owner);
+                page->owner.list = page_owner::LIST_PARTIAL;
+                cls.partial.push_front(&page->owner);
+            }
+
+            // Empty pages other than the current one go back to the OS.
+            // Nothing can still be in flight: remote frees count as used.
+            if (page->owner.used == 0)
+            {
+                cls.partial.remove(&page->owner);
+                JALLOC_STAT(stat_return(size_class, PG_SIZE));
+                page_heap_.free_span(page);
+            }
+        }
 
-        for (auto*& pool : tiny_pools_)
+        // A page of an adopted segment, already carrying this thread's tag
+        void adopt(page_owner* page) noexcept
         {
-            if (pool)
+            auto* tiny = reinterpret_cast<tiny_pool*>(page);
+            tiny->reclaim_remote(page->size_class);
+            if (page->used == 0)
             {
-                operator delete(pool, std::align_val_t{PG_SIZE});
-                pool = nullptr;
+                JALLOC_STAT(stat_return(page->size_class, PG_SIZE));
+                page_heap_.free_span(page);
+                return;
             }
+            auto& cls = classes[page->size_class];
+            const bool full = page->used >= size_classes[page->size_class].blocks;
+            page->list = full ? page_owner::LIST_FULL : page_owner::LIST_PARTIAL;
+            (full ? cls.full : cls.partial).push_back(page);
         }
-    }
-};
 
-// Initialization
-thread_local thread_cache_t Jallocator::thread_cache_{};
-thread_local Jallocator::pool_manager Jallocator::pool_manager_{};
-thread_local Jallocator::large_block_cache_t Jallocator::large_block_cache_{};
-thread_local std::array<Jallocator::tiny_block_manager::tiny_pool *,
-    TINY_CLASSES>
-Jallocator::tiny_pools_{};
+        void release() noexcept
+        {
+            for (auto& cls : classes)
+            {
+                if (cls.current)
+                {
+                    cls.current->reclaim_remote(cls.current->owner.size_class);
+                    release_page(&cls.current->owner);
+                }
+                while (page_owner* page = cls.partial.pop_front())
+                {
+                    reinterpret_cast<tiny_pool*>(page)->reclaim_remote(page->size_class);
+                    release_page(page);
+                }
+                while (page_owner* page = cls.full.pop_front())
+                {
+                    reinterpret_cast<tiny_pool*>(page)->reclaim_remote(page->size_class);
+                    release_page(page);
+                }
+                cls = class_pages{};
+            }
+        }
+    };
 
-// C API
-#ifndef __cplusplus
-{
- extern  "C"
-{
+    static_assert(sizeof(pool) == PG_SIZE);
+    static_assert(sizeof(tiny_block_manager::tiny_pool) == PG_SIZE);
+    static_assert(sizeof(page_owner) + sizeof(bitmap) <= POOL_HEADER_SIZE);
+    static_assert(sizeof(block_header) == BLOCK_HEADER_SIZE);
 
-}
-    ALWAYS_INLINE
-    void* malloc(const size_t size)
+    // Small and medium pools, one page each, drawn from the page heap.
+    // Pools with free slots sit on `partial`, exhausted ones on `full`.
+    struct pool_manager
     {
-        return Jallocator::allocate(size);
-    }
+        struct class_pools
+        {
+            page_list partial;
+            page_list full;
+        };
 
-    ALWAYS_INLINE
-    void free(void* ptr)
-    {
-        Jallocator::deallocate(ptr);
-    }
+        // How many full pools allocate() checks for pending remote frees
+        // before it takes a new page.
+        static constexpr size_t REMOTE_SCAN_LIMIT = 16;
 
-    ALWAYS_INLINE
-    void* realloc(void* ptr, const size_t new_size)
-    {
-        return Jallocator::reallocate(ptr, new_size);
-    }
+        alignas(CACHE_LINE_SIZE) class_pools pools[SIZE_CLASSES]{};
 
-    ALWAYS_INLINE
-    void* calloc(const size_t num, const size_t size)
-    {
-        return Jallocator::callocate(num, size);
-    }
+        ALWAYS_INLINE
+        void* allocate(const uint8_t size_class) noexcept
+        {
+            void* ptr = nullptr;
+            allocate_batch(size_class, &ptr, 1);
+            return ptr;
+        }
 
-    ALWAYS_INLINE
-    void cleanup()
-    {
-        Jallocator::cleanup();
-    }
-}
-#endif
+        // Up to `max` blocks of one class. Only maps a new page when nothing
+        // at all could be found, a short batch is fine.
+        size_t allocate_batch(const uint8_t size_class, void** out, const size_t max) noexcept
+        {
+            const auto& sc = size_classes[size_class];
+            auto& cls = pools[size_class];
+            size_t count = 0;
 
-// inline void* operator new(size_t __sz)
-// {
-//     return Jallocator::allocate(__sz);
-// }
-//
-// inline void* operator new[](size_t __sz)
-// {
-//     return Jallocator::allocate(__sz);
-// }
-//
-// inline void operator delete(void* __p) noexcept
-// {
-//     Jallocator::deallocate(__p);
-// }
-//
-// inline void operator delete[](void* __p) noexcept
-// {
-//     Jallocator::deallocate(__p);
-// }
+            while (count < max)
+            {
+                page_owner* head = cls.partial.head;
+                if (!head && (count > 0 || !(head = next_pool(size_class))))
+                    break;
+
+                count += reinterpret_cast<pool*>(head)->allocate_batch(sc, out + count, max - count);
+                if (count < max)
+                {
+                    cls.partial.remove(head);
+                    head->list = page_owner::LIST_FULL;
+                    cls.full.push_front(head);
+                }
+            }
+            return count;
+        }
+
+        // Partial list ran dry: revive a full pool with remote frees, or map one
+        page_owner* next_pool(const uint8_t size_class) noexcept
+        {
+            const auto& sc = size_classes[size_class];
+            auto& cls = pools[size_class];
+
+            for (size_t i = 0; i < REMOTE_SCAN_LIMIT && cls.full.tail; ++i)
+            {
+                page_owner* candidate = cls.full.tail;
+                cls.full.remove(candidate);
+                if (candidate->has_remote())
+                {
+                    reinterpret_cast<pool*>(candidate)->reclaim_remote(sc);
+                    candidate->list = page_owner::LIST_PARTIAL;
+                    cls.partial.push_front(candidate);
+                    return candidate;
+                }
+                cls.full.push_front(candidate);
+            }
+
+            void* span = page_heap_.allocate_span(1, size_class);
+            if (UNLIKELY(!span))
+                return nullptr;
+            JALLOC_STAT(stat(size_class).mapped_bytes.add(PG_SIZE));
+
+            auto* new_pool = new (span) pool(size_class);
+            new_pool->owner.list = page_owner::LIST_PARTIAL;
+            cls.partial.push_front(&new_pool->owner);
+            return &new_pool->owner;
+        }
+
+        ALWAYS_INLINE
+        void deallocate(void* ptr, const uint8_t size_class) noexcept
+        {
+            if (UNLIKELY((reinterpret_cast<uintptr_t>(ptr) & ~(PG_SIZE-1)) == 0))
+                return;
+
+            if (UNLIKELY(size_class >= SIZE_CLASSES))
+                return;
+
+            // Pools are page aligned, so the owning pool is one mask away
+            auto* p = pool_from<pool>(ptr);
+            page_owner* page = &p->owner;
+            if (UNLIKELY(page->signature != POOL_SIGNATURE || page->size_class != size_class))
+                return;
+
+            p->deallocate(ptr, size_classes[size_class]);
+
+            // An empty pool goes back to the page heap unless it is the one
+            // allocations are served from, which would only be rebuilt next time
+            auto& cls = pools[size_class];
+            if (UNLIKELY(page->used == 0 && page != cls.partial.head))
+            {
+                (page->list == page_owner::LIST_FULL ? cls.full : cls.partial).remove(page);
+                JALLOC_STAT(stat_return(size_class, PG_SIZE));
+                page_heap_.free_span(p);
+                return;
+            }
+
+            if (page->list == page_owner::LIST_FULL)
+            {
+                cls.full.remove(page);
+                page->list = page_owner::LIST_PARTIAL;
+                cls.partial.push_front(page);
+            }
+        }
+
+        // Behind the pools that are already partial, so the one allocations
+        // are served from stays in front
+        void adopt(page_owner* page) noexcept
+        {
+            const uint8_t size_class = page->size_class;
+            reinterpret_cast<pool*>(page)->reclaim_remote(size_classes[size_class]);
+            if (page->used == 0)
+            {
+                JALLOC_STAT(stat_return(size_class, PG_SIZE));
+                page_heap_.free_span(page);
+                return;
+            }
+            auto& cls = pools[size_class];
+            const bool full = page->used >= size_classes[size_class].blocks;
+            page->list = full ? page_owner::LIST_FULL : page_owner::LIST_PARTIAL;
+            (full ? cls.full : cls.partial).push_back(page);
+        }
+
+        void release() noexcept
+        {
+            for (uint8_t size_class = 0; size_class < SIZE_CLASSES; ++size_class)
+            {
+                auto& cls = pools[size_class];
+                while (page_owner* page = cls.partial.pop_front())
+                {
+                    reinterpret_cast<pool*>(page)->reclaim_remote(size_classes[size_class]);
+                    release_page(page);
+                }
+                while (page_owner* page = cls.full.pop_front())
+                {
+                    reinterpret_cast<pool*>(page)->reclaim_remote(size_classes[size_class]);
+                    release_page(page);
+                }
+            }
+        }
+    };
+
+    // Per-thread cache of mapped blocks. Mapping sizes are rounded up to
+    // one of four bins per power of two, so any block in a bin fits any
+    // request for that bin. Blocks idle for longer than the decay interval
+    // in tuning are unmapped the next time the cache is touched.
+    struct alignas(CACHE_LINE_SIZE) large_block_cache_t
+    {
+        struct cache_entry
+        {
+            void* block;
+            size_t size; // bytes mapped, header included
+            uint64_t last_use;
+            size_t node; // the node it was cached on
+        };
+
+        struct bin
+        {
+            cache_entry entries[LARGE_CACHE_DEPTH];
+            size_t count;
+        };
+
+        static constexpr size_t MIN_BIN_SHIFT = 12; // bins start above MIN_CACHE_BLOCK
+        static constexpr size_t NUM_BINS = (63 - __builtin_clzll(MAX_CACHE_BLOCK) - MIN_BIN_SHIFT) * 4;
+
+        bin bins[NUM_BINS]{};
+        size_t total_cached{0};
+        uint64_t last_decay{0};
+
+        ALWAYS_INLINE
+        static uint64_t get_timestamp() noexcept
+        {
+#if defined(__x86_64__)
+#if defined(_MSC_VER)
+                    return __rdtsc();
+#else
+                    unsigned int aux;
+                    return __rdtscp(&aux);
+#endif
+#elif defined(__aarch64__)
+            // Use CNTVCT_EL0 (Virtual Count Register) for ARM64
+            uint64_t timestamp;
+#if defined(_MSC_VER)
+                    timestamp = _ReadStatusReg(ARM64_CNTVCT_EL0);
+#else
+            asm volatile("mrs %0, cntvct_el0" : "=r"(timestamp));
+#endif
+            return timestamp;
+#else
+                // Fallback for other architectures
+                return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+        }
+
+        // get_timestamp() rate, measured once against the steady clock
+        // where the counter frequency cannot be read
+        static uint64_t ticks_per_ms() noexcept
+        {
+            static const uint64_t rate = []
+            {
+#if defined(__aarch64__) && !defined(_MSC_VER)
+                uint64_t frequency;
+                asm volatile("mrs %0, cntfrq_el0" : "=r"(frequency));
+                return frequency / 1000;
+#elif defined(__x86_64__)
+                using clock = std::chrono::steady_clock;
+                const auto start = clock::now();
+                const uint64_t first = get_timestamp();
+                while (clock::now() - start < std::chrono::milliseconds(2))
+                {
+                }
+                const uint64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    clock::now() - start).count();
+                return (get_timestamp() - first) * 1000000 / (elapsed ? elapsed : 1);
+#else
+                return static_cast<uint64_t>(std::chrono::steady_clock::period::den /
+                                             std::chrono::steady_clock::period::num / 1000);
+#endif
+            }();
+            return rate ? rate : 1;
+        }
+
+        // Bytes mapped for bin `index`: (5..8)/4 of a power of two
+        ALWAYS_INLINE
+        static constexpr size_t bin_size(const size_t index) noexcept
+        {
+            return (5 + (index & 3)) << (index / 4 + MIN_BIN_SHIFT - 2);
+        }
+
+        // Smallest bin whose blocks hold `size` bytes
+        ALWAYS_INLINE
+        static size_t bin_for(const size_t size) noexcept
+        {
+            const size_t octave = 63 - __builtin_clzll(size - 1);
+            const size_t step = octave - 2;
+            const size_t sub = ((size - 1) >> step) - 4; // 0..3
+            return (octave - MIN_BIN_SHIFT) * 4 + sub;
+        }
+
+        // Largest bin whose requests a block of `size` mapped bytes can serve
+        ALWAYS_INLINE
+        static size_t bin_holding(const size_t size) noexcept
+        {
+            const size_t index = bin_for(size);
+            return bin_size(index) > size ? index - 1 : index;
+        }
+
+        // Mapping size for a new block of `size` bytes, header included
+        ALWAYS_INLINE
+        static size_t round_size(const size_t size) noexcept
+        {
+            if (size <= MIN_CACHE_BLOCK || size > MAX_CACHE_BLOCK)
+                return (size + PG_SIZE - 1) & ~(PG_SIZE - 1);
+            return bin_size(bin_for(size));
+        }
+
+        // `size` is the rounded mapping size, `mapped` receives the block's own.
+        // Only blocks cached on `node` are handed out, a thread that moved
+        // lets the old ones decay.
+        ALWAYS_INLINE
+        void *get_cached_block(const size_t size, size_t& mapped, const size_t node) noexcept
+        {
+            if (UNLIKELY(size <= MIN_CACHE_BLOCK || size > MAX_CACHE_BLOCK))
+                return nullptr;
+
+            auto& b = bins[bin_for(size)];
+            for (size_t i = b.count; i-- > 0;)
+            {
+                if (b.entries[i].node != node)
+                    continue;
+
+                const cache_entry entry = b.entries[i];
+                for (size_t j = i + 1; j < b.count; ++j)
+                    b.entries[j - 1] = b.entries[j];
+                --b.count;
+                total_cached -= entry.size;
+                mapped = entry.size;
+                return entry.block;
+            }
+            return nullptr;
+        }
+
+        // `size` is what the block has mapped. Blocks mremap'd to an odd
+        // size go into the largest bin they still fill.
+        ALWAYS_INLINE
+        bool cache_block(void *block, const size_t size, const size_t node) noexcept
+        {
+            if (UNLIKELY(size < bin_size(0) || size > MAX_CACHE_BLOCK))
+                return false;
+
+            const tuning& knobs = tuning::get();
+            const uint64_t now = get_timestamp();
+            if (UNLIKELY(now - last_decay > knobs.large_cache_decay_ticks.load(std::memory_order_relaxed) / 4))
+                decay(now);
+
+            const size_t depth = tuning::read(knobs.large_cache_depth);
+            if (depth == 0 || total_cached + size > tuning::read(knobs.large_cache_bytes))
+                return false;
+
+            auto& b = bins[bin_holding(size)];
+            while (b.count >= depth)
+            {
+                // bin full, the oldest entry makes room
+                unmap(b.entries[0]);
+                for (size_t i = 1; i < b.count; ++i)
+                    b.entries[i - 1] = b.entries[i];
+                --b.count;
+            }
+
+            b.entries[b.count++] = {block, size, now, node};
+            total_cached += size;
+            return true;
+        }
+
+        // Unmaps every entry idle for longer than the decay interval. Entries
+        // are kept oldest first, so expired ones sit at the front of a bin.
+        void decay(const uint64_t now) noexcept
+        {
+            last_decay = now;
+            const uint64_t decay_ticks = tuning::get().large_cache_decay_ticks.load(std::memory_order_relaxed);
+            for (auto& b : bins)
+            {
+                size_t expired = 0;
+                while (expired < b.count && now - b.entries[expired].last_use > decay_ticks)
+                    unmap(b.entries[expired++]);
+                if (expired == 0)
+                    continue;
+                for (size_t i = expired; i < b.count; ++i)
+                    b.entries[i - expired] = b.entries[i];
+                b.count -= expired;
+            }
+        }
+
+        ALWAYS_INLINE
+        void unmap(const cache_entry& entry) noexcept
+        {
+            unmap_entry(entry);
+            total_cached -= entry.size;
+        }
+
+        static void unmap_entry(const cache_entry& entry) noexcept
+        {
+            JALLOC_STAT(stat(STAT_LARGE).cached_bytes.sub(entry.size));
+            JALLOC_STAT(stat_return(STAT_LARGE, entry.size));
+            JALLOC_STAT(stats_registry::bump(stats_registry_.unmap_calls));
+            UNMAP_MEMORY(entry.block, entry.size);
+        }
+
+        ALWAYS_INLINE
+        void clear() noexcept
+        {
+            for (auto& b : bins)
+            {
+                for (size_t i = 0; i < b.count; ++i)
+                    unmap(b.entries[i]);
+                b.count = 0;
+            }
+            total_cached = 0;
+        }
+    };
+
+    // What exited threads leave for the ones that come after them, so a
+    // short-lived thread starts on warm memory rather than fresh mappings.
+    // A segment is adopted whole, pool pages and all, by the next thread
+    // of its node that runs out of room, see page_heap::adopt. Cached
+    // mappings go to whichever thread next misses its own cache. Waiting
+    // segments are linked through segment::next.
+    struct orphanage
+    {
+        using cache_entry = large_block_cache_t::cache_entry;
+
+        spin_lock lock;
+        segment* segments[NUMA_MAX_NODES]{};
+        std::atomic<size_t> segment_count{0};
+        std::atomic<size_t> block_count{0};
+        cache_entry blocks[ORPHAN_LARGE_BLOCKS]{};
+
+        // Called by the owner. Empty segments are only kept while few wait,
+        // ones with live blocks could not be unmapped anyway.
+        void push_segment(segment* seg) noexcept
+        {
+            seg->reclaim_remote();
+            seg->tag.store(0, std::memory_order_release);
+            if (seg->is_empty() && segment_count.load(std::memory_order_relaxed) >= ORPHAN_SEGMENT_LIMIT)
+            {
+                segment::unreserve(seg);
+                return;
+            }
+
+            std::lock_guard guard(lock);
+            seg->prev = nullptr;
+            seg->next = segments[numa::slot(seg->node)];
+            segments[numa::slot(seg->node)] = seg;
+            segment_count.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        segment* pop_segment(const size_t node) noexcept
+        {
+            if (LIKELY(segment_count.load(std::memory_order_relaxed) == 0))
+                return nullptr;
+
+            // nodes past NUMA_MAX_NODES share a list, only take our own
+            std::lock_guard guard(lock);
+            for (segment** link = &segments[numa::slot(node)]; *link; link = &(*link)->next)
+            {
+                segment* seg = *link;
+                if (seg->node != node)
+                    continue;
+                *link = seg->next;
+                seg->next = nullptr;
+                segment_count.fetch_sub(1, std::memory_order_relaxed);
+                return seg;
+            }
+            return nullptr;
+        }
+
+        // Takes over the mappings of `cache` that have not decayed yet, as
+        // many as there is room for; the rest is unmapped
+        void push_blocks(large_block_cache_t& cache) noexcept
+        {
+            const uint64_t now = large_block_cache_t::get_timestamp();
+            const uint64_t decay_ticks = tuning::get().large_cache_decay_ticks.load(std::memory_order_relaxed);
+
+            std::lock_guard guard(lock);
+            size_t count = 0;
+            for (size_t i = 0; i < block_count.load(std::memory_order_relaxed); ++i)
+            {
+                if (now - blocks[i].last_use > decay_ticks)
+                    large_block_cache_t::unmap_entry(blocks[i]);
+                else
+                    blocks[count++] = blocks[i];
+            }
+            for (auto& b : cache.bins)
+            {
+                // newest first, they have the longest to live
+                for (size_t i = b.count; i-- > 0;)
+                {
+                    if (count < ORPHAN_LARGE_BLOCKS && now - b.entries[i].last_use <= decay_ticks)
+                        blocks[count++] = b.entries[i];
+                    else
+                        large_block_cache_t::unmap_entry(b.entries[i]);
+                }
+                b.count = 0;
+            }
+            cache.total_cached = 0;
+            block_count.store(count, std::memory_order_relaxed);
+        }
+
+        // Same contract as large_block_cache_t::get_cached_block
+        void* pop_block(const size_t size, size_t& mapped, const size_t node) noexcept
+        {
+            if (LIKELY(block_count.load(std::memory_order_relaxed) == 0))
+                return nullptr;
+            if (size <= MIN_CACHE_BLOCK || size > MAX_CACHE_BLOCK)
+                return nullptr;
+
+            const size_t bin = large_block_cache_t::bin_for(size);
+            std::lock_guard guard(lock);
+            size_t count = block_count.load(std::memory_order_relaxed);
+            for (size_t i = 0; i < count; ++i)
+            {
+                if (blocks[i].node != node || large_block_cache_t::bin_holding(blocks[i].size) != bin)
+                    continue;
+                void* block = blocks[i].block;
+                mapped = blocks[i].size;
+                blocks[i] = blocks[--count];
+                block_count.store(count, std::memory_order_relaxed);
+                return block;
+            }
+            return nullptr;
+        }
+
+        // Scavenger
+        void drop_blocks() noexcept
+        {
+            if (block_count.load(std::memory_order_relaxed) == 0)
+                return;
+            std::lock_guard guard(lock);
+            for (size_t i = 0; i < block_count.load(std::memory_order_relaxed); ++i)
+                large_block_cache_t::unmap_entry(blocks[i]);
+            block_count.store(0, std::memory_order_relaxed);
+        }
+    };
+
+#ifdef JALLOC_STATS
+    // Only its own thread writes a counter, so a bump is a load and a store
+    // rather than a locked add. stats() reads them from any thread.
+    struct stat_counter
+    {
+        std::atomic<uint64_t> value{0};
+
+        ALWAYS_INLINE
+        void add(const uint64_t n) noexcept
+        {
+            value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+
+        ALWAYS_INLINE
+        void sub(const uint64_t n) noexcept
+        {
+            add(0 - n);
+        }
+
+        ALWAYS_INLINE
+        uint64_t get() const noexcept
+        {
+            return value.load(std::memory_order_relaxed);
+        }
+    };
+
+    // A block freed by another thread is counted by that thread, so one
+    // thread's byte figures can wrap; only the sum over threads is meaningful
+    struct alignas(CACHE_LINE_SIZE) class_counters
+    {
+        stat_counter allocations;
+        stat_counter deallocations;
+        stat_counter cache_hits;
+        stat_counter allocated_bytes;
+        stat_counter cached_bytes;
+        stat_counter mapped_bytes;
+        stat_counter returned_bytes;
+
+        void fold_into(class_counters& total) const noexcept
+        {
+            total.allocations.add(allocations.get());
+            total.deallocations.add(deallocations.get());
+            total.cache_hits.add(cache_hits.get());
+            total.allocated_bytes.add(allocated_bytes.get());
+            total.cached_bytes.add(cached_bytes.get());
+            total.mapped_bytes.add(mapped_bytes.get());
+            total.returned_bytes.add(returned_bytes.get());
+        }
+
+        void fold_into(jalloc::class_stats& total) const noexcept
+        {
+            total.allocations += allocations.get();
+            total.deallocations += deallocations.get();
+            total.cache_hits += cache_hits.get();
+            total.allocated_bytes += allocated_bytes.get();
+            total.cached_bytes += cached_bytes.get();
+            total.mapped_bytes += mapped_bytes.get();
+            total.returned_bytes += returned_bytes.get();
+        }
+    };
+
+    // Pool classes first, then spans and mapped blocks
+    static constexpr size_t STAT_SPANS = SIZE_CLASSES;
+    static constexpr size_t STAT_LARGE = SIZE_CLASSES + 1;
+    static constexpr size_t STAT_CLASSES = SIZE_CLASSES + 2;
+
+    struct thread_stats
+    {
+        class_counters classes[STAT_CLASSES];
+        thread_stats* next{nullptr};
+        thread_stats* prev{nullptr};
+    };
+
+    // Counters of the live threads plus what exited ones left behind.
+    // System calls are rare enough to count in shared atomics.
+    struct stats_registry
+    {
+        spin_lock lock;
+        thread_stats* head{nullptr};
+        thread_stats retired;
+        std::atomic<uint64_t> map_calls{0};
+        std::atomic<uint64_t> unmap_calls{0};
+        std::atomic<uint64_t> purge_calls{0};
+        std::atomic<uint64_t> purged_bytes{0};
+
+        ALWAYS_INLINE
+        static void bump(std::atomic<uint64_t>& counter, const uint64_t n = 1) noexcept
+        {
+            counter.fetch_add(n, std::memory_order_relaxed);
+        }
+
+        void add(thread_stats* stats) noexcept
+        {
+            std::lock_guard guard(lock);
+            stats->prev = nullptr;
+            stats->next = head;
+            if (head)
+                head->prev = stats;
+            head = stats;
+        }
+
+        void remove(thread_stats* stats) noexcept
+        {
+            std::lock_guard guard(lock);
+            if (stats->prev)
+                stats->prev->next = stats->next;
+            else
+                head = stats->next;
+            if (stats->next)
+                stats->next->prev = stats->prev;
+            for (size_t i = 0; i < STAT_CLASSES; ++i)
+                stats->classes[i].fold_into(retired.classes[i]);
+        }
+
+        void collect(jalloc::stats_snapshot& out) noexcept
+        {
+            std::lock_guard guard(lock);
+            for (const thread_stats* stats = &retired; stats; stats = stats == &retired ? head : stats->next)
+            {
+                for (size_t i = 0; i < SIZE_CLASSES; ++i)
+                    stats->classes[i].fold_into(out.classes[i]);
+                stats->classes[STAT_SPANS].fold_into(out.spans);
+                stats->classes[STAT_LARGE].fold_into(out.large);
+            }
+            out.map_calls = map_calls.load(std::memory_order_relaxed);
+            out.unmap_calls = unmap_calls.load(std::memory_order_relaxed);
+            out.purge_calls = purge_calls.load(std::memory_order_relaxed);
+            out.purged_bytes = purged_bytes.load(std::memory_order_relaxed);
+        }
+    };
+#endif
+
+#ifdef JALLOC_PROFILING
+    // Sampled blocks by address, and the call stacks they came from. Both
+    // tables are mapped on the first sample and never grow: a sample that
+    // finds them full is dropped. Sampling is rare, one lock covers both.
+    struct heap_profiler
+    {
+        struct stack_bucket
+        {
+            uint64_t hash;
+            size_t depth;
+            void* frames[PROFILE_MAX_DEPTH];
+            uint64_t live_objects;
+            uint64_t live_bytes;
+            uint64_t total_objects;
+            uint64_t total_bytes;
+        };
+
+        struct sample
+        {
+            const void* ptr; // nullptr = empty slot
+            size_t size;
+            stack_bucket* bucket;
+        };
+
+        spin_lock lock;
+        std::atomic<size_t> rate{PROFILE_SAMPLE_RATE};
+        sample* samples{nullptr};
+        stack_bucket* buckets{nullptr};
+        size_t live{0};
+        uint64_t dropped{0};
+
+        static constexpr size_t SAMPLE_BITS = __builtin_ctzll(PROFILE_SAMPLE_SLOTS);
+
+        ALWAYS_INLINE
+        static size_t slot_of(const void* ptr) noexcept
+        {
+            return (reinterpret_cast<uintptr_t>(ptr) >> 6) * 0x9E3779B97F4A7C15ULL >> (64 - SAMPLE_BITS);
+        }
+
+        bool map_tables() noexcept
+        {
+            if (LIKELY(samples))
+                return true;
+            void* s = MAP_MEMORY(PROFILE_SAMPLE_SLOTS * sizeof(sample));
+            if (UNLIKELY(s == MAP_FAILED || !s))
+                return false;
+            void* b = MAP_MEMORY(PROFILE_STACK_SLOTS * sizeof(stack_bucket));
+            if (UNLIKELY(b == MAP_FAILED || !b))
+            {
+                UNMAP_MEMORY(s, PROFILE_SAMPLE_SLOTS * sizeof(sample));
+                return false;
+            }
+            samples = static_cast<sample*>(s);
+            buckets = static_cast<stack_bucket*>(b);
+            return true;
+        }
+
+        stack_bucket* bucket_for(void* const* frames, const size_t depth) noexcept
+        {
+            uint64_t hash = depth;
+            for (size_t i = 0; i < depth; ++i)
+                hash = (hash ^ reinterpret_cast<uintptr_t>(frames[i])) * 0x100000001B3ULL;
+            hash |= 1; // 0 marks an empty bucket
+
+            for (size_t n = 0, i = hash & (PROFILE_STACK_SLOTS - 1); n < PROFILE_STACK_SLOTS;
+                 ++n, i = (i + 1) & (PROFILE_STACK_SLOTS - 1))
+            {
+                stack_bucket& bucket = buckets[i];
+                if (bucket.hash == 0)
+                {
+                    bucket.hash = hash;
+                    bucket.depth = depth;
+                    std::memcpy(bucket.frames, frames, depth * sizeof(void*));
+                    return &bucket;
+                }
+                if (bucket.hash == hash && bucket.depth == depth &&
+                    std::memcmp(bucket.frames, frames, depth * sizeof(void*)) == 0)
+                    return &bucket;
+            }
+            return nullptr;
+        }
+
+        void record(const void* ptr, const size_t size, void* const* frames, const size_t depth) noexcept
+        {
+            std::lock_guard guard(lock);
+            // keep a quarter of the slots empty so probes stay short
+            if (UNLIKELY(!map_tables() || live >= PROFILE_SAMPLE_SLOTS / 4 * 3))
+            {
+                ++dropped;
+                return;
+            }
+            stack_bucket* bucket = bucket_for(frames, depth);
+            if (UNLIKELY(!bucket))
+            {
+                ++dropped;
+                return;
+            }
+            ++bucket->live_objects;
+            bucket->live_bytes += size;
+            ++bucket->total_objects;
+            bucket->total_bytes += size;
+
+            size_t i = slot_of(ptr);
+            while (samples[i].ptr)
+                i = (i + 1) & (PROFILE_SAMPLE_SLOTS - 1);
+            samples[i] = {ptr, size, bucket};
+            ++live;
+        }
+
+        // Linear probing with backward shift, so no tombstones pile up
+        void forget(const void* ptr) noexcept
+        {
+            std::lock_guard guard(lock);
+            if (UNLIKELY(!samples))
+                return;
+            size_t i = slot_of(ptr);
+            while (samples[i].ptr != ptr)
+            {
+                if (!samples[i].ptr)
+                    return; // dropped when it was sampled
+                i = (i + 1) & (PROFILE_SAMPLE_SLOTS - 1);
+            }
+
+            samples[i].bucket->live_objects -= 1;
+            samples[i].bucket->live_bytes -= samples[i].size;
+            --live;
+            for (size_t j = (i + 1) & (PROFILE_SAMPLE_SLOTS - 1); samples[j].ptr;
+                 j = (j + 1) & (PROFILE_SAMPLE_SLOTS - 1))
+            {
+                // an entry may move back into the hole unless its home slot
+                // lies cyclically in (i, j]
+                const size_t home = slot_of(samples[j].ptr);
+                if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+                    continue;
+                samples[i] = samples[j];
+                i = j;
+            }
+            samples[i] = {};
+        }
+
+        // Buffered write(2), nothing on this path may allocate
+        struct writer
+        {
+            int fd;
+            bool ok{true};
+            size_t used{0};
+            char buffer[4096]{};
+
+            void flush() noexcept
+            {
+                for (size_t done = 0; ok && done < used;)
+                {
+                    const ssize_t n = ::write(fd, buffer + done, used - done);
+                    if (n < 0 && errno == EINTR)
+                        continue;
+                    ok = n > 0;
+                    done += ok ? static_cast<size_t>(n) : 0;
+                }
+                used = 0;
+            }
+
+            void put(const char* text, const size_t length) noexcept
+            {
+                for (size_t i = 0; i < length; ++i)
+                {
+                    if (used == sizeof(buffer))
+                        flush();
+                    buffer[used++] = text[i];
+                }
+            }
+
+            void put(const char* text) noexcept
+            {
+                put(text, std::strlen(text));
+            }
+
+            void put(uint64_t value, const unsigned base = 10) noexcept
+            {
+                char digits[24];
+                size_t n = 0;
+                do
+                {
+                    digits[n++] = "0123456789abcdef"[value % base];
+                    value /= base;
+                } while (value);
+                while (n)
+                    put(&digits[--n], 1);
+            }
+
+            void put_counts(const uint64_t live_objects, const uint64_t live_bytes,
+                            const uint64_t total_objects, const uint64_t total_bytes) noexcept
+            {
+                put(live_objects);
+                put(": ");
+                put(live_bytes);
+                put(" [");
+                put(total_objects);
+                put(": ");
+                put(total_bytes);
+                put("]");
+            }
+        };
+
+        // Legacy pprof heap profile (heap_v2): pprof undoes the sampling
+        // from the rate in the header. Linux appends /proc/self/maps so the
+        // addresses can be symbolized.
+        bool dump(const int fd) noexcept
+        {
+            writer out{fd};
+            {
+                std::lock_guard guard(lock);
+                uint64_t totals[4]{};
+                for (size_t i = 0; samples && i < PROFILE_STACK_SLOTS; ++i)
+                {
+                    totals[0] += buckets[i].live_objects;
+                    totals[1] += buckets[i].live_bytes;
+                    totals[2] += buckets[i].total_objects;
+                    totals[3] += buckets[i].total_bytes;
+                }
+                out.put("heap profile: ");
+                out.put_counts(totals[0], totals[1], totals[2], totals[3]);
+                out.put(" @ heap_v2/");
+                out.put(rate.load(std::memory_order_relaxed));
+                out.put("\n");
+
+                for (size_t i = 0; samples && i < PROFILE_STACK_SLOTS; ++i)
+                {
+                    const stack_bucket& bucket = buckets[i];
+                    if (bucket.hash == 0)
+                        continue;
+                    out.put_counts(bucket.live_objects, bucket.live_bytes,
+                                   bucket.total_objects, bucket.total_bytes);
+                    out.put(" @");
+                    for (size_t f = 0; f < bucket.depth; ++f)
+                    {
+                        out.put(" 0x");
+                        out.put(reinterpret_cast<uintptr_t>(bucket.frames[f]), 16);
+                    }
+                    out.put("\n");
+                }
+            }
+
+            #ifdef __linux__
+                out.put("\nMAPPED_LIBRARIES:\n");
+                out.flush();
+                if (const int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC); maps >= 0)
+                {
+                    ssize_t n;
+                    while ((n = read(maps, out.buffer, sizeof(out.buffer))) > 0)
+                    {
+                        out.used = static_cast<size_t>(n);
+                        out.flush();
+                    }
+                    close(maps);
+                }
+            #endif
+            out.flush();
+            return out.ok;
+        }
+    };
+#endif
+
+#ifdef JALLOC_TRACING
+    // Trace file: a header of TRACE_FILE_MAGIC and the timestamp ticks per
+    // millisecond, then chunks of one thread's events in the order they
+    // happened. Chunks of different threads interleave, a reader merges
+    // them by time. Each chunk is {magic, count, thread} and count events.
+    //
+    // Threads fill chunks of their own and push them onto `full`, a writer
+    // thread takes the whole stack now and then and writes it out, so the
+    // allocating threads never block on the file.
+    struct trace_recorder
+    {
+        enum op : uint8_t
+        {
+            ALLOCATE,
+            ALLOCATE_ALIGNED,
+            CALLOCATE,
+            REALLOCATE,
+            DEALLOCATE,
+            DEALLOCATE_SIZED,
+        };
+
+        struct event
+        {
+            uint64_t time;   // get_timestamp()
+            uint64_t ptr;    // block freed or resized, alignment for ALLOCATE_ALIGNED
+            uint64_t result; // block handed out
+            uint64_t size;   // op in the top byte
+        };
+
+        struct chunk
+        {
+            chunk* next;
+            uint64_t session;
+            // written to the file from here on
+            uint32_t magic;
+            uint32_t count;
+            uint64_t thread;
+            event events[TRACE_CHUNK_EVENTS];
+        };
+        static_assert(sizeof(chunk) == 32 * 1024);
+
+        std::atomic<uint64_t> session{0};
+        std::atomic<uint64_t> threads{0};
+        std::atomic<chunk*> full{nullptr};
+        spin_lock spare_lock;
+        chunk* spare{nullptr};
+
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::thread worker;
+        bool running{false};
+        bool owns_fd{false};
+        int fd{-1};
+
+        ~trace_recorder()
+        {
+            stop();
+        }
+
+        // Built by the first start_trace(), its mutex, condition variable
+        // and thread cannot be constant-initialised. Traced calls check
+        // tracing_ before they get here.
+        static trace_recorder& get() noexcept
+        {
+            static trace_recorder recorder;
+            return recorder;
+        }
+
+        chunk* take_chunk() noexcept
+        {
+            {
+                std::lock_guard guard(spare_lock);
+                if (chunk* c = spare)
+                {
+                    spare = c->next;
+                    return c;
+                }
+            }
+            void* memory = MAP_MEMORY(sizeof(chunk));
+            return memory == MAP_FAILED ? nullptr : static_cast<chunk*>(memory);
+        }
+
+        void recycle(chunk* c) noexcept
+        {
+            std::lock_guard guard(spare_lock);
+            c->next = spare;
+            spare = c;
+        }
+
+        void push(chunk* c) noexcept
+        {
+            c->next = full.load(std::memory_order_relaxed);
+            while (!full.compare_exchange_weak(c->next, c, std::memory_order_release, std::memory_order_relaxed))
+            {
+            }
+        }
+
+        bool write_all(const void* data, const size_t length) const noexcept
+        {
+            for (size_t done = 0; done < length;)
+            {
+                const ssize_t n = ::write(fd, static_cast<const char*>(data) + done, length - done);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                    return false;
+                done += static_cast<size_t>(n);
+            }
+            return true;
+        }
+
+        // Writes what was pushed so far, oldest first. Chunks left over
+        // from an earlier trace are only recycled.
+        void drain() noexcept
+        {
+            chunk* list = full.exchange(nullptr, std::memory_order_acquire);
+            chunk* ordered = nullptr;
+            while (list)
+            {
+                chunk* next = list->next;
+                list->next = ordered;
+                ordered = list;
+                list = next;
+            }
+
+            const uint64_t current = session.load(std::memory_order_relaxed);
+            while (ordered)
+            {
+                chunk* next = ordered->next;
+                if (ordered->session == current)
+                    write_all(&ordered->magic, offsetof(chunk, events) - offsetof(chunk, magic) +
+                                               ordered->count * sizeof(event));
+                recycle(ordered);
+                ordered = next;
+            }
+        }
+
+        bool start(const int file, const bool owned) noexcept
+        {
+            std::lock_guard guard(mutex);
+            if (running || file < 0)
+                return false;
+            fd = file;
+            owns_fd = owned;
+            // opened without O_TRUNC, so a refused start leaves the
+            // running trace's file alone
+            if (owned && ftruncate(fd, 0) != 0)
+                return false;
+            const uint64_t header[2] = {TRACE_FILE_MAGIC, large_block_cache_t::ticks_per_ms()};
+            if (!write_all(header, sizeof(header)))
+                return false;
+
+            session.fetch_add(1, std::memory_order_relaxed);
+            running = true;
+            worker = std::thread([this]
+            {
+                std::unique_lock lock(mutex);
+                while (running)
+                {
+                    wake.wait_for(lock, TRACE_FLUSH_INTERVAL);
+                    lock.unlock();
+                    drain();
+                    lock.lock();
+                }
+            });
+            tracing_.store(true, std::memory_order_release);
+            return true;
+        }
+
+        void stop() noexcept
+        {
+            tracing_.store(false, std::memory_order_relaxed);
+            std::thread finished;
+            {
+                std::lock_guard guard(mutex);
+                if (!running)
+                    return;
+                running = false;
+                finished = std::move(worker);
+            }
+            wake.notify_all();
+            finished.join();
+            drain();
+
+            std::lock_guard guard(mutex);
+            if (owns_fd)
+                close(fd);
+            fd = -1;
+        }
+
+        // A forked child has no writer, and the locks may be held by
+        // threads it does not have either: it stops tracing and leaves
+        // the file to the parent
+        void after_fork() noexcept
+        {
+            tracing_.store(false, std::memory_order_relaxed);
+            new (&worker) std::thread();
+            new (&mutex) std::mutex();
+            new (&wake) std::condition_variable();
+            new (&spare_lock) spin_lock();
+            running = false;
+            owns_fd = false;
+            fd = -1;
+        }
+    };
+
+    // Calling thread's chunk, and whether it is already inside a traced call
+    struct trace_state
+    {
+        trace_recorder::chunk* current;
+        uint64_t thread;
+        bool nested;
+    };
+#endif
+
+    // Optional background thread that gives free memory back to the OS
+    // while the process is above `rss_target`. Each pass bumps
+    // scavenge_epoch_, which makes every thread drop its span and large
+    // block caches on its next trip through them, then purges free pages
+    // in all segments.
+    struct scavenger_t
+    {
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::thread worker;
+        bool running{false};
+        size_t rss_target{0};
+        std::chrono::milliseconds interval{1000};
+
+        ~scavenger_t()
+        {
+            stop();
+        }
+
+        // Built on first use, its mutex, condition variable and thread
+        // cannot be constant-initialised. Allocation paths only read
+        // scavenge_epoch_ and never get here.
+        static scavenger_t& get() noexcept
+        {
+            static scavenger_t scavenger;
+            return scavenger;
+        }
+
+        void start(const size_t target, const std::chrono::milliseconds every) noexcept
+        {
+            #ifndef _WIN32
+                static const bool fork_handled = pthread_atfork(nullptr, nullptr, [] { get().after_fork(); }) == 0;
+                (void)fork_handled;
+            #endif
+            std::lock_guard guard(mutex);
+            rss_target = target;
+            interval = every;
+            if (running)
+                return;
+            running = true;
+            worker = std::thread([this] { run(); });
+        }
+
+        void stop() noexcept
+        {
+            std::thread finished;
+            {
+                std::lock_guard guard(mutex);
+                if (!running)
+                    return;
+                running = false;
+                finished = std::move(worker);
+            }
+            wake.notify_all();
+            finished.join();
+        }
+
+        void run() noexcept
+        {
+            std::unique_lock lock(mutex);
+            while (running)
+            {
+                wake.wait_for(lock, interval);
+                if (!running)
+                    break;
+
+                const size_t target = rss_target;
+                lock.unlock();
+                if (resident_bytes() > target)
+                    scavenge();
+                lock.lock();
+            }
+        }
+
+        // A forked child has no scavenger thread, and the mutex may be held
+        // by the one it lost: it starts out stopped, with the parent's
+        // target and interval for the next start
+        void after_fork() noexcept
+        {
+            new (&worker) std::thread();
+            new (&mutex) std::mutex();
+            new (&wake) std::condition_variable();
+            running = false;
+        }
+
+        // Where it cannot be read, the process always counts as over target
+        static size_t resident_bytes() noexcept
+        {
+            #ifdef __linux__
+                const int fd = open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+                if (fd < 0)
+                    return SIZE_MAX;
+                char buffer[64];
+                const ssize_t length = read(fd, buffer, sizeof(buffer) - 1);
+                close(fd);
+                if (length <= 0)
+                    return SIZE_MAX;
+                buffer[length] = 0;
+
+                // second field is resident pages
+                const char* c = buffer;
+                while (*c && *c != ' ')
+                    ++c;
+                size_t pages = 0;
+                for (++c; *c >= '0' && *c <= '9'; ++c)
+                    pages = pages * 10 + (*c - '0');
+                return pages * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+            #else
+                return SIZE_MAX;
+            #endif
+        }
+    };
+
+    static thread_local thread_cache_t thread_cache_;
+    static thread_local pool_manager pool_manager_;
+    static thread_local large_block_cache_t large_block_cache_;
+    static thread_local tiny_block_manager tiny_pools_;
+    static thread_local page_heap page_heap_;
+    static thread_local span_cache_t span_cache_;
+    static thread_local uint64_t owner_tag_;
+    static owner_registry owners_;
+    static transfer_cache transfer_[NUMA_MAX_NODES];
+    static segment_registry segments_;
+    static orphanage orphans_;
+    static std::atomic<uint64_t> scavenge_epoch_;
+    static std::atomic<bool> huge_pages_;
+    static thread_local uint64_t scavenge_seen_;
+    static const bool environment_loaded_;
+#ifndef _WIN32
+    static const bool fork_handled_;
+#endif
+#ifdef JALLOC_STATS
+    static thread_local thread_stats stats_;
+    static stats_registry stats_registry_;
+
+    ALWAYS_INLINE
+    static class_counters& stat(const size_t index) noexcept
+    {
+        return stats_.classes[index];
+    }
+
+    ALWAYS_INLINE
+    static void stat_allocate(const size_t index, const size_t bytes) noexcept
+    {
+        stat(index).allocations.add(1);
+        stat(index).allocated_bytes.add(bytes);
+    }
+
+    ALWAYS_INLINE
+    static void stat_deallocate(const size_t index, const size_t bytes) noexcept
+    {
+        stat(index).deallocations.add(1);
+        stat(index).allocated_bytes.sub(bytes);
+    }
+
+    // Pages or a mapping the class gave back below it
+    ALWAYS_INLINE
+    static void stat_return(const size_t index, const size_t bytes) noexcept
+    {
+        stat(index).mapped_bytes.sub(bytes);
+        stat(index).returned_bytes.add(bytes);
+    }
+#endif
+#ifdef JALLOC_PROFILING
+    // Bytes this thread may still allocate before the next sample
+    static thread_local int64_t sample_countdown_;
+    static thread_local uint64_t sample_rng_;
+    // set while a sample is taken, backtrace() can allocate
+    static thread_local bool in_profiler_;
+    static heap_profiler profiler_;
+
+    // Exponential with mean `rate`, which makes sampling a Poisson process
+    // over allocated bytes: every byte has the same chance to be picked,
+    // whatever the size of the block it is in
+    static int64_t next_sample_interval() noexcept
+    {
+        const size_t rate = profiler_.rate.load(std::memory_order_relaxed);
+        if (rate == 0)
+            return PROFILE_IDLE_INTERVAL;
+
+        sample_rng_ ^= sample_rng_ >> 12;
+        sample_rng_ ^= sample_rng_ << 25;
+        sample_rng_ ^= sample_rng_ >> 27;
+        const double u = static_cast<double>((sample_rng_ * 0x2545F4914F6CDD1DULL) >> 11) * 0x1.0p-53;
+        const double interval = -std::log(1.0 - u) * static_cast<double>(rate);
+        return interval < 0x1.0p40 ? static_cast<int64_t>(interval) + 1 : int64_t{1} << 40;
+    }
+
+    // The countdown ran out. Sampled blocks get a span or a mapping of
+    // their own, so a free finds the mark in the header it loads anyway.
+    // With `zeroed` the block reads as zero, as callocate promises.
+    [[gnu::noinline]]
+    static void* allocate_sampled(const size_t size, const bool zeroed = false) noexcept
+    {
+        if (UNLIKELY(sample_rng_ == 0))
+        {
+            // first allocation of the thread, only arm the countdown
+            sample_rng_ = (reinterpret_cast<uintptr_t>(&sample_rng_) ^
+                           large_block_cache_t::get_timestamp()) | 1;
+            sample_countdown_ = next_sample_interval();
+            return zeroed ? callocate_unsampled(size) : allocate_unsampled(size);
+        }
+        sample_countdown_ = next_sample_interval();
+        if (in_profiler_ || size == 0 || size > (1ULL << 47) ||
+            profiler_.rate.load(std::memory_order_relaxed) == 0)
+            return zeroed ? callocate_unsampled(size) : allocate_unsampled(size);
+
+        register_thread_cleanup();
+        in_profiler_ = true;
+        void* ptr = size <= MID_LARGE_THRESHOLD ? allocate_mid(size, zeroed) : allocate_large(size, zeroed);
+        if (LIKELY(ptr))
+        {
+            (reinterpret_cast<block_header*>(ptr) - 1)->set_sampled(true);
+            void* frames[PROFILE_MAX_DEPTH + 1];
+            size_t depth = 0;
+            #ifdef JALLOC_HAVE_BACKTRACE
+                const int captured = backtrace(frames, PROFILE_MAX_DEPTH + 1);
+                depth = captured > 1 ? static_cast<size_t>(captured) : 1;
+            #endif
+            // frame 0 is this function
+            profiler_.record(ptr, size, frames + 1, depth - 1);
+        }
+        in_profiler_ = false;
+        return ptr;
+    }
+
+    ALWAYS_INLINE
+    static void forget_sample(block_header* header) noexcept
+    {
+        header->set_sampled(false);
+        profiler_.forget(header + 1);
+    }
+#endif
+
+    // A scavenger pass asked every thread to drop its caches
+    ALWAYS_INLINE
+    static void check_scavenge() noexcept
+    {
+        if (const uint64_t epoch = scavenge_epoch_.load(std::memory_order_relaxed);
+            UNLIKELY(epoch != scavenge_seen_))
+        {
+            scavenge_seen_ = epoch;
+            span_cache_.release();
+            large_block_cache_.clear();
+        }
+    }
+
+    ALWAYS_INLINE
+    static uint64_t current_owner() noexcept
+    {
+        if (UNLIKELY(owner_tag_ == 0))
+            owner_tag_ = owners_.acquire();
+        return owner_tag_;
+    }
+
+    ALWAYS_INLINE
+    static void* allocate_tiny(const size_t size) noexcept
+    {
+        if (UNLIKELY(size == 0))
+            return nullptr;
+
+        const uint8_t size_class = (size - 1) >> 3;
+        if (UNLIKELY(size_class >= TINY_CLASSES))
+            return nullptr;
+
+        JALLOC_STAT(stat_allocate(size_class, size_classes[size_class].size));
+        return tiny_pools_.allocate(size_class);
+    }
+
+    // Tiny and small blocks have no header, the slot itself is handed out
+    ALWAYS_INLINE
+    static void* allocate_small(const size_t size) noexcept
+    {
+        const uint8_t size_class = (size - 1) >> 3;
+        JALLOC_STAT(const size_t class_size = size_classes[size_class].size);
+        JALLOC_STAT(stat_allocate(size_class, class_size));
+
+        if (void* cached = thread_cache_.get(size_class))
+        {
+            JALLOC_STAT(stat(size_class).cache_hits.add(1));
+            JALLOC_STAT(stat(size_class).cached_bytes.sub(class_size));
+            return cached;
+        }
+
+        void* batch[CACHE_BATCH];
+        const size_t want = refill_count(size_class);
+        size_t count = transfer_[numa::slot(page_heap_.node)].remove(size_class, batch, want);
+        JALLOC_STAT(stat(size_class).cached_bytes.sub(count * class_size));
+        if (count == 0)
+            count = pool_manager_.allocate_batch(size_class, batch, want);
+        if (UNLIKELY(count == 0))
+            return nullptr;
+
+        thread_cache_.fill(size_class, batch + 1, count - 1);
+        JALLOC_STAT(stat(size_class).cached_bytes.add((count - 1) * class_size));
+        return batch[0];
+    }
+
+    // Cache miss: grow the class's limit, then fetch what it may now hold
+    ALWAYS_INLINE
+    static size_t refill_count(const uint8_t size_class) noexcept
+    {
+        const size_t batch = batch_for(size_class);
+        thread_cache_.on_miss(size_class, batch);
+        const size_t room = thread_cache_.room(size_class) + 1;
+        return room < batch ? room : batch;
+    }
+
+    ALWAYS_INLINE
+    static void* allocate_medium(const size_t size, const uint8_t size_class) noexcept
+    {
+        JALLOC_STAT(const size_t class_size = size_classes[size_class].size);
+        JALLOC_STAT(stat_allocate(size_class, class_size));
+        if (void* cached = thread_cache_.get(size_class))
+        {
+            JALLOC_STAT(stat(size_class).cache_hits.add(1));
+            JALLOC_STAT(stat(size_class).cached_bytes.sub(class_size));
+            auto* header = reinterpret_cast<block_header*>(
+                static_cast<char*>(cached) - sizeof(block_header));
+            header->encode(size, size_class, false);
+            return cached;
+        }
+
+        void* batch[CACHE_BATCH];
+        const size_t want = refill_count(size_class);
+
+        // Blocks from the transfer cache already carry a free header
+        if (size_t count = transfer_[numa::slot(page_heap_.node)].remove(size_class, batch, want))
+        {
+            thread_cache_.fill(size_class, batch + 1, count - 1);
+            JALLOC_STAT(stat(size_class).cached_bytes.sub(class_size));
+            auto* header = reinterpret_cast<block_header*>(
+                static_cast<char*>(batch[0]) - sizeof(block_header));
+            header->encode(size, size_class, false);
+            return batch[0];
+        }
+
+        const size_t count = pool_manager_.allocate_batch(size_class, batch, want);
+        if (UNLIKELY(count == 0))
+            return nullptr;
+
+        // The rest of the batch is cached as free blocks with their headers set up
+        for (size_t i = 1; i < count; ++i)
+        {
+            auto* header = new (batch[i]) block_header();
+            header->init(size_classes[size_class].size, size_class, true);
+            batch[i] = header + 1;
+        }
+        thread_cache_.fill(size_class, batch + 1, count - 1);
+        JALLOC_STAT(stat(size_class).cached_bytes.add((count - 1) * class_size));
+
+        auto* header = new (batch[0]) block_header();
+        header->init(size, size_class, false);
+        return header + 1;
+    }
+
+    // Cached blocks may have come from another thread via the transfer cache
+    ALWAYS_INLINE
+    static void release_block(void* ptr, const uint8_t size_class) noexcept
+    {
+        if (page_owner* page = pool_from<page_owner>(ptr); UNLIKELY(!page->is_local()))
+        {
+            page->push_remote(ptr);
+            return;
+        }
+        pool_manager_.deallocate(ptr, size_class);
+    }
+
+    // Hands `n` of the class's oldest cached blocks back to the pools
+    static void flush_cache(const uint8_t size_class, size_t n) noexcept
+    {
+        void* batch[CACHE_BATCH];
+        while (n > 0)
+        {
+            const size_t count = thread_cache_.drain(size_class, batch, n < CACHE_BATCH ? n : CACHE_BATCH);
+            if (count == 0)
+                break;
+            JALLOC_STAT(stat(size_class).cached_bytes.sub(count * size_classes[size_class].size));
+            for (size_t i = 0; i < count; ++i)
+                release_block(batch[i], size_class);
+            n -= count;
+        }
+    }
+
+    // Like flush_cache, but offers the blocks to other threads first
+    static void spill_cache(const uint8_t size_class, size_t n) noexcept
+    {
+        void* batch[CACHE_BATCH];
+        while (n > 0)
+        {
+            const size_t count = thread_cache_.drain(size_class, batch, n < CACHE_BATCH ? n : CACHE_BATCH);
+            if (count == 0)
+                break;
+            // A thread moved between nodes may hold blocks of several: each
+            // run goes to the transfer cache of the node its memory is on
+            for (size_t start = 0, end; start < count; start = end)
+            {
+                const size_t node = segment::of(batch[start])->node;
+                end = start + 1;
+                for (size_t i = end; i < count; ++i)
+                    if (segment::of(batch[i])->node == node)
+                        std::swap(batch[i], batch[end++]);
+
+                const size_t kept = transfer_[numa::slot(node)].insert(size_class, batch + start, end - start);
+                // what the transfer cache took stays cached, now process-wide
+                JALLOC_STAT(stat(size_class).cached_bytes.sub((end - start - kept) * size_classes[size_class].size));
+                for (size_t i = start + kept; i < end; ++i)
+                    release_block(batch[i], size_class);
+            }
+            n -= count;
+        }
+    }
+
+    // Over the byte budget: every class gives back half of what it holds
+    static void trim_cache() noexcept
+    {
+        for (uint8_t size_class = TINY_CLASSES; size_class < SIZE_CLASSES; ++size_class)
+            spill_cache(size_class, (thread_cache_.caches[size_class].count + 1) / 2);
+    }
+
+    // Caches a freed local block, making room first if the class is full
+    ALWAYS_INLINE
+    static void cache_block(void* ptr, const uint8_t size_class) noexcept
+    {
+        JALLOC_STAT(stat(size_class).cached_bytes.add(size_classes[size_class].size));
+        if (LIKELY(thread_cache_.put(ptr, size_class)))
+            return;
+
+        const size_t batch = batch_for(size_class);
+        thread_cache_.on_overflow(size_class, batch);
+        if (thread_cache_.over_budget(size_class))
+        {
+            trim_cache();
+        }
+        else
+        {
+            const auto& cache = thread_cache_.caches[size_class];
+            const size_t excess = cache.count + 1 > cache.limit ? cache.count + 1 - cache.limit : 0;
+            spill_cache(size_class, excess > batch ? excess : batch);
+        }
+
+        if (UNLIKELY(!thread_cache_.put(ptr, size_class)))
+        {
+            JALLOC_STAT(stat(size_class).cached_bytes.sub(size_classes[size_class].size));
+            release_block(ptr, size_class);
+        }
+    }
+
+    ALWAYS_INLINE
+    static void deallocate_headerless(void* ptr, page_owner* page) noexcept
+    {
+        const uint8_t size_class = page->size_class;
+        JALLOC_STAT(stat_deallocate(size_class, size_classes[size_class].size));
+        if (UNLIKELY(!page->is_local()))
+        {
+            page->push_remote(ptr);
+            return;
+        }
+
+        if (size_class < TINY_CLASSES)
+        {
+            tiny_pools_.deallocate(ptr, size_class);
+            return;
+        }
+
+        cache_block(ptr, size_class);
+    }
+
+    // 2 KB..256 KB: a page span with the header in its first 64 bytes.
+    // With `zeroed` set only the bytes a previous owner may have written
+    // are cleared, pages fresh from the OS already read as zero.
+    ALWAYS_INLINE
+    static void* allocate_mid(const size_t size, const bool zeroed = false) noexcept
+    {
+        check_scavenge();
+        const size_t pages = (size + sizeof(block_header) + PG_SIZE - 1) / PG_SIZE;
+        void* span = span_cache_.get(pages);
+        size_t dirty = span ? static_cast<block_header*>(span)->dirty : 0;
+        JALLOC_STAT(if (span) stat(STAT_SPANS).cache_hits.add(1));
+        JALLOC_STAT(if (span) stat(STAT_SPANS).cached_bytes.sub(pages * PG_SIZE));
+        if (!span)
+        {
+            bool fresh = false;
+            span = page_heap_.allocate_span(pages, SPAN_CLASS, &fresh);
+            if (!fresh)
+                dirty = pages * PG_SIZE - sizeof(block_header);
+            JALLOC_STAT(if (span) stat(STAT_SPANS).mapped_bytes.add(pages * PG_SIZE));
+        }
+        if (UNLIKELY(!span))
+            return nullptr;
+        JALLOC_STAT(stat_allocate(STAT_SPANS, pages * PG_SIZE));
+
+        auto* header = new (span) block_header();
+        header->init(size, SPAN_CLASS, false);
+        if (zeroed)
+            zero_memory(header + 1, size < dirty ? size : dirty);
+        header->dirty = dirty;
+        header->mark_dirty(size);
+        return header + 1;
+    }
+
+    ALWAYS_INLINE
+    static void deallocate_mid(block_header* header) noexcept
+    {
+        check_scavenge();
+        segment* seg = segment::of(header);
+        JALLOC_STAT(const size_t bytes = seg->span_pages(header) * PG_SIZE);
+        JALLOC_STAT(stat_deallocate(STAT_SPANS, bytes));
+        if (UNLIKELY(!seg->is_local()))
+        {
+            JALLOC_STAT(stat_return(STAT_SPANS, bytes));
+            seg->push_remote(header);
+            return;
+        }
+
+        if (span_cache_.put(header, seg->span_pages(header)))
+        {
+            JALLOC_STAT(stat(STAT_SPANS).cached_bytes.add(bytes));
+            return;
+        }
+        JALLOC_STAT(stat_return(STAT_SPANS, bytes));
+        page_heap_.free_span(header);
+    }
+
+    // The header records what the mapping can hold, not what was asked for,
+    // so the mapping size can always be recovered from it. `zeroed` works
+    // as for allocate_mid: a new mapping is never touched.
+    ALWAYS_INLINE
+    static void* allocate_large(const size_t size, const bool zeroed = false) noexcept
+    {
+        check_scavenge();
+        constexpr size_t header_size = (sizeof(block_header) + CACHE_LINE_SIZE - 1)
+                                       & ~(CACHE_LINE_SIZE - 1);
+
+        size_t mapped = large_block_cache_t::round_size(size + header_size);
+        const bool huge = mapped >= HUGE_PAGE_SIZE && huge_pages_.load(std::memory_order_relaxed);
+        if (huge)
+            mapped = (mapped + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+
+        const size_t node = page_heap_.local_node();
+        void* ptr = large_block_cache_.get_cached_block(mapped, mapped, node);
+        if (!ptr)
+            ptr = orphans_.pop_block(mapped, mapped, node);
+        const size_t dirty = ptr ? static_cast<block_header*>(ptr)->dirty : 0;
+        JALLOC_STAT(if (ptr) stat(STAT_LARGE).cache_hits.add(1));
+        JALLOC_STAT(if (ptr) stat(STAT_LARGE).cached_bytes.sub(mapped));
+        if (!ptr)
+        {
+            ptr = huge ? map_aligned(mapped, HUGE_PAGE_SIZE) : MAP_MEMORY(mapped);
+            JALLOC_STAT(stats_registry::bump(stats_registry_.map_calls));
+            if (UNLIKELY(ptr == MAP_FAILED || !ptr))
+                return nullptr;
+            numa::bind(ptr, mapped, node);
+            JALLOC_STAT(stat(STAT_LARGE).mapped_bytes.add(mapped));
+        }
+        JALLOC_STAT(stat_allocate(STAT_LARGE, mapped));
+
+        auto* header = new (ptr) block_header();
+        header->init(mapped - header_size, 255, false);
+        header->set_memory_mapped(true);
+        if (zeroed)
+            zero_memory(static_cast<char*>(ptr) + header_size, size < dirty ? size : dirty);
+        header->dirty = dirty;
+        header->mark_dirty(size);
+        return static_cast<char *>(ptr) + header_size;
+    }
+
+    // Rebuilds the page lists for the pool pages of a segment just adopted,
+    // from its span table. Pages with nothing live in them go back to the
+    // page heap.
+    static void adopt_pages(segment* seg) noexcept
+    {
+        seg->reclaim_remote();
+        const uint64_t tag = current_owner();
+        for (size_t i = segment::META_PAGES; i < SEGMENT_PAGES;)
+        {
+            const span_info info = seg->spans[i];
+            if (!info.in_use)
+            {
+                ++i;
+                continue;
+            }
+            auto* page = static_cast<page_owner*>(seg->page_address(i));
+            i += info.pages;
+            if (info.size_class >= SIZE_CLASSES)
+                continue;
+
+            page->tag.store(tag, std::memory_order_release);
+            if (info.size_class < TINY_CLASSES)
+                tiny_pools_.adopt(page);
+            else
+                pool_manager_.adopt(page);
+        }
+    }
+
+    // Size to map for a large block that is being grown, the headroom lets
+    // the next few reallocations finish in place
+    ALWAYS_INLINE
+    static size_t large_growth(const size_t size) noexcept
+    {
+        const size_t grown = size + size / 4;
+        return grown <= (1ULL << 47) ? grown : size;
+    }
+
+    ALWAYS_INLINE
+    static void thread_cleanup()
+    {
+        cleanup();
+    }
+
+#ifdef JALLOC_TRACING
+    static std::atomic<bool> tracing_;
+    static thread_local trace_state trace_;
+
+    // A public call made while a trace runs and not from inside another one
+    ALWAYS_INLINE
+    static bool trace_wanted() noexcept
+    {
+        return UNLIKELY(tracing_.load(std::memory_order_relaxed)) && !trace_.nested;
+    }
+
+    // Hands the thread's chunk to the writer, or drops it when it belongs
+    // to a trace that has ended
+    static void flush_trace() noexcept
+    {
+        trace_recorder::chunk* c = trace_.current;
+        if (!c)
+            return;
+        trace_.current = nullptr;
+        trace_recorder& recorder = trace_recorder::get();
+        if (c->count && c->session == recorder.session.load(std::memory_order_relaxed) &&
+            tracing_.load(std::memory_order_relaxed))
+            recorder.push(c);
+        else
+            recorder.recycle(c);
+    }
+
+    static void record(const trace_recorder::op op, const void* ptr, const void* result,
+                       const size_t size) noexcept
+    {
+        register_thread_cleanup();
+        trace_recorder& recorder = trace_recorder::get();
+        const uint64_t session = recorder.session.load(std::memory_order_relaxed);
+        trace_recorder::chunk* c = trace_.current;
+        if (UNLIKELY(!c || c->session != session))
+        {
+            if (c)
+                recorder.recycle(c);
+            trace_.current = c = recorder.take_chunk();
+            if (UNLIKELY(!c))
+                return;
+            if (trace_.thread == 0)
+                trace_.thread = recorder.threads.fetch_add(1, std::memory_order_relaxed) + 1;
+            c->session = session;
+            c->magic = TRACE_CHUNK_MAGIC;
+            c->count = 0;
+            c->thread = trace_.thread;
+        }
+
+        c->events[c->count++] = {
+            large_block_cache_t::get_timestamp(),
+            reinterpret_cast<uintptr_t>(ptr),
+            reinterpret_cast<uintptr_t>(result),
+            static_cast<uint64_t>(size) | static_cast<uint64_t>(op) << 56
+        };
+        if (c->count == TRACE_CHUNK_EVENTS)
+        {
+            trace_.current = nullptr;
+            recorder.push(c);
+        }
+    }
+
+    // Allocations are stamped once they return and frees before they run,
+    // so an address is never seen handed out again before its free
+    template<typename Call>
+    [[gnu::noinline]]
+    static void* traced(const trace_recorder::op op, const void* ptr, const size_t size, Call call) noexcept
+    {
+        if (op == trace_recorder::DEALLOCATE || op == trace_recorder::DEALLOCATE_SIZED)
+            record(op, ptr, nullptr, size);
+        trace_.nested = true;
+        void* result = call();
+        trace_.nested = false;
+        if (op != trace_recorder::DEALLOCATE && op != trace_recorder::DEALLOCATE_SIZED)
+            record(op, ptr, result, size);
+        return result;
+    }
+#endif
+
+    ALWAYS_INLINE
+    static void register_thread_cleanup()
+    {
+        thread_local struct Cleanup
+        {
+#ifdef JALLOC_STATS
+            Cleanup()
+            {
+                stats_registry_.add(&stats_);
+            }
+#endif
+
+            ~Cleanup()
+            {
+                JALLOC_RECORD(flush_trace());
+                cleanup();
+                owners_.release(owner_tag_);
+                owner_tag_ = 0;
+                JALLOC_STAT(stats_registry_.remove(&stats_));
+            }
+        } cleanup;
+    }
+
+    ALWAYS_INLINE
+    static void* allocate_unsampled(const size_t size) noexcept
+    {
+        register_thread_cleanup();
+        if (UNLIKELY(size == 0 || size > (1ULL << 47)))
+            return nullptr;
+
+        if (LIKELY(size <= TINY_LARGE_THRESHOLD))
+            return allocate_tiny(size);
+
+        if (LIKELY(size > MEDIUM_LARGE_THRESHOLD))
+            return size <= MID_LARGE_THRESHOLD ? allocate_mid(size) : allocate_large(size);
+
+        if (size <= SMALL_LARGE_THRESHOLD)
+            return allocate_small(size);
+
+        return allocate_medium(size, medium_class_for(size));
+    }
+
+public:
+    // The block is aligned to at least the largest power of two dividing
+    // the size, capped at 16, and never less than 8: allocate(24) may give
+    // only 8 bytes where allocate(32) gives 16. Callers that need alignof(max_align_t) for any size round
+    // it up to a multiple of 16 first, as the malloc override does, or use
+    // allocate_aligned.
+    ALWAYS_INLINE
+    static void* allocate(const size_t size) noexcept
+    {
+        JALLOC_RECORD(if (trace_wanted())
+                          return traced(trace_recorder::ALLOCATE, nullptr, size,
+                                        [size] { return allocate(size); }));
+        // unsampled calls pay for one thread-local subtraction
+        JALLOC_SAMPLE(if (UNLIKELY((sample_countdown_ -= static_cast<int64_t>(size)) < 0))
+                          return allocate_sampled(size));
+        return allocate_unsampled(size);
+    }
+
+    // For a size known at compile time, e.g. sizeof(T): the tier and size
+    // class are resolved here, so the call goes straight to the thread
+    // cache of its class. Release with deallocate_fixed of the same
+    // arguments. Alignments no class slot satisfies take allocate_aligned.
+    template<size_t Size, size_t Alignment = alignof(std::max_align_t)>
+    ALWAYS_INLINE
+    static void* allocate_fixed() noexcept
+    {
+        static_assert(Size > 0 && Size <= (1ULL << 47));
+        static_assert(Alignment > 0 && (Alignment & (Alignment - 1)) == 0);
+        if constexpr (!fixed_fits<Size, Alignment>())
+        {
+            return allocate_aligned(Size, Alignment);
+        }
+        else
+        {
+            // traced as a plain allocate, which gives a replay the same block
+            JALLOC_RECORD(if (trace_wanted())
+                              return traced(trace_recorder::ALLOCATE, nullptr, Size,
+                                            [] { return allocate_fixed<Size, Alignment>(); }));
+            JALLOC_SAMPLE(if (UNLIKELY((sample_countdown_ -= static_cast<int64_t>(Size)) < 0))
+                              return allocate_sampled(Size));
+            register_thread_cleanup();
+            if constexpr (Size <= TINY_LARGE_THRESHOLD)
+                return allocate_tiny(Size);
+            else if constexpr (Size <= SMALL_LARGE_THRESHOLD)
+                return allocate_small(Size);
+            else if constexpr (Size <= MEDIUM_LARGE_THRESHOLD)
+            {
+                constexpr uint8_t size_class = medium_class_for(Size);
+                return allocate_medium(Size, size_class);
+            }
+            else if constexpr (Size <= MID_LARGE_THRESHOLD)
+                return allocate_mid(Size);
+            else
+                return allocate_large(Size);
+        }
+    }
+
+    template<size_t Size, size_t Alignment = alignof(std::max_align_t)>
+    ALWAYS_INLINE
+    static void deallocate_fixed(void* ptr) noexcept
+    {
+        if constexpr (!fixed_fits<Size, Alignment>())
+            deallocate(ptr);
+        else
+            deallocate(ptr, Size);
+    }
+
+    // Whether the class `Size` lands in already gives `Alignment`: small
+    // slots sit at multiples of their size from a 128-byte boundary, all
+    // other blocks are 64-byte aligned
+    template<size_t Size, size_t Alignment>
+    static constexpr bool fixed_fits() noexcept
+    {
+        if (Alignment <= ALIGNMENT && (Size > SMALL_LARGE_THRESHOLD || Alignment <= 8 || Size % Alignment == 0))
+            return true;
+        return Alignment <= POOL_HEADER_SIZE && Size <= SMALL_LARGE_THRESHOLD && Size % Alignment == 0;
+    }
+
+    // `alignment` must be a power of two. Small requests up to 128-byte
+    // alignment are rounded to a class whose slots already fall on the
+    // boundary, every block past 256 bytes is 64-byte aligned as it is, and
+    // anything stricter is cut from a span or mapping behind an offset header.
+    ALWAYS_INLINE
+    static void* allocate_aligned(const size_t size, const size_t alignment) noexcept
+    {
+        JALLOC_RECORD(if (trace_wanted())
+                          return traced(trace_recorder::ALLOCATE_ALIGNED, reinterpret_cast<void*>(alignment), size,
+                                        [size, alignment] { return allocate_aligned(size, alignment); }));
+        if (UNLIKELY(alignment == 0 || (alignment & (alignment - 1)) != 0))
+            return nullptr;
+        if (UNLIKELY(size > (1ULL << 47) || alignment > (1ULL << 47)))
+            return nullptr;
+
+        // headerless slots are laid out from the 128-byte aligned end of the page header
+        // a sampled block would only be 64-byte aligned, these stay out of the profile
+        if (alignment <= POOL_HEADER_SIZE && size <= SMALL_LARGE_THRESHOLD)
+            return allocate_unsampled((size + alignment - 1) & ~(alignment - 1));
+        if (alignment <= ALIGNMENT)
+            return allocate_unsampled(size);
+
+        register_thread_cleanup();
+        if (UNLIKELY(size == 0))
+            return nullptr;
+
+        const size_t total = size + alignment + sizeof(block_header);
+        void* base = total <= MID_LARGE_THRESHOLD ? allocate_mid(total) : allocate_large(total);
+        if (UNLIKELY(!base))
+            return nullptr;
+
+        const uintptr_t aligned = (reinterpret_cast<uintptr_t>(base) + sizeof(block_header) + alignment - 1)
+                                  & ~(alignment - 1);
+        auto* header = reinterpret_cast<block_header*>(aligned) - 1;
+        header->init(size, ALIGNED_CLASS, false, static_cast<block_header*>(base) - 1);
+        return reinterpret_cast<void*>(aligned);
+    }
+
+    ALWAYS_INLINE
+    static void deallocate(void* ptr) noexcept
+    {
+        if (!ptr)
+            return;
+        JALLOC_RECORD(if (trace_wanted())
+                      {
+                          traced(trace_recorder::DEALLOCATE, ptr, 0,
+                                 [ptr] { deallocate(ptr); return nullptr; });
+                          return;
+                      });
+        // a thread that only ever frees must still be counted
+        JALLOC_STAT(register_thread_cleanup());
+        if (UNLIKELY((reinterpret_cast<uintptr_t>(ptr) & ~(PG_SIZE-1)) == 0))
+            return;
+
+        page_owner* page = pool_page_of(ptr);
+        if (LIKELY(page && page->size_class < SMALL_CLASSES))
+        {
+            deallocate_headerless(ptr, page);
+            return;
+        }
+
+        if (UNLIKELY(!block_header::is_aligned(ptr)))
+            return;
+
+        auto* header = reinterpret_cast<block_header*>(
+            static_cast<char*>(ptr) - sizeof(block_header));
+
+        if (UNLIKELY(!header->is_valid()))
+            return;
+
+        uint8_t size_class = header->size_class();
+        if (UNLIKELY(size_class >= SIZE_CLASSES && size_class < ALIGNED_CLASS))
+            return;
+
+        if (UNLIKELY(size_class == ALIGNED_CLASS))
+        {
+            if (UNLIKELY(header->is_free()))
+                return;
+            header->set_free(true);
+            // carry on with the span or mapping the block was cut from
+            header = header->prev_physical;
+            ptr = header + 1;
+            size_class = header->size_class();
+        }
+
+        if (size_class == SPAN_CLASS)
+        {
+            if (UNLIKELY(header->is_free()))
+                return;
+            JALLOC_SAMPLE(if (UNLIKELY(header->is_sampled())) forget_sample(header));
+            header->set_free(true);
+            deallocate_mid(header);
+            return;
+        }
+
+        if (UNLIKELY(size_class == 255))
+        {
+            void* block = static_cast<char*>(ptr) - sizeof(block_header);
+            // Only mappings carry class 255. Anything else is a corrupt header
+            // or a pointer jalloc never handed out, and handing it to free()
+            // would come straight back here once malloc is overridden.
+            if (UNLIKELY(!header->is_memory_mapped()))
+                std::abort();
+            JALLOC_SAMPLE(if (UNLIKELY(header->is_sampled())) forget_sample(header));
+            check_scavenge();
+            const size_t mapped = header->size() + sizeof(block_header);
+            JALLOC_STAT(stat_deallocate(STAT_LARGE, mapped));
+            if (large_block_cache_.cache_block(block, mapped, page_heap_.node))
+            {
+                JALLOC_STAT(stat(STAT_LARGE).cached_bytes.add(mapped));
+                return;
+            }
+            JALLOC_STAT(stat_return(STAT_LARGE, mapped));
+            JALLOC_STAT(stats_registry::bump(stats_registry_.unmap_calls));
+            UNMAP_MEMORY(block, mapped);
+            return;
+        }
+
+        if (UNLIKELY(!page || header->is_free()))
+            return;
+
+        JALLOC_STAT(stat_deallocate(size_class, size_classes[size_class].size));
+        // Blocks owned by another thread go back to their page, never into our cache
+        if (UNLIKELY(!page->is_local()))
+        {
+            header->set_free(true);
+            page->push_remote(ptr);
+            return;
+        }
+
+        header->set_free(true);
+        cache_block(ptr, size_class);
+    }
+
+    // Sized free: `size` only picks the route, the class still comes from
+    // the page or header the block already carries. A block shrunk in place
+    // by reallocate() keeps its old slot, so the caller's size may name a
+    // smaller class than the one it lives in; those take the plain path.
+    ALWAYS_INLINE
+    static void deallocate(void* ptr, const size_t size) noexcept
+    {
+        JALLOC_RECORD(if (ptr && trace_wanted())
+                      {
+                          traced(trace_recorder::DEALLOCATE_SIZED, ptr, size,
+                                 [ptr, size] { deallocate(ptr, size); return nullptr; });
+                          return;
+                      });
+        JALLOC_STAT(register_thread_cleanup());
+        if (UNLIKELY(!ptr || size == 0 || size > MID_LARGE_THRESHOLD))
+        {
+            // mapped blocks need the mapping size from their header anyway
+            deallocate(ptr);
+            return;
+        }
+
+        // a sampled block of any size sits in a span, not in a pool page
+        JALLOC_SAMPLE(if (UNLIKELY(size <= MEDIUM_LARGE_THRESHOLD
+                                   ? pool_from<page_owner>(ptr)->signature != POOL_SIGNATURE
+                                   : (reinterpret_cast<block_header*>(ptr) - 1)->is_sampled()))
+                      {
+                          deallocate(ptr);
+                          return;
+                      });
+
+        if (LIKELY(size <= SMALL_LARGE_THRESHOLD))
+        {
+            // a medium block shrunk below 256 bytes has a medium page
+            if (page_owner* page = pool_from<page_owner>(ptr); LIKELY(page->size_class < SMALL_CLASSES))
+            {
+                deallocate_headerless(ptr, page);
+                return;
+            }
+            deallocate(ptr);
+            return;
+        }
+
+        auto* header = reinterpret_cast<block_header*>(
+            static_cast<char*>(ptr) - sizeof(block_header));
+        const uint8_t size_class = header->size_class();
+
+        if (size > MEDIUM_LARGE_THRESHOLD)
+        {
+            if (UNLIKELY(size_class != SPAN_CLASS || header->is_free()))
+            {
+                deallocate(ptr);
+                return;
+            }
+            header->set_free(true);
+            deallocate_mid(header);
+            return;
+        }
+
+        if (UNLIKELY(size_class < SMALL_CLASSES || size_class >= SIZE_CLASSES || header->is_free()))
+        {
+            deallocate(ptr);
+            return;
+        }
+        header->set_free(true);
+        JALLOC_STAT(stat_deallocate(size_class, size_classes[size_class].size));
+        if (page_owner* page = pool_from<page_owner>(ptr); UNLIKELY(!page->is_local()))
+        {
+            page->push_remote(ptr);
+            return;
+        }
+        cache_block(ptr, size_class);
+    }
+
+    ALWAYS_INLINE NO_SANITIZE_ADDRESS
+    static void* reallocate(void* ptr, const size_t new_size) noexcept
+    {
+        if (UNLIKELY(!ptr))
+            return allocate(new_size);
+        JALLOC_RECORD(if (trace_wanted())
+                          return traced(trace_recorder::REALLOCATE, ptr, new_size,
+                                        [ptr, new_size] { return reallocate(ptr, new_size); }));
+
+        if (UNLIKELY(new_size == 0))
+        {
+            deallocate(ptr);
+            return nullptr;
+        }
+
+        size_t old_size;
+        if (const page_owner* page = pool_page_of(ptr); page && page->size_class < SMALL_CLASSES)
+        {
+            // headerless, the whole slot is usable
+            old_size = size_classes[page->size_class].size;
+            if (new_size <= old_size)
+                return ptr;
+        }
+        else
+        {
+            if (UNLIKELY(!block_header::is_aligned(ptr)))
+                return nullptr;
+
+            // cool thing I just learned
+            // header is 100% not null if the ptr is aligned!
+            auto* header = reinterpret_cast<block_header*>(
+                static_cast<char*>(ptr) - sizeof(block_header));
+
+            if (UNLIKELY(!header))
+                return nullptr;
+
+            if (UNLIKELY(!header->is_valid()))
+                return nullptr;
+
+            if (UNLIKELY(header->size() > (1ULL << 47)))
+                return nullptr;
+
+            // the sample described the block as it was allocated
+            JALLOC_SAMPLE(if (UNLIKELY(header->is_sampled())) forget_sample(header));
+
+            old_size = header->size();
+            const uint8_t old_class = header->size_class();
+
+#if defined(__clang__)
+            HAVE_BUILTIN_ASSUME(old_class <= SIZE_CLASSES || old_class >= ALIGNED_CLASS);
+#endif
+
+            // Spans grow onto the free pages behind them and give back their tail
+            if (old_class == SPAN_CLASS && new_size > MEDIUM_LARGE_THRESHOLD)
+            {
+                segment* seg = segment::of(header);
+                const size_t pages = seg->span_pages(header);
+                const size_t needed = (new_size + sizeof(block_header) + PG_SIZE - 1) / PG_SIZE;
+                bool zeroed = true;
+                if (needed <= pages || (needed <= MID_MAX_PAGES && seg->grow_span(header, needed, zeroed)))
+                {
+                    if (needed < pages)
+                        seg->shrink_span(header, needed);
+                    JALLOC_STAT(stat(STAT_SPANS).allocated_bytes.add((needed - pages) * PG_SIZE));
+                    JALLOC_STAT(if (needed > pages) stat(STAT_SPANS).mapped_bytes.add((needed - pages) * PG_SIZE));
+                    JALLOC_STAT(if (needed < pages) stat_return(STAT_SPANS, (pages - needed) * PG_SIZE));
+                    header->encode(new_size, SPAN_CLASS, false);
+                    // recycled pages it grew over may hold anything
+                    header->mark_dirty(zeroed ? new_size : needed * PG_SIZE - sizeof(block_header));
+                    return ptr;
+                }
+            }
+
+            if (old_class < SIZE_CLASSES)
+            {
+                if (const size_t max_size = size_classes[old_class].size; new_size <= max_size)
+                {
+                    // a later move copies header->size() bytes, keep it current
+                    header->encode(new_size, old_class, false);
+                    return ptr;
+                }
+            }
+
+            // The header holds the mapping's capacity: growth within it is
+            // free, shrinking unmaps the tail once it is worth a syscall
+            if (UNLIKELY(header->is_memory_mapped()))
+            {
+                void* block = static_cast<char*>(ptr) - sizeof(block_header);
+                const size_t old_total = old_size + sizeof(block_header);
+                if (new_size <= old_size && new_size > MID_LARGE_THRESHOLD)
+                {
+                    header->mark_dirty(new_size);
+                    #ifndef _WIN32
+                    if (const size_t keep = (new_size + sizeof(block_header) + PG_SIZE - 1) & ~(PG_SIZE - 1);
+                        old_total - keep >= old_total / 4)
+                    {
+                        UNMAP_MEMORY(static_cast<char*>(block) + keep, old_total - keep);
+                        JALLOC_STAT(stats_registry::bump(stats_registry_.unmap_calls));
+                        JALLOC_STAT(stat(STAT_LARGE).allocated_bytes.sub(old_total - keep));
+                        JALLOC_STAT(stat_return(STAT_LARGE, old_total - keep));
+                        header->encode(keep - sizeof(block_header), 255, false);
+                        header->set_memory_mapped(true);
+                    }
+                    #endif
+                    return ptr;
+                }
+
+                #ifdef __linux__
+                if (new_size > old_size)
+                {
+                    const size_t new_total = (large_growth(new_size) + sizeof(block_header) + PG_SIZE - 1)
+                                             & ~(PG_SIZE - 1);
+                    void* new_block = mremap(block, old_total, new_total, MREMAP_MAYMOVE);
+                    JALLOC_STAT(stats_registry::bump(stats_registry_.map_calls));
+                    if (new_block != MAP_FAILED)
+                    {
+                        JALLOC_STAT(stat(STAT_LARGE).allocated_bytes.add(new_total - old_total));
+                        JALLOC_STAT(stat(STAT_LARGE).mapped_bytes.add(new_total - old_total));
+                        auto* new_header = reinterpret_cast<block_header*>(new_block);
+                        new_header->encode(new_total - sizeof(block_header), 255, false);
+                        new_header->set_memory_mapped(true);
+                        new_header->mark_dirty(new_size);
+                        return static_cast<char*>(new_block) + sizeof(block_header);
+                    }
+                }
+                #endif
+            }
+        }
+
+        // A block that outgrows the mid-size range is likely to keep growing
+        void* new_ptr = new_size > old_size && new_size > MID_LARGE_THRESHOLD
+                            ? allocate_growing(new_size)
+                            : allocate(new_size);
+        if (UNLIKELY(!new_ptr))
+            return nullptr;
+
+        copy_memory(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+
+        deallocate(ptr);
+        return new_ptr;
+    }
+
+    // Spans and mapped blocks are only cleared over the bytes an earlier
+    // owner may have written; memory fresh from the OS is not touched at all
+    ALWAYS_INLINE NO_SANITIZE_ADDRESS
+    static void* callocate(const size_t num, const size_t size) noexcept
+    {
+        if (UNLIKELY(num == 0 || size == 0))
+            return nullptr;
+
+        if (UNLIKELY(num > SIZE_MAX / size))
+            return nullptr;
+        JALLOC_RECORD(if (trace_wanted())
+                          return traced(trace_recorder::CALLOCATE, nullptr, num * size,
+                                        [num, size] { return callocate(num, size); }));
+
+        const size_t total_size = num * size;
+        JALLOC_SAMPLE(if (UNLIKELY((sample_countdown_ -= static_cast<int64_t>(total_size)) < 0))
+                          return allocate_sampled(total_size, true));
+        return callocate_unsampled(total_size);
+    }
+
+private:
+    static void* callocate_unsampled(const size_t total_size) noexcept
+    {
+        if (total_size > MEDIUM_LARGE_THRESHOLD)
+        {
+            register_thread_cleanup();
+            if (UNLIKELY(total_size > (1ULL << 47)))
+                return nullptr;
+            return total_size <= MID_LARGE_THRESHOLD
+                       ? allocate_mid(total_size, true)
+                       : allocate_large(total_size, true);
+        }
+
+        void* ptr = allocate_unsampled(total_size);
+        if (UNLIKELY(!ptr))
+            return nullptr;
+
+        std::memset(ptr, 0, total_size);
+        return ptr;
+    }
+
+    // A block reallocate() moves past the mid-size range, mapped with
+    // headroom. Sampled like any other allocation, a sampled one gets none.
+    static void* allocate_growing(const size_t size) noexcept
+    {
+        JALLOC_SAMPLE(if (UNLIKELY((sample_countdown_ -= static_cast<int64_t>(size)) < 0))
+                          return allocate_sampled(size));
+        return allocate_large(large_growth(size));
+    }
+
+public:
+
+    // Bytes the block can actually hold, 0 for nullptr or a pointer that
+    // does not look like one of ours
+    static size_t usable_size(const void* ptr) noexcept
+    {
+        if (UNLIKELY(!ptr))
+            return 0;
+
+        if (const page_owner* page = pool_page_of(ptr); page && page->size_class < SMALL_CLASSES)
+            return size_classes[page->size_class].size;
+
+        if (UNLIKELY(!block_header::is_aligned(ptr)))
+            return 0;
+
+        const auto* header = reinterpret_cast<const block_header*>(
+            static_cast<const char*>(ptr) - sizeof(block_header));
+        if (UNLIKELY(!header->is_valid()))
+            return 0;
+
+        const uint8_t size_class = header->size_class();
+        if (size_class < SIZE_CLASSES)
+            return size_classes[size_class].size;
+        if (size_class == SPAN_CLASS)
+            return segment::of(header)->span_pages(header) * PG_SIZE - sizeof(block_header);
+        if (size_class == ALIGNED_CLASS)
+        {
+            // whatever is left of the block it was cut from
+            const char* base = reinterpret_cast<const char*>(header->prev_physical + 1);
+            return base + usable_size(base) - static_cast<const char*>(ptr);
+        }
+        return header->size();
+    }
+
+    // Returns free memory to the OS right away. The calling thread drops its
+    // caches now, every other thread on its next span or large allocation.
+    // Returns the bytes purged from segments.
+    static size_t scavenge() noexcept
+    {
+        scavenge_epoch_.fetch_add(1, std::memory_order_relaxed);
+        check_scavenge();
+        orphans_.drop_blocks();
+        return segments_.purge();
+    }
+
+    // Scavenge every `interval` while the process RSS is above `rss_target`
+    // bytes. Calling it again updates both.
+    static void start_scavenger(const size_t rss_target,
+                                const std::chrono::milliseconds interval = std::chrono::milliseconds(1000)) noexcept
+    {
+        scavenger_t::get().start(rss_target, interval);
+    }
+
+    static void stop_scavenger() noexcept
+    {
+        scavenger_t::get().stop();
+    }
+
+    // Runtime tuning by key, false for an unknown key or a value out of
+    // range. The same keys are read from the environment at startup,
+    // upper-cased with JALLOC_ in front and '.' as '_', e.g.
+    // JALLOC_THREAD_CACHE_BUDGET=1M. Sizes are in bytes, intervals in ms.
+    //
+    //   thread_cache.depth      blocks per class, 1..CACHE_SIZE
+    //   thread_cache.budget     bytes all classes of a thread may hold
+    //   span_cache.depth        spans kept per page count, 0..SPAN_CACHE_DEPTH
+    //   large_cache.depth       mappings kept per bin, 0..LARGE_CACHE_DEPTH
+    //   large_cache.bytes       bytes of mappings a thread may keep
+    //   large_cache.decay_ms    idle time before a kept mapping is unmapped
+    //   scavenger.rss_target    starts the scavenger, or retargets it
+    //   scavenger.interval_ms   time between two scavenger passes
+    //   scavenger.enabled       0 stops the scavenger, 1 starts it
+    //   huge_pages              0 or 1, see set_huge_pages()
+    //   profile.sample_rate     see set_sample_rate(), JALLOC_PROFILE only
+    //
+    // Caches pick new limits up as they are next used, blocks they hold
+    // past a lowered limit drain out through the ordinary paths.
+    static bool control(const char* key, const size_t value) noexcept
+    {
+        tuning& knobs = tuning::get();
+        const auto is = [key](const char* name) { return std::strcmp(key, name) == 0; };
+        const auto store = [value](std::atomic<size_t>& field, const size_t low, const size_t high)
+        {
+            if (value < low || value > high)
+                return false;
+            field.store(value, std::memory_order_relaxed);
+            return true;
+        };
+
+        if (is("thread_cache.depth"))
+            return store(knobs.thread_cache_depth, 1, CACHE_SIZE);
+        if (is("thread_cache.budget"))
+            return store(knobs.thread_cache_budget, 0, SIZE_MAX);
+        if (is("span_cache.depth"))
+            return store(knobs.span_cache_depth, 0, SPAN_CACHE_DEPTH);
+        if (is("large_cache.depth"))
+            return store(knobs.large_cache_depth, 0, LARGE_CACHE_DEPTH);
+        if (is("large_cache.bytes"))
+            return store(knobs.large_cache_bytes, 0, SIZE_MAX);
+        if (is("large_cache.decay_ms"))
+        {
+            const uint64_t rate = large_block_cache_t::ticks_per_ms();
+            const uint64_t ticks = value < UINT64_MAX / rate ? value * rate : UINT64_MAX;
+            knobs.large_cache_decay_ticks.store(ticks, std::memory_order_relaxed);
+            return true;
+        }
+        if (is("scavenger.rss_target") || is("scavenger.interval_ms") || is("scavenger.enabled"))
+        {
+            scavenger_t& scavenger = scavenger_t::get();
+            size_t target;
+            std::chrono::milliseconds interval;
+            bool running;
+            {
+                std::lock_guard guard(scavenger.mutex);
+                target = scavenger.rss_target;
+                interval = scavenger.interval;
+                running = scavenger.running;
+            }
+            if (is("scavenger.enabled"))
+            {
+                if (value > 1)
+                    return false;
+                value ? scavenger.start(target, interval) : scavenger.stop();
+                return true;
+            }
+            if (is("scavenger.rss_target"))
+            {
+                scavenger.start(value, interval);
+                return true;
+            }
+            if (value == 0)
+                return false;
+            interval = std::chrono::milliseconds(value);
+            if (running)
+            {
+                scavenger.start(target, interval);
+                return true;
+            }
+            std::lock_guard guard(scavenger.mutex);
+            scavenger.interval = interval;
+            return true;
+        }
+        if (is("huge_pages"))
+        {
+            if (value > 1)
+                return false;
+            set_huge_pages(value != 0);
+            return true;
+        }
+#ifdef JALLOC_PROFILING
+        if (is("profile.sample_rate"))
+        {
+            set_sample_rate(value);
+            return true;
+        }
+#endif
+        return false;
+    }
+
+    // Decimal with an optional K, M or G suffix
+    static bool parse_size(const char* text, size_t& value) noexcept
+    {
+        value = 0;
+        if (*text < '0' || *text > '9')
+            return false;
+        for (; *text >= '0' && *text <= '9'; ++text)
+        {
+            const size_t digit = static_cast<size_t>(*text - '0');
+            if (value > SIZE_MAX / 10 || value * 10 > SIZE_MAX - digit)
+                return false;
+            value = value * 10 + digit;
+        }
+        size_t shift = 0;
+        switch (*text)
+        {
+            case 'k': case 'K': shift = 10; ++text; break;
+            case 'm': case 'M': shift = 20; ++text; break;
+            case 'g': case 'G': shift = 30; ++text; break;
+            default: break;
+        }
+        if (*text || value > (SIZE_MAX >> shift))
+            return false;
+        value <<= shift;
+        return true;
+    }
+
+    // Applies every JALLOC_* variable that names a control() key. Runs once
+    // from a static initialiser, allocations made before it see the defaults.
+    static bool load_environment() noexcept
+    {
+        static constexpr const char* keys[] = {
+            "thread_cache.depth", "thread_cache.budget", "span_cache.depth",
+            "large_cache.depth", "large_cache.bytes", "large_cache.decay_ms",
+            "scavenger.interval_ms", "scavenger.rss_target", "scavenger.enabled",
+            "huge_pages", "profile.sample_rate",
+        };
+        for (const char* key : keys)
+        {
+            char name[64] = "JALLOC_";
+            size_t n = 7;
+            for (const char* c = key; *c && n + 1 < sizeof(name); ++c)
+                name[n++] = *c == '.' ? '_' : *c >= 'a' && *c <= 'z' ? static_cast<char>(*c - 'a' + 'A') : *c;
+            name[n] = 0;
+
+            size_t value;
+            if (const char* text = std::getenv(name); text && parse_size(text, value))
+                control(key, value);
+        }
+        JALLOC_RECORD(if (const char* path = std::getenv("JALLOC_TRACE_FILE"); path && *path)
+                          start_trace_file(path));
+        return true;
+    }
+
+    // Sums every thread's counters. Without JALLOC_STATS only
+    // segment_bytes is filled in and `enabled` is false.
+    static jalloc::stats_snapshot stats() noexcept
+    {
+        jalloc::stats_snapshot snapshot{};
+        for (size_t i = 0; i < SIZE_CLASSES; ++i)
+            snapshot.classes[i].size = size_classes[i].size;
+        snapshot.spans.size = MID_LARGE_THRESHOLD;
+        snapshot.large.size = 1ULL << 47;
+        for (size_t node = 0; node < NUMA_MAX_NODES; ++node)
+            snapshot.segment_bytes[node] = numa::segment_bytes[node].load(std::memory_order_relaxed);
+
+#ifdef JALLOC_STATS
+        snapshot.enabled = true;
+        stats_registry_.collect(snapshot);
+#endif
+        return snapshot;
+    }
+
+    // Mean bytes allocated between two samples, 0 stops sampling. Ignored
+    // unless built with JALLOC_PROFILE.
+    static void set_sample_rate(const size_t bytes) noexcept
+    {
+        JALLOC_SAMPLE(profiler_.rate.store(bytes, std::memory_order_relaxed));
+        (void)bytes;
+    }
+
+    // Writes the live samples to `fd` as a pprof heap profile. False when
+    // the write fails or the profiler is not built in.
+    static bool dump_profile(const int fd) noexcept
+    {
+#ifdef JALLOC_PROFILING
+        return profiler_.dump(fd);
+#else
+        (void)fd;
+        return false;
+#endif
+    }
+
+#ifdef JALLOC_TRACING
+    // JALLOC_TRACE_FILE names a file per process, `path.pid`: every program
+    // a traced one starts inherits the variable
+    static void start_trace_file(const char* path) noexcept
+    {
+        char name[4096];
+        size_t n = 0;
+        while (path[n] && n < sizeof(name) - 24)
+        {
+            name[n] = path[n];
+            ++n;
+        }
+        char digits[20];
+        size_t count = 0;
+        for (auto pid = static_cast<unsigned long>(getpid()); pid || count == 0; pid /= 10)
+            digits[count++] = static_cast<char>('0' + pid % 10);
+        name[n++] = '.';
+        while (count)
+            name[n++] = digits[--count];
+        name[n] = 0;
+        start_trace(open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644), true);
+    }
+#endif
+
+    // Records every allocate, deallocate, reallocate and callocate made from
+    // now on into `fd` until stop_trace(), see jalloc_replay to run the
+    // trace again. Events are buffered per thread and written by a thread
+    // of the recorder. With `owned` the recorder closes `fd` when done.
+    // False when a trace already runs, or without JALLOC_TRACE.
+    static bool start_trace(const int fd, const bool owned = false) noexcept
+    {
+#ifdef JALLOC_TRACING
+        static const bool fork_handled = pthread_atfork(nullptr, nullptr, [] { trace_recorder::get().after_fork(); }) == 0;
+        (void)fork_handled;
+        if (trace_recorder::get().start(fd, owned))
+            return true;
+        if (owned && fd >= 0)
+            close(fd);
+        return false;
+#else
+        (void)fd;
+        (void)owned;
+        return false;
+#endif
+    }
+
+    // Ends the trace once what the threads handed over is written. Events
+    // still buffered in other threads are written when those threads fill
+    // their chunk or exit while a trace runs, so join workers first.
+    static void stop_trace() noexcept
+    {
+#ifdef JALLOC_TRACING
+        flush_trace();
+        trace_recorder::get().stop();
+#endif
+    }
+
+    // Opt-in huge page backing for segments and mapped blocks of 2 MB and
+    // up: MADV_HUGEPAGE on Linux, MEM_LARGE_PAGES on Windows. Applies to
+    // memory mapped after the call.
+    static void set_huge_pages(const bool enabled) noexcept
+    {
+        huge_pages_.store(enabled, std::memory_order_relaxed);
+    }
+
+    ALWAYS_INLINE
+    static void cleanup() noexcept
+    {
+        orphans_.push_blocks(large_block_cache_);
+        for (uint8_t size_class = TINY_CLASSES; size_class < SIZE_CLASSES; ++size_class)
+            flush_cache(size_class, thread_cache_.caches[size_class].count);
+        thread_cache_.clear();
+        if (owner_tag_)
+        {
+            for (auto& transfer : transfer_)
+            {
+                transfer.reclaim_owned(owner_tag_, [](void* ptr, const uint8_t size_class)
+                {
+                    JALLOC_STAT(stat(size_class).cached_bytes.sub(size_classes[size_class].size));
+                    pool_manager_.deallocate(ptr, size_class);
+                });
+            }
+        }
+
+        tiny_pools_.release();
+        pool_manager_.release();
+        span_cache_.release();
+        page_heap_.release();
+    }
+
+#ifndef _WIN32
+    // fork() keeps only the calling thread, so a lock another thread held
+    // at that moment would stay held in the child for good. Every lock an
+    // allocation can take is held across the fork, in the order the code
+    // nests them: transfer caches, orphanage, segment registry, segments,
+    // then the leaf locks of the counters and the profiler.
+    static void lock_for_fork() noexcept
+    {
+        for (auto& transfer : transfer_)
+            for (auto& stack : transfer.classes)
+                stack.lock.lock();
+        orphans_.lock.lock();
+        segments_.lock.lock();
+        for (segment* seg = segments_.head; seg; seg = seg->all_next)
+            seg->lock.lock();
+        JALLOC_STAT(stats_registry_.lock.lock());
+        JALLOC_SAMPLE(profiler_.lock.lock());
+    }
+
+    // Parent and child alike, the child's locks are plain flags it now owns
+    static void unlock_after_fork() noexcept
+    {
+        JALLOC_SAMPLE(profiler_.lock.unlock());
+        JALLOC_STAT(stats_registry_.lock.unlock());
+        for (segment* seg = segments_.head; seg; seg = seg->all_next)
+            seg->lock.unlock();
+        segments_.lock.unlock();
+        orphans_.lock.unlock();
+        for (auto& transfer : transfer_)
+            for (auto& stack : transfer.classes)
+                stack.lock.unlock();
+    }
+
+    static bool register_fork_handlers() noexcept
+    {
+        return pthread_atfork(lock_for_fork, unlock_after_fork, unlock_after_fork) == 0;
+    }
+#endif
+};
+
+// Initialization
+thread_local thread_cache_t Jallocator::thread_cache_{};
+thread_local Jallocator::pool_manager Jallocator::pool_manager_{};
+thread_local Jallocator::large_block_cache_t Jallocator::large_block_cache_{};
+thread_local Jallocator::tiny_block_manager Jallocator::tiny_pools_{};
+thread_local Jallocator::page_heap Jallocator::page_heap_{};
+thread_local Jallocator::span_cache_t Jallocator::span_cache_{};
+thread_local uint64_t Jallocator::owner_tag_{0};
+Jallocator::owner_registry Jallocator::owners_{};
+Jallocator::transfer_cache Jallocator::transfer_[NUMA_MAX_NODES]{};
+Jallocator::segment_registry Jallocator::segments_{};
+Jallocator::orphanage Jallocator::orphans_{};
+std::atomic<uint64_t> Jallocator::scavenge_epoch_{0};
+std::atomic<bool> Jallocator::huge_pages_{false};
+thread_local uint64_t Jallocator::scavenge_seen_{0};
+#ifdef JALLOC_STATS
+thread_local Jallocator::thread_stats Jallocator::stats_{};
+Jallocator::stats_registry Jallocator::stats_registry_{};
+#endif
+#ifdef JALLOC_PROFILING
+thread_local int64_t Jallocator::sample_countdown_{0};
+thread_local uint64_t Jallocator::sample_rng_{0};
+thread_local bool Jallocator::in_profiler_{false};
+Jallocator::heap_profiler Jallocator::profiler_{};
+#endif
+#ifdef JALLOC_TRACING
+std::atomic<bool> Jallocator::tracing_{false};
+thread_local Jallocator::trace_state Jallocator::trace_{};
+#endif
+// the only dynamic initialisers, see the JALLOC_OVERRIDE notes below
+#ifndef _WIN32
+const bool Jallocator::fork_handled_ = Jallocator::register_fork_handlers();
+#endif
+const bool Jallocator::environment_loaded_ = Jallocator::load_environment();
+
+// Free-standing entry points, jalloc::deallocate(ptr, size) is the sized free
+namespace jalloc
+{
+    ALWAYS_INLINE
+    void* allocate(const size_t size) noexcept
+    {
+        return Jallocator::allocate(size);
+    }
+
+    ALWAYS_INLINE
+    void* allocate_aligned(const size_t size, const size_t alignment) noexcept
+    {
+        return Jallocator::allocate_aligned(size, alignment);
+    }
+
+    ALWAYS_INLINE
+    void* reallocate(void* ptr, const size_t new_size) noexcept
+    {
+        return Jallocator::reallocate(ptr, new_size);
+    }
+
+    ALWAYS_INLINE
+    void deallocate(void* ptr) noexcept
+    {
+        Jallocator::deallocate(ptr);
+    }
+
+    ALWAYS_INLINE
+    void deallocate(void* ptr, const size_t size) noexcept
+    {
+        Jallocator::deallocate(ptr, size);
+    }
+
+    ALWAYS_INLINE
+    void* callocate(const size_t num, const size_t size) noexcept
+    {
+        return Jallocator::callocate(num, size);
+    }
+
+    ALWAYS_INLINE
+    size_t usable_size(const void* ptr) noexcept
+    {
+        return Jallocator::usable_size(ptr);
+    }
+
+    inline stats_snapshot stats() noexcept
+    {
+        return Jallocator::stats();
+    }
+
+    inline bool control(const char* key, const size_t value) noexcept
+    {
+        return Jallocator::control(key, value);
+    }
+
+    inline void set_sample_rate(const size_t bytes) noexcept
+    {
+        Jallocator::set_sample_rate(bytes);
+    }
+
+    inline bool dump_profile(const int fd) noexcept
+    {
+        return Jallocator::dump_profile(fd);
+    }
+
+    inline bool start_trace(const int fd) noexcept
+    {
+        return Jallocator::start_trace(fd);
+    }
+
+    inline void stop_trace() noexcept
+    {
+        Jallocator::stop_trace();
+    }
+
+    // Bump-pointer region for objects that die together, e.g. everything a
+    // request handler builds. Chunks are page spans from the calling
+    // thread's segments, the same source pool pages come from. Allocation
+    // moves a cursor: there is no block header, no bitmap and no per-object
+    // free. reset() keeps the newest chunk and returns the others, the
+    // destructor returns them all. Destructors of the objects are not run.
+    //
+    // Not thread-safe, but it may be reset or destroyed on another thread.
+    class arena
+    {
+    public:
+        arena() noexcept = default;
+        arena(const arena&) = delete;
+        arena& operator=(const arena&) = delete;
+
+        ~arena()
+        {
+            release();
+        }
+
+        // Null when out of memory or when `alignment` is not a power of
+        // two up to 2^47, which allocate_slow turns down before the
+        // rounding can wrap the cursor. A zero-byte block still points
+        // into a chunk: the cursor has to be short of the limit, which
+        // also sends a fresh arena, where both are 0, to allocate_slow.
+        ALWAYS_INLINE
+        void* allocate(const size_t size, const size_t alignment = alignof(std::max_align_t)) noexcept
+        {
+            const bool valid = alignment - 1 < (1ULL << 47) && (alignment & (alignment - 1)) == 0;
+            const uintptr_t start = (cursor_ + alignment - 1) & ~(alignment - 1);
+            if (LIKELY(valid && start < limit_ && size <= limit_ - start))
+            {
+                cursor_ = start + size;
+                return reinterpret_cast<void*>(start);
+            }
+            return allocate_slow(size, alignment);
+        }
+
+        // Everything allocated so far is gone. A handler that fits in one
+        // chunk never goes back to the page heap.
+        void reset() noexcept
+        {
+            release_chunks(oversized_);
+            oversized_ = nullptr;
+            if (!chunks_)
+                return;
+            release_chunks(chunks_->next);
+            chunks_->next = nullptr;
+            cursor_ = reinterpret_cast<uintptr_t>(chunks_ + 1);
+        }
+
+        void release() noexcept
+        {
+            release_chunks(oversized_);
+            release_chunks(chunks_);
+            oversized_ = chunks_ = nullptr;
+            cursor_ = limit_ = 0;
+            next_chunk_ = ARENA_MIN_CHUNK;
+        }
+
+    private:
+        // At the start of every chunk and oversized block
+        struct chunk
+        {
+            chunk* next;
+        };
+
+        chunk* chunks_{nullptr}; // newest, the one being carved, first
+        chunk* oversized_{nullptr};
+        uintptr_t cursor_{0};
+        uintptr_t limit_{0};
+        size_t next_chunk_{ARENA_MIN_CHUNK};
+
+        static void release_chunks(chunk* c) noexcept
+        {
+            while (c)
+            {
+                chunk* next = c->next;
+                Jallocator::deallocate(c);
+                c = next;
+            }
+        }
+
+        [[gnu::noinline]]
+        void* allocate_slow(const size_t size, const size_t alignment) noexcept
+        {
+            if (UNLIKELY(alignment == 0 || (alignment & (alignment - 1)) != 0))
+                return nullptr;
+            if (UNLIKELY(size > (1ULL << 47) || alignment > (1ULL << 47)))
+                return nullptr;
+
+            const size_t needed = sizeof(chunk) + size + alignment;
+            if (needed > ARENA_MAX_CHUNK / 4)
+            {
+                auto* block = static_cast<chunk*>(Jallocator::allocate(needed));
+                if (UNLIKELY(!block))
+                    return nullptr;
+                block->next = oversized_;
+                oversized_ = block;
+                return reinterpret_cast<void*>((reinterpret_cast<uintptr_t>(block + 1) + alignment - 1)
+                                               & ~(alignment - 1));
+            }
+
+            while (next_chunk_ - BLOCK_HEADER_SIZE < needed)
+                next_chunk_ *= 2;
+            // the span header and the chunk fill whole pages
+            const size_t bytes = next_chunk_ - BLOCK_HEADER_SIZE;
+            auto* fresh = static_cast<chunk*>(Jallocator::allocate(bytes));
+            if (UNLIKELY(!fresh))
+                return nullptr;
+            if (next_chunk_ < ARENA_MAX_CHUNK)
+                next_chunk_ *= 2;
+
+            fresh->next = chunks_;
+            chunks_ = fresh;
+            cursor_ = reinterpret_cast<uintptr_t>(fresh + 1);
+            limit_ = reinterpret_cast<uintptr_t>(fresh) + bytes;
+            return allocate(size, alignment);
+        }
+    };
+
+#if defined(__cpp_lib_memory_resource)
+    // std::pmr view of an arena. Deallocation is a no-op, the memory comes
+    // back when the arena is reset.
+    class arena_resource final : public std::pmr::memory_resource
+    {
+    public:
+        explicit arena_resource(arena& region) noexcept
+            : region_(region)
+        {
+        }
+
+    private:
+        arena& region_;
+
+        void* do_allocate(const size_t bytes, const size_t alignment) override
+        {
+            void* ptr = region_.allocate(bytes, alignment);
+            if (UNLIKELY(!ptr))
+            {
+                #if defined(__cpp_exceptions)
+                    throw std::bad_alloc();
+                #else
+                    std::abort();
+                #endif
+            }
+            return ptr;
+        }
+
+        void do_deallocate(void*, size_t, size_t) noexcept override
+        {
+        }
+
+        bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+        {
+            return this == &other;
+        }
+    };
+#endif
+
+    // STL allocator. Single objects, which is what node containers ask
+    // for, resolve their size class at compile time; arrays take the
+    // regular sized path.
+    template<typename T>
+    class allocator
+    {
+    public:
+        using value_type = T;
+
+        allocator() noexcept = default;
+
+        template<typename U>
+        allocator(const allocator<U>&) noexcept
+        {
+        }
+
+        T* allocate(const size_t n)
+        {
+            void* ptr = LIKELY(n == 1) ? Jallocator::allocate_fixed<sizeof(T), alignof(T)>() : allocate_array(n);
+            if (UNLIKELY(!ptr))
+            {
+                #if defined(__cpp_exceptions)
+                    throw std::bad_alloc();
+                #else
+                    std::abort();
+                #endif
+            }
+            return static_cast<T*>(ptr);
+        }
+
+        void deallocate(T* ptr, const size_t n) noexcept
+        {
+            if (LIKELY(n == 1))
+                Jallocator::deallocate_fixed<sizeof(T), alignof(T)>(ptr);
+            else if constexpr (alignof(T) <= ALIGNMENT)
+                Jallocator::deallocate(ptr, n * sizeof(T));
+            else
+                Jallocator::deallocate(ptr);
+        }
+
+        template<typename U>
+        bool operator==(const allocator<U>&) const noexcept
+        {
+            return true;
+        }
+
+        template<typename U>
+        bool operator!=(const allocator<U>&) const noexcept
+        {
+            return false;
+        }
+
+    private:
+        // n * sizeof(T) is a multiple of alignof(T), which every class up
+        // to 64-byte alignment honours as it is
+        static void* allocate_array(const size_t n) noexcept
+        {
+            if (UNLIKELY(n == 0 || n > (1ULL << 47) / sizeof(T)))
+                return nullptr;
+            if constexpr (alignof(T) <= ALIGNMENT)
+                return Jallocator::allocate(n * sizeof(T));
+            else
+                return Jallocator::allocate_aligned(n * sizeof(T), alignof(T));
+        }
+    };
+
+    // Typed allocation through the compile-time path. The pool itself is
+    // the thread cache of T's size class, so it holds no state and objects
+    // may be destroyed on any thread.
+    template<typename T>
+    class object_pool
+    {
+    public:
+        // Null when out of memory. An exception from the constructor gives
+        // the memory back and propagates.
+        template<typename... Args>
+        static T* create(Args&&... args)
+        {
+            void* ptr = Jallocator::allocate_fixed<sizeof(T), alignof(T)>();
+            if (UNLIKELY(!ptr))
+                return nullptr;
+            #if defined(__cpp_exceptions)
+                try
+                {
+                    return new (ptr) T(std::forward<Args>(args)...);
+                }
+                catch (...)
+                {
+                    Jallocator::deallocate_fixed<sizeof(T), alignof(T)>(ptr);
+                    throw;
+                }
+            #else
+                return new (ptr) T(std::forward<Args>(args)...);
+            #endif
+        }
+
+        static void destroy(T* object) noexcept
+        {
+            if (!object)
+                return;
+            object->~T();
+            Jallocator::deallocate_fixed<sizeof(T), alignof(T)>(object);
+        }
+    };
+
+#ifdef JALLOC_PROFILING
+    inline bool dump_profile(const char* path) noexcept
+    {
+        const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+            return false;
+        const bool ok = Jallocator::dump_profile(fd);
+        return close(fd) == 0 && ok;
+    }
+#endif
+
+#ifdef JALLOC_TRACING
+    inline bool start_trace(const char* path) noexcept
+    {
+        return Jallocator::start_trace(open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644), true);
+    }
+#endif
+}
+
+// Replacements for the C allocation functions and the global operators.
+// libjalloc is built from jalloc_override.cpp, which defines
+// JALLOC_OVERRIDE; a program can define it in exactly one of its own
+// translation units instead to link the same in statically.
+//
+// The loader and libc call malloc before any constructor of ours has run,
+// so the allocation paths only touch constant-initialised statics and
+// plain TLS that needs no setup. The scavenger and the trace recorder
+// build their locks and threads on first use, which is never from an
+// allocation. Two dynamic initialisers run at startup: one registers the
+// fork handlers, which cannot matter before a second thread exists, and
+// the other applies the JALLOC_* variables, so blocks handed out before
+// it runs use the built-in tuning.
+#if defined(JALLOC_OVERRIDE) && !defined(_WIN32)
+
+#include <cstdlib>
+
+#ifdef __THROW
+    #define JALLOC_NOTHROW __THROW
+#else
+    #define JALLOC_NOTHROW
+#endif
+#define JALLOC_EXPORT __attribute__((visibility("default")))
+
+namespace jalloc::detail
+{
+    // malloc and operator new promise alignof(max_align_t), 16 bytes, but
+    // headerless classes step by 8. Past 8 bytes, where an object may need
+    // 16, sizes go up to a multiple of 16, whose slots all fall on 16 bytes.
+    // Zero becomes 1 for a unique pointer, and a size too big to round
+    // becomes 0, which allocate() turns down.
+    ALWAYS_INLINE
+    constexpr size_t request_size(const size_t size) noexcept
+    {
+        return size <= 8 ? (size ? size : 1) : (size + 15) & ~static_cast<size_t>(15);
+    }
+
+    // malloc(0) and friends hand out a unique pointer like the libc they replace
+    ALWAYS_INLINE
+    void* allocate_nonzero(const size_t size) noexcept
+    {
+        void* ptr = Jallocator::allocate(request_size(size));
+        if (UNLIKELY(!ptr))
+            errno = ENOMEM;
+        return ptr;
+    }
+
+    ALWAYS_INLINE
+    void* allocate_aligned_nonzero(const size_t size, size_t alignment) noexcept
+    {
+        // memalign takes any alignment, the next power of two satisfies it
+        if (UNLIKELY(alignment & (alignment - 1)))
+            alignment = 1ULL << (64 - __builtin_clzll(alignment));
+        void* ptr = Jallocator::allocate_aligned(size ? size : 1, alignment ? alignment : 1);
+        if (UNLIKELY(!ptr))
+            errno = ENOMEM;
+        return ptr;
+    }
+
+    // operator new: retry through the new handler, throw once there is none
+    inline void* allocate_or_throw(const size_t size, const size_t alignment = 0)
+    {
+        for (;;)
+        {
+            void* ptr = alignment
+                            ? Jallocator::allocate_aligned(size ? size : 1, alignment)
+                            : Jallocator::allocate(request_size(size));
+            if (LIKELY(ptr))
+                return ptr;
+
+            const std::new_handler handler = std::get_new_handler();
+            if (!handler)
+            {
+                #if defined(__cpp_exceptions)
+                    throw std::bad_alloc();
+                #else
+                    std::abort();
+                #endif
+            }
+            handler();
+        }
+    }
+}
+
+extern "C"
+{
+    JALLOC_EXPORT void* malloc(const size_t size) JALLOC_NOTHROW
+    {
+        return jalloc::detail::allocate_nonzero(size);
+    }
+
+    JALLOC_EXPORT void free(void* ptr) JALLOC_NOTHROW
+    {
+        Jallocator::deallocate(ptr);
+    }
+
+    JALLOC_EXPORT void free_sized(void* ptr, const size_t size) JALLOC_NOTHROW
+    {
+        Jallocator::deallocate(ptr, jalloc::detail::request_size(size));
+    }
+
+    JALLOC_EXPORT void* calloc(const size_t num, const size_t size) JALLOC_NOTHROW
+    {
+        if (UNLIKELY(num == 0 || size == 0))
+            return jalloc::detail::allocate_nonzero(0);
+        if (UNLIKELY(num > SIZE_MAX / size))
+        {
+            errno = ENOMEM;
+            return nullptr;
+        }
+
+        void* ptr = Jallocator::callocate(1, jalloc::detail::request_size(num * size));
+        if (UNLIKELY(!ptr))
+            errno = ENOMEM;
+        return ptr;
+    }
+
+    JALLOC_EXPORT void* realloc(void* ptr, const size_t new_size) JALLOC_NOTHROW
+    {
+        if (!ptr)
+            return jalloc::detail::allocate_nonzero(new_size);
+
+        // zero still frees
+        void* new_ptr = Jallocator::reallocate(ptr, new_size ? jalloc::detail::request_size(new_size) : 0);
+        if (UNLIKELY(!new_ptr && new_size != 0))
+            errno = ENOMEM;
+        return new_ptr;
+    }
+
+    JALLOC_EXPORT int posix_memalign(void** out, const size_t alignment, const size_t size) JALLOC_NOTHROW
+    {
+        if (alignment < sizeof(void*) || (alignment & (alignment - 1)) != 0)
+            return EINVAL;
+        void* ptr = Jallocator::allocate_aligned(size ? size : 1, alignment);
+        if (UNLIKELY(!ptr))
+            return ENOMEM;
+        *out = ptr;
+        return 0;
+    }
+
+    JALLOC_EXPORT void* aligned_alloc(const size_t alignment, const size_t size) JALLOC_NOTHROW
+    {
+        if (UNLIKELY(alignment == 0 || (alignment & (alignment - 1)) != 0))
+        {
+            errno = EINVAL;
+            return nullptr;
+        }
+        return jalloc::detail::allocate_aligned_nonzero(size, alignment);
+    }
+
+    JALLOC_EXPORT void* memalign(const size_t alignment, const size_t size) JALLOC_NOTHROW
+    {
+        return jalloc::detail::allocate_aligned_nonzero(size, alignment);
+    }
+
+    JALLOC_EXPORT void* valloc(const size_t size) JALLOC_NOTHROW
+    {
+        return jalloc::detail::allocate_aligned_nonzero(size, PG_SIZE);
+    }
+
+    JALLOC_EXPORT void* pvalloc(const size_t size) JALLOC_NOTHROW
+    {
+        return jalloc::detail::allocate_aligned_nonzero((size + PG_SIZE - 1) & ~(PG_SIZE - 1), PG_SIZE);
+    }
+
+    JALLOC_EXPORT size_t malloc_usable_size(void* ptr) JALLOC_NOTHROW
+    {
+        return Jallocator::usable_size(ptr);
+    }
+
+    #ifdef __APPLE__
+        JALLOC_EXPORT size_t malloc_size(const void* ptr)
+        {
+            return Jallocator::usable_size(ptr);
+        }
+    #endif
+}
+
+JALLOC_EXPORT void* operator new(const size_t size)
+{
+    return jalloc::detail::allocate_or_throw(size);
+}
+
+JALLOC_EXPORT void* operator new[](const size_t size)
+{
+    return jalloc::detail::allocate_or_throw(size);
+}
+
+JALLOC_EXPORT void* operator new(const size_t size, const std::nothrow_t&) noexcept
+{
+    return Jallocator::allocate(jalloc::detail::request_size(size));
+}
+
+JALLOC_EXPORT void* operator new[](const size_t size, const std::nothrow_t&) noexcept
+{
+    return Jallocator::allocate(jalloc::detail::request_size(size));
+}
+
+JALLOC_EXPORT void* operator new(const size_t size, const std::align_val_t alignment)
+{
+    return jalloc::detail::allocate_or_throw(size, static_cast<size_t>(alignment));
+}
+
+JALLOC_EXPORT void* operator new[](const size_t size, const std::align_val_t alignment)
+{
+    return jalloc::detail::allocate_or_throw(size, static_cast<size_t>(alignment));
+}
+
+JALLOC_EXPORT void* operator new(const size_t size, const std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    return Jallocator::allocate_aligned(size ? size : 1, static_cast<size_t>(alignment));
+}
+
+JALLOC_EXPORT void* operator new[](const size_t size, const std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    return Jallocator::allocate_aligned(size ? size : 1, static_cast<size_t>(alignment));
+}
+
+JALLOC_EXPORT void operator delete(void* ptr) noexcept
+{
+    Jallocator::deallocate(ptr);
+}
+
+JALLOC_EXPORT void operator delete[](void* ptr) noexcept
+{
+    Jallocator::deallocate(ptr);
+}
+
+JALLOC_EXPORT void operator delete(void* ptr, const std::nothrow_t&) noexcept
+{
+    Jallocator::deallocate(ptr);
+}
+
+JALLOC_EXPORT void operator delete[](void* ptr, const std::nothrow_t&) noexcept
+{
+    Jallocator::deallocate(ptr);
+}
+
+// The sized delete names the size new actually asked allocate() for
+JALLOC_EXPORT void operator delete(void* ptr, const size_t size) noexcept
+{
+    Jallocator::deallocate(ptr, jalloc::detail::request_size(size));
+}
+
+JALLOC_EXPORT void operator delete[](void* ptr, const size_t size) noexcept
+{
+    Jallocator::deallocate(ptr, jalloc::detail::request_size(size));
+}
+
+// Aligned blocks may sit behind an offset header, the size says nothing about them
+JALLOC_EXPORT void operator delete(void* ptr, const std::align_val_t) noexcept
+{
+    Jallocator::deallocate(ptr);
+}
+
+JALLOC_EXPORT void operator delete[](void* ptr, const std::align_val_t) noexcept
+{
+    Jallocator::deallocate(ptr);
+}
+
+JALLOC_EXPORT void operator delete(void* ptr, const size_t, const std::align_val_t) noexcept
+{
+    Jallocator::deallocate(ptr);
+}
+
+JALLOC_EXPORT void operator delete[](void* ptr, const size_t, const std::align_val_t) noexcept
+{
+    Jallocator::deallocate(ptr);
+}
+
+JALLOC_EXPORT void operator delete(void* ptr, const std::align_val_t, const std::nothrow_t&) noexcept
+{
+    Jallocator::deallocate(ptr);
+}
+
+JALLOC_EXPORT void operator delete[](void* ptr, const std::align_val_t, const std::nothrow_t&) noexcept
+{
+    Jallocator::deallocate(ptr);
+}
+
+#endif
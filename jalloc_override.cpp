@@ -0,0 +1,4 @@
+// libjalloc: malloc, free and the global operator new/delete backed by
+// jalloc, for LD_PRELOAD (or DYLD_INSERT_LIBRARIES) on existing binaries.
+#define JALLOC_OVERRIDE
+#include "jalloc.hpp"
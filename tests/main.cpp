@@ -1,7 +1,14 @@
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cstring>
 #include <iomanip>
 #include <iostream>
+#include <list>
+#include <memory>
+#include <stdexcept>
 #include <thread>
+#include <unordered_set>
 #include <vector>
 #include "jalloc.hpp"
 
@@ -87,8 +94,7 @@ void benchmark_multi_threaded(const char *name, size_t size, int num_threads = 3
         });
     }
 
-    for (std::iterator_traits<std::__pointer<std::thread, std::allocator<std::thread> >::type>::reference thread:
-         threads)
+    for (auto& thread: threads)
     {
         thread.join();
     }
@@ -106,12 +112,679 @@ void benchmark_multi_threaded(const char *name, size_t size, int num_threads = 3
             << ops_per_sec << '\n';
 }
 
+template<typename Copy>
+void benchmark_copy(const char *name, size_t size, Copy copy)
+{
+    // move about 1 GB per size so short copies are not all timer noise
+    const size_t rounds = std::max<size_t>(1, (size_t(1) << 30) / size);
+    std::vector<char> src(size, 1);
+    std::vector<char> dst(size);
+    copy(dst.data(), src.data(), size);
+
+    auto start = std::chrono::high_resolution_clock::now();
+
+    for (size_t i = 0; i < rounds; ++i)
+    {
+        src[i % size] = static_cast<char>(i);
+        copy(dst.data(), src.data(), size);
+    }
+
+    auto end = std::chrono::high_resolution_clock::now();
+    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+    double gb_per_sec = (rounds * static_cast<double>(size)) / (duration.count() / 1000000.0) / 1e9;
+    volatile char sink = dst[size / 2];
+    (void)sink;
+
+    std::cout << std::left << std::setw(12) << name
+            << "| Copy   | Size: " << std::setw(9) << size
+            << "| Rounds: " << std::setw(7) << rounds
+            << "| Time: " << std::fixed << std::setprecision(3) << std::setw(8)
+            << duration.count() / 1000.0
+            << "ms | GB/s: " << std::setprecision(2)
+            << gb_per_sec << '\n';
+}
+
 struct StdAllocator
 {
 };
 
+static int failures = 0;
+
+static void check(const bool ok, const char *what, size_t size)
+{
+    if (!ok)
+    {
+        std::cerr << "FAIL: " << what << ", size " << size << '\n';
+        ++failures;
+    }
+}
+
+// Class a request of `size` bytes lands in, as the allocate() paths pick it
+static size_t class_for(size_t size)
+{
+    return size <= SMALL_LARGE_THRESHOLD ? (size - 1) >> 3 : medium_class_for(size);
+}
+
+void test_size_classes()
+{
+    // a sampled block is a span, whatever its size
+    Jallocator::control("profile.sample_rate", 0);
+    for (size_t size = 1; size <= MEDIUM_LARGE_THRESHOLD; ++size)
+    {
+        // the smallest class that holds the size, and the block can hold it
+        const size_t size_class = class_for(size);
+        check(size_class < SIZE_CLASSES && size_classes[size_class].size >= size, "class holds size", size);
+        check(size_class == 0 || size_classes[size_class - 1].size < size, "smallest class", size);
+
+        void *ptr = Jallocator::allocate(size);
+        check(ptr && Jallocator::usable_size(ptr) == size_classes[size_class].size, "usable size", size);
+        Jallocator::deallocate(ptr, size);
+    }
+
+    // every class maps back to itself
+    for (size_t size_class = 0; size_class < SIZE_CLASSES; ++size_class)
+        check(class_for(size_classes[size_class].size) == size_class, "class round trip", size_classes[size_class].size);
+
+    // the edges between headerless, medium and span blocks
+    const std::pair<size_t, size_t> edges[] = {
+        {256, 256}, {257, 320}, {2048, 2048}, {2049, PG_SIZE - BLOCK_HEADER_SIZE},
+        {PG_SIZE - BLOCK_HEADER_SIZE + 1, 2 * PG_SIZE - BLOCK_HEADER_SIZE},
+    };
+    for (const auto &[size, usable]: edges)
+    {
+        void *ptr = Jallocator::allocate(size);
+        check(ptr && Jallocator::usable_size(ptr) == usable, "edge usable size", size);
+        Jallocator::deallocate(ptr);
+    }
+    Jallocator::control("profile.sample_rate", PROFILE_SAMPLE_RATE);
+}
+
+static void fill(void *ptr, size_t size, unsigned char seed)
+{
+    auto *bytes = static_cast<unsigned char *>(ptr);
+    for (size_t i = 0; i < size; ++i)
+        bytes[i] = static_cast<unsigned char>(seed + i * 31);
+}
+
+static bool intact(const void *ptr, size_t size, unsigned char seed)
+{
+    const auto *bytes = static_cast<const unsigned char *>(ptr);
+    for (size_t i = 0; i < size; ++i)
+        if (bytes[i] != static_cast<unsigned char>(seed + i * 31))
+            return false;
+    return true;
+}
+
+// Blocks freed on another thread go back to their owner, which hands them out again
+void test_cross_thread_free()
+{
+    const size_t sizes[] = {16, 48, 200, 512, 1500, 9000, 100000};
+    constexpr size_t count = 500;
+
+    for (const size_t size: sizes)
+    {
+        std::vector<void *> blocks;
+        std::atomic<int> phase{0};
+        bool reused = false;
+        bool kept_intact = true;
+
+        std::thread owner([&]
+        {
+            for (size_t i = 0; i < count; ++i)
+            {
+                void *ptr = Jallocator::allocate(size);
+                fill(ptr, std::min<size_t>(size, 64), static_cast<unsigned char>(i));
+                blocks.push_back(ptr);
+            }
+            phase.store(1, std::memory_order_release);
+            while (phase.load(std::memory_order_acquire) != 2)
+                std::this_thread::yield();
+
+            // the odd blocks are still ours and must not be handed out again
+            const std::unordered_set<void *> freed(blocks.begin(), blocks.end());
+            std::vector<void *> again;
+            for (size_t i = 0; i < 4 * count; ++i)
+            {
+                void *ptr = Jallocator::allocate(size);
+                again.push_back(ptr);
+                if (freed.count(ptr))
+                {
+                    reused = true;
+                    const size_t index = std::find(blocks.begin(), blocks.end(), ptr) - blocks.begin();
+                    kept_intact &= index % 2 == 0;
+                }
+            }
+            for (size_t i = 1; i < count; i += 2)
+                kept_intact &= intact(blocks[i], std::min<size_t>(size, 64), static_cast<unsigned char>(i));
+            for (void *ptr: again)
+                Jallocator::deallocate(ptr);
+            for (size_t i = 1; i < count; i += 2)
+                Jallocator::deallocate(blocks[i]);
+        });
+
+        while (phase.load(std::memory_order_acquire) != 1)
+            std::this_thread::yield();
+        for (size_t i = 0; i < count; i += 2)
+            Jallocator::deallocate(blocks[i]);
+        phase.store(2, std::memory_order_release);
+        owner.join();
+
+        check(reused, "remote frees reused by the owner", size);
+        check(kept_intact, "live blocks untouched by remote frees", size);
+    }
+}
+
+// Every size and alignment combination lands on its boundary, can be
+// written in full and resized, from headerless slots up to mappings
+void test_aligned_allocation()
+{
+    const size_t sizes[] = {1, 8, 24, 100, 256, 257, 2000, 5000, 70000, 300000};
+    for (size_t alignment = 1; alignment <= 2 * 1024 * 1024; alignment <<= 1)
+    {
+        for (const size_t size: sizes)
+        {
+            void *ptr = Jallocator::allocate_aligned(size, alignment);
+            check(ptr && reinterpret_cast<uintptr_t>(ptr) % alignment == 0, "aligned", alignment);
+            if (!ptr)
+                continue;
+            check(Jallocator::usable_size(ptr) >= size, "aligned usable size", size);
+            fill(ptr, size, static_cast<unsigned char>(alignment));
+
+            void *grown = Jallocator::reallocate(ptr, 2 * size);
+            check(grown && intact(grown, size, static_cast<unsigned char>(alignment)), "aligned block grows", size);
+            Jallocator::deallocate(grown);
+        }
+    }
+
+    check(!Jallocator::allocate_aligned(64, 48), "alignment not a power of two", 64);
+    check(!Jallocator::allocate_aligned(64, 0), "zero alignment", 64);
+}
+
+static bool zeroed(const void *ptr, size_t size)
+{
+    const auto *bytes = static_cast<const unsigned char *>(ptr);
+    for (size_t i = 0; i < size; ++i)
+        if (bytes[i])
+            return false;
+    return true;
+}
+
+// callocate skips the memset on memory it knows is clean, so every way a
+// block can come back dirty has to be caught: plain reuse, a block that
+// was shrunk before it was freed, and pages the scavenger purged
+void test_callocate_zeroes()
+{
+    const size_t sizes[] = {24, 200, 1000, 3000, 9000, 100000, 300000, 3 << 20};
+    for (const size_t size: sizes)
+    {
+        void *dirty = Jallocator::allocate(size);
+        std::memset(dirty, 0xAB, Jallocator::usable_size(dirty));
+        Jallocator::deallocate(dirty);
+        void *ptr = Jallocator::callocate(1, size);
+        check(ptr && zeroed(ptr, size), "callocate after reuse", size);
+        Jallocator::deallocate(ptr);
+
+        // the bytes past the shrunk size were written all the same
+        dirty = Jallocator::allocate(size);
+        std::memset(dirty, 0xCD, Jallocator::usable_size(dirty));
+        dirty = Jallocator::reallocate(dirty, size / 2 + 1);
+        Jallocator::deallocate(dirty);
+        ptr = Jallocator::callocate(size, 1);
+        check(ptr && zeroed(ptr, size), "callocate after a shrunk block", size);
+        Jallocator::deallocate(ptr);
+
+        dirty = Jallocator::allocate(size);
+        std::memset(dirty, 0xEF, Jallocator::usable_size(dirty));
+        Jallocator::deallocate(dirty);
+        Jallocator::scavenge();
+        ptr = Jallocator::callocate(1, size);
+        check(ptr && zeroed(ptr, size), "callocate after a scavenge", size);
+        Jallocator::deallocate(ptr);
+    }
+
+    check(!Jallocator::callocate(SIZE_MAX / 2, 3), "callocate overflow", SIZE_MAX);
+}
+
+// Arena blocks are aligned, never overlap across chunks and oversized
+// requests, and reset() starts over in the chunk it keeps
+void test_arena()
+{
+    jalloc::arena region;
+    check(region.allocate(0) != nullptr, "zero bytes from a fresh arena", 0);
+    std::vector<std::pair<void *, size_t>> blocks;
+    for (size_t i = 0; i < 4000; ++i)
+    {
+        const size_t size = 1 + i * 37 % 3000;
+        const size_t alignment = size_t(1) << i % 8;
+        void *ptr = region.allocate(size, alignment);
+        check(ptr && reinterpret_cast<uintptr_t>(ptr) % alignment == 0, "arena alignment", alignment);
+        fill(ptr, size, static_cast<unsigned char>(i));
+        blocks.emplace_back(ptr, size);
+    }
+    void *oversized = region.allocate(ARENA_MAX_CHUNK, PG_SIZE);
+    check(oversized && reinterpret_cast<uintptr_t>(oversized) % PG_SIZE == 0, "arena oversized block", ARENA_MAX_CHUNK);
+    fill(oversized, ARENA_MAX_CHUNK, 7);
+
+    bool kept_intact = intact(oversized, ARENA_MAX_CHUNK, 7);
+    for (size_t i = 0; i < blocks.size(); ++i)
+        kept_intact &= intact(blocks[i].first, blocks[i].second, static_cast<unsigned char>(i));
+    check(kept_intact, "arena blocks intact", blocks.size());
+
+    // turned down before the bump, the cursor stays where it was
+    jalloc::arena strict;
+    void *before = strict.allocate(8, 8);
+    check(strict.allocate(16, 0) == nullptr, "arena rejects alignment 0", 0);
+    check(strict.allocate(16, 24) == nullptr, "arena rejects alignment 24", 24);
+    check(strict.allocate(16, size_t(1) << 48) == nullptr, "arena rejects alignment 2^48", 16);
+    check(strict.allocate(16, size_t(1) << 63) == nullptr, "arena rejects alignment 2^63", 16);
+    check(strict.allocate(8, 8) == static_cast<char *>(before) + 8, "arena cursor survives bad alignments", 8);
+
+    region.reset();
+    void *first = region.allocate(100);
+    region.reset();
+    check(first && region.allocate(100) == first, "arena reset reuses its chunk", 100);
+
+    // released by whichever thread is done with it
+    auto moved = std::make_unique<jalloc::arena>();
+    fill(moved->allocate(50000), 50000, 3);
+    std::thread([&moved] { moved.reset(); }).join();
+
+#if defined(__cpp_lib_memory_resource)
+    jalloc::arena backing;
+    jalloc::arena_resource resource(backing);
+    std::pmr::vector<size_t> values(&resource);
+    for (size_t i = 0; i < 10000; ++i)
+        values.push_back(i);
+    size_t sum = 0;
+    for (const size_t value: values)
+        sum += value;
+    check(sum == 10000 * 9999 / 2, "pmr vector on an arena", values.size());
+
+    jalloc::arena fresh;
+    jalloc::arena_resource fresh_resource(fresh);
+    check(fresh_resource.allocate(0) != nullptr, "pmr zero bytes from a fresh arena", 0);
+    void *ptr = resource.allocate(0, 64);
+    check(ptr && reinterpret_cast<uintptr_t>(ptr) % 64 == 0, "pmr zero-byte allocation", 0);
+#endif
+}
+
+struct alignas(128) wide
+{
+    unsigned char bytes[200];
+};
+
+struct tracked
+{
+    static inline int live = 0;
+    size_t value;
+
+    explicit tracked(size_t v) : value(v)
+    {
+#if defined(__cpp_exceptions)
+        if (v == SIZE_MAX)
+            throw std::runtime_error("refused");
+#endif
+        ++live;
+    }
+
+    ~tracked()
+    {
+        --live;
+    }
+};
+
+// Containers on jalloc::allocator keep their elements and their alignment,
+// object_pool constructs and destroys in place and reuses its slots
+void test_typed_allocation()
+{
+    Jallocator::control("profile.sample_rate", 0);
+    std::list<size_t, jalloc::allocator<size_t>> nodes;
+    std::vector<wide, jalloc::allocator<wide>> arrays;
+    for (size_t i = 0; i < 5000; ++i)
+    {
+        nodes.push_back(i);
+        arrays.emplace_back();
+        arrays.back().bytes[0] = static_cast<unsigned char>(i);
+    }
+    size_t sum = 0;
+    for (const size_t value: nodes)
+        sum += value;
+    check(sum == 5000 * 4999 / 2, "list on jalloc::allocator", nodes.size());
+    check(reinterpret_cast<uintptr_t>(arrays.data()) % alignof(wide) == 0, "over-aligned vector", alignof(wide));
+    check(arrays[4999].bytes[0] == static_cast<unsigned char>(4999), "vector on jalloc::allocator", arrays.size());
+
+    jalloc::allocator<wide> single;
+    wide *one = single.allocate(1);
+    check(reinterpret_cast<uintptr_t>(one) % alignof(wide) == 0, "over-aligned single object", alignof(wide));
+    single.deallocate(one, 1);
+
+    std::vector<tracked *> objects;
+    for (size_t i = 0; i < 1000; ++i)
+        objects.push_back(jalloc::object_pool<tracked>::create(i));
+    bool constructed = tracked::live == 1000;
+    for (size_t i = 0; i < objects.size(); ++i)
+        constructed &= objects[i] && objects[i]->value == i;
+    check(constructed, "object_pool constructs in place", objects.size());
+
+    // destroyed on another thread, the blocks go back to their owner
+    std::thread([&objects] { for (tracked *object: objects) jalloc::object_pool<tracked>::destroy(object); }).join();
+    check(tracked::live == 0, "object_pool destroys", objects.size());
+
+    tracked *first = jalloc::object_pool<tracked>::create(1);
+    jalloc::object_pool<tracked>::destroy(first);
+    tracked *second = jalloc::object_pool<tracked>::create(2);
+    check(second == first && second->value == 2, "object_pool reuses its slot", sizeof(tracked));
+    jalloc::object_pool<tracked>::destroy(second);
+    jalloc::object_pool<tracked>::destroy(nullptr);
+    check(tracked::live == 0, "object_pool reuse destroys once", sizeof(tracked));
+
+#if defined(__cpp_exceptions)
+    bool thrown = false;
+    try
+    {
+        jalloc::object_pool<tracked>::create(SIZE_MAX);
+    }
+    catch (const std::runtime_error &)
+    {
+        thrown = true;
+    }
+    check(thrown && tracked::live == 0, "object_pool passes a constructor exception on", sizeof(tracked));
+#endif
+    Jallocator::control("profile.sample_rate", PROFILE_SAMPLE_RATE);
+}
+
+static uintptr_t segment_base(const void *ptr)
+{
+    return reinterpret_cast<uintptr_t>(ptr) & ~(SEGMENT_SIZE - 1);
+}
+
+// An exited thread's pages wait for another thread to adopt them: blocks
+// still live in them keep their contents and are never handed out, freed
+// ones come back to whoever adopts the segment
+void test_thread_exit_handoff()
+{
+    Jallocator::control("profile.sample_rate", 0);
+    const size_t sizes[] = {48, 1000, 9000};
+    constexpr size_t count = 200;
+
+    for (const size_t size: sizes)
+    {
+        std::vector<void *> blocks;
+        std::thread exiting([&]
+        {
+            for (size_t i = 0; i < count; ++i)
+            {
+                void *ptr = Jallocator::allocate(size);
+                fill(ptr, std::min<size_t>(size, 64), static_cast<unsigned char>(i));
+                blocks.push_back(ptr);
+            }
+            // some go out through the thread cache and the transfer cache
+            for (int i = 0; i < 64; ++i)
+                Jallocator::deallocate(Jallocator::allocate(size));
+        });
+        exiting.join();
+
+        std::unordered_set<uintptr_t> segments;
+        bool kept_intact = true;
+        for (size_t i = 0; i < count; ++i)
+        {
+            segments.insert(segment_base(blocks[i]));
+            kept_intact &= intact(blocks[i], std::min<size_t>(size, 64), static_cast<unsigned char>(i));
+        }
+        check(kept_intact, "blocks intact after their thread exited", size);
+
+        // freed from here, onto pages that have no owner
+        for (size_t i = 0; i < count; i += 2)
+            Jallocator::deallocate(blocks[i]);
+
+        bool adopted = false;
+        bool reused = false;
+        bool live_untouched = true;
+        std::thread adopting([&]
+        {
+            const std::unordered_set<void *> freed(blocks.begin(), blocks.end());
+            std::vector<void *> again;
+            for (size_t i = 0; i < count; ++i)
+            {
+                void *ptr = Jallocator::allocate(size);
+                again.push_back(ptr);
+                adopted |= segments.count(segment_base(ptr)) != 0;
+                if (freed.count(ptr))
+                {
+                    reused = true;
+                    const size_t index = std::find(blocks.begin(), blocks.end(), ptr) - blocks.begin();
+                    live_untouched &= index % 2 == 0;
+                }
+            }
+            for (void *ptr: again)
+                Jallocator::deallocate(ptr);
+        });
+        adopting.join();
+
+        for (size_t i = 1; i < count; i += 2)
+            live_untouched &= intact(blocks[i], std::min<size_t>(size, 64), static_cast<unsigned char>(i));
+        for (size_t i = 1; i < count; i += 2)
+            Jallocator::deallocate(blocks[i]);
+
+        check(adopted, "new thread adopts the exited thread's segment", size);
+        check(reused, "freed blocks of an exited thread reused", size);
+        check(live_untouched, "live blocks of an exited thread untouched", size);
+    }
+    Jallocator::control("profile.sample_rate", PROFILE_SAMPLE_RATE);
+}
+
+// A block reallocate() shrank in place keeps its slot, so a sized free
+// with the new size must still hand the slot back to its own class
+void test_sized_free_after_shrink()
+{
+    Jallocator::control("profile.sample_rate", 0);
+    const std::pair<size_t, size_t> shrinks[] = {{1000, 400}, {1000, 100}, {300, 16}, {1500, 257}};
+    for (const auto &[size, shrunk]: shrinks)
+    {
+        void *ptr = Jallocator::allocate(size);
+        void *same = Jallocator::reallocate(ptr, shrunk);
+        check(same == ptr, "shrinks in place", shrunk);
+        Jallocator::deallocate(same, shrunk);
+
+        std::vector<void *> smaller;
+        for (int i = 0; i < 64; ++i)
+            smaller.push_back(Jallocator::allocate(shrunk));
+        check(std::find(smaller.begin(), smaller.end(), ptr) == smaller.end(), "slot kept out of the smaller class", shrunk);
+        for (void *block: smaller)
+            Jallocator::deallocate(block, shrunk);
+
+        void *again = Jallocator::allocate(size);
+        check(again == ptr, "slot back in its own class", size);
+        Jallocator::deallocate(again, size);
+    }
+    Jallocator::control("profile.sample_rate", PROFILE_SAMPLE_RATE);
+}
+
+// reallocate() keeps a block where it is whenever it can: within what it
+// holds, a span onto the free pages behind it and back, and a mapping
+// through the quarter of headroom each move or mremap leaves it, or by
+// unmapping its tail. The block is alone on a fresh thread, so the pages
+// behind its span are free.
+void test_realloc_in_place()
+{
+    Jallocator::control("profile.sample_rate", 0);
+    std::thread([]
+    {
+        constexpr size_t START = 3 * 1024;
+        constexpr size_t STEP = 4 * 1024;
+        constexpr size_t PEAK = 4 << 20;
+        const auto pages = [](const size_t size) { return (size + BLOCK_HEADER_SIZE + PG_SIZE - 1) & ~(PG_SIZE - 1); };
+        std::vector<unsigned char> reference(PEAK);
+        fill(reference.data(), PEAK, 11);
+
+        auto *block = static_cast<unsigned char *>(Jallocator::allocate(START));
+        std::memcpy(block, reference.data(), START);
+        size_t size = START;
+        bool mapped = false;
+        bool kept = true, in_place = true, span_grew = true, headroom = true;
+        for (size_t next = START + STEP; next <= PEAK && block; next += STEP)
+        {
+            const size_t usable = Jallocator::usable_size(block);
+            auto *grown = static_cast<unsigned char *>(Jallocator::reallocate(block, next));
+            check(grown != nullptr, "realloc grows", next);
+            if (!grown)
+                return;
+            kept &= std::memcmp(grown, reference.data(), size) == 0;
+            if (next <= usable)
+                in_place &= grown == block;
+            else if (!mapped && pages(next) <= MID_MAX_PAGES * PG_SIZE)
+                span_grew &= grown == block;
+            else
+                headroom &= Jallocator::usable_size(grown) >= next + next / 4;
+            mapped |= pages(next) > MID_MAX_PAGES * PG_SIZE;
+            std::memcpy(grown + size, reference.data() + size, next - size);
+            block = grown;
+            size = next;
+        }
+        check(kept, "realloc growth keeps the contents", size);
+        check(in_place, "growth within the block stays in place", size);
+        check(span_grew, "span grows onto free pages", MID_LARGE_THRESHOLD);
+        check(headroom, "moved or remapped block gets a quarter of headroom", size);
+
+        bool shrunk_in_place = true, tail_returned = true;
+        kept = true;
+        while (size > START)
+        {
+            const size_t next = size - STEP;
+            const size_t total = Jallocator::usable_size(block) + BLOCK_HEADER_SIZE;
+            auto *shrunk = static_cast<unsigned char *>(Jallocator::reallocate(block, next));
+            check(shrunk != nullptr, "realloc shrinks", next);
+            if (!shrunk)
+                return;
+            kept &= std::memcmp(shrunk, reference.data(), next) == 0;
+            // a mapping moves to a span once it falls into the mid-size range
+            if (!mapped || next > MID_LARGE_THRESHOLD)
+            {
+                shrunk_in_place &= shrunk == block;
+                // spans always give back their tail, mappings once it is a quarter
+                const size_t expected = !mapped || total - pages(next) >= total / 4 ? pages(next) : total;
+                tail_returned &= Jallocator::usable_size(shrunk) + BLOCK_HEADER_SIZE == expected;
+            }
+            else
+            {
+                mapped = false;
+            }
+            block = shrunk;
+            size = next;
+        }
+        check(kept, "realloc shrinking keeps the contents", size);
+        check(shrunk_in_place, "shrinks stay in place", size);
+        check(tail_returned, "shrunk tail given back", size);
+        Jallocator::deallocate(block);
+    }).join();
+    Jallocator::control("profile.sample_rate", PROFILE_SAMPLE_RATE);
+}
+
+// control() takes each key only within its range and leaves the knob
+// alone otherwise; the cache effects are checked in tests/stats.cpp
+void test_control()
+{
+    tuning &knobs = tuning::get();
+    check(!Jallocator::control("no.such_key", 1), "unknown key", 1);
+    check(!Jallocator::control("thread_cache.depth", 0), "thread cache depth 0", 0);
+    check(!Jallocator::control("thread_cache.depth", CACHE_SIZE + 1), "thread cache depth too deep", CACHE_SIZE + 1);
+    check(Jallocator::control("thread_cache.depth", 7) && knobs.thread_cache_depth == 7, "thread cache depth", 7);
+    check(!Jallocator::control("thread_cache.depth", 0) && knobs.thread_cache_depth == 7, "rejected depth kept", 0);
+    check(Jallocator::control("thread_cache.depth", CACHE_SIZE), "thread cache depth restored", CACHE_SIZE);
+    check(Jallocator::control("thread_cache.budget", 0) && knobs.thread_cache_budget == 0, "thread cache budget 0", 0);
+    check(Jallocator::control("thread_cache.budget", THREAD_CACHE_BUDGET), "thread cache budget restored", THREAD_CACHE_BUDGET);
+    check(!Jallocator::control("span_cache.depth", SPAN_CACHE_DEPTH + 1), "span cache depth too deep", SPAN_CACHE_DEPTH + 1);
+    check(Jallocator::control("span_cache.depth", 0) && knobs.span_cache_depth == 0, "span cache depth 0", 0);
+    check(Jallocator::control("span_cache.depth", SPAN_CACHE_DEPTH), "span cache depth restored", SPAN_CACHE_DEPTH);
+    check(!Jallocator::control("large_cache.depth", LARGE_CACHE_DEPTH + 1), "large cache depth too deep", LARGE_CACHE_DEPTH + 1);
+    check(Jallocator::control("large_cache.depth", LARGE_CACHE_DEPTH), "large cache depth", LARGE_CACHE_DEPTH);
+    check(Jallocator::control("large_cache.bytes", MAX_CACHE_SIZE), "large cache bytes", MAX_CACHE_SIZE);
+    check(!Jallocator::control("huge_pages", 2), "huge pages 2", 2);
+    check(Jallocator::control("huge_pages", 0), "huge pages off", 0);
+    check(!Jallocator::control("scavenger.enabled", 2), "scavenger enabled 2", 2);
+    check(!Jallocator::control("scavenger.interval_ms", 0), "scavenger interval 0", 0);
+#ifdef JALLOC_PROFILING
+    check(Jallocator::control("profile.sample_rate", PROFILE_SAMPLE_RATE), "sample rate", PROFILE_SAMPLE_RATE);
+#else
+    check(!Jallocator::control("profile.sample_rate", PROFILE_SAMPLE_RATE), "sample rate without profiling", 0);
+#endif
+
+    const struct
+    {
+        const char *text;
+        bool ok;
+        size_t value;
+    } sizes[] = {
+        {"0", true, 0},
+        {"4K", true, size_t(4) << 10},
+        {"3m", true, size_t(3) << 20},
+        {"1G", true, size_t(1) << 30},
+        {"18446744073709551615", true, SIZE_MAX},
+        {"18446744073709551615K", false, 0},
+        {"18446744073709551616", false, 0},
+        {"12x", false, 0},
+        {"4KB", false, 0},
+        {"", false, 0},
+        {"K", false, 0},
+        {"-1", false, 0},
+    };
+    for (const auto &entry: sizes)
+    {
+        size_t value = 1;
+        const bool ok = Jallocator::parse_size(entry.text, value);
+        if (ok != entry.ok || (ok && value != entry.value))
+        {
+            std::cerr << "parse_size(\"" << entry.text << "\")\n";
+            check(false, "parse_size", value);
+        }
+    }
+}
+
+// Without JALLOC_STATS a snapshot has the class sizes and the reserved
+// segment bytes, and no counts; tests/stats.cpp covers the counting build
+void test_stats_disabled()
+{
+#ifndef JALLOC_STATS
+    void *ptr = Jallocator::allocate(100);
+    const jalloc::stats_snapshot snapshot = jalloc::stats();
+    check(!snapshot.enabled, "stats disabled", 0);
+    bool counted = snapshot.spans.allocations || snapshot.large.allocations || snapshot.map_calls;
+    bool sized = true;
+    for (size_t size_class = 0; size_class < SIZE_CLASSES; ++size_class)
+    {
+        counted |= snapshot.classes[size_class].allocations || snapshot.classes[size_class].allocated_bytes;
+        sized &= snapshot.classes[size_class].size == size_classes[size_class].size;
+    }
+    check(!counted, "no counts without JALLOC_STATS", 100);
+    check(sized, "class sizes in the snapshot", SIZE_CLASSES);
+
+    size_t reserved = 0;
+    for (const size_t bytes: snapshot.segment_bytes)
+        reserved += bytes;
+    check(reserved >= SEGMENT_SIZE, "segment bytes always counted", reserved);
+    Jallocator::deallocate(ptr);
+#endif
+}
+
 int main()
 {
+    test_size_classes();
+    test_cross_thread_free();
+    test_aligned_allocation();
+    test_callocate_zeroes();
+    test_arena();
+    test_typed_allocation();
+    test_sized_free_after_shrink();
+    test_thread_exit_handoff();
+    test_realloc_in_place();
+    test_control();
+    test_stats_disabled();
+    if (failures)
+    {
+        std::cerr << failures << " failures\n";
+        return 1;
+    }
+
     std::cout << "Benchmarking Allocators\n";
     std::cout << std::string(std::string::size_type(80), '-') << "\n";
 
@@ -136,5 +809,17 @@ int main()
         std::cout << std::string(std::string::size_type(80), '-') << "\n";
     }
 
+    // The engine reallocate moves blocks with, against plain memcpy
+    std::vector<size_t> copy_sizes = {256, 4096, 65536, 1 << 20, 16 << 20, 64 << 20};
+
+    std::cout << "\nCopy benchmarks:\n";
+    std::cout << std::string(std::string::size_type(80), '-') << "\n";
+    for (auto size: copy_sizes)
+    {
+        benchmark_copy("copy_memory", size, [](void* dst, const void* src, size_t n) { copy_memory(dst, src, n); });
+        benchmark_copy("memcpy", size, [](void* dst, const void* src, size_t n) { std::memcpy(dst, src, n); });
+        std::cout << std::string(std::string::size_type(80), '-') << "\n";
+    }
+
     return 0;
 }
@@ -0,0 +1,108 @@
+// The malloc and operator new replacements, linked straight in: every
+// block they hand out has to keep alignof(max_align_t), and the aligned
+// entry points the alignment they were asked for.
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#define JALLOC_OVERRIDE
+#include "jalloc.hpp"
+
+static int failures = 0;
+
+static void check(const bool ok, const char* what, const size_t size)
+{
+    if (!ok)
+    {
+        std::fprintf(stderr, "FAIL: %s, size %zu\n", what, size);
+        ++failures;
+    }
+}
+
+static bool aligned(const void* ptr)
+{
+    return reinterpret_cast<uintptr_t>(ptr) % alignof(std::max_align_t) == 0;
+}
+
+int main()
+{
+    constexpr size_t BLOCKS = 64;
+    void* blocks[BLOCKS];
+    for (size_t size = 9; size <= 256; ++size)
+    {
+        // several per size, so the later slots of a page are covered too
+        for (auto& block : blocks)
+        {
+            block = std::malloc(size);
+            check(block && aligned(block), "malloc", size);
+        }
+        for (auto& block : blocks)
+        {
+            block = std::realloc(block, size + 8);
+            check(block && aligned(block), "realloc", size + 8);
+        }
+        for (const auto block : blocks)
+            std::free(block);
+
+        for (auto& block : blocks)
+        {
+            block = std::calloc(1, size);
+            check(block && aligned(block), "calloc", size);
+        }
+        for (const auto block : blocks)
+            std::free(block);
+
+        for (auto& block : blocks)
+        {
+            block = new char[size];
+            check(aligned(block), "operator new[]", size);
+        }
+        for (const auto block : blocks)
+            ::operator delete[](block, size);
+
+        for (auto& block : blocks)
+        {
+            block = ::operator new(size, std::nothrow);
+            check(block && aligned(block), "nothrow operator new", size);
+        }
+        for (const auto block : blocks)
+            ::operator delete(block, size);
+    }
+
+    for (size_t alignment = sizeof(void*); alignment <= 1024 * 1024; alignment <<= 1)
+    {
+        for (const size_t size : {size_t{1}, size_t{100}, size_t{3000}, size_t{70000}})
+        {
+            const auto on_boundary = [alignment](const void* ptr)
+            {
+                return ptr && reinterpret_cast<uintptr_t>(ptr) % alignment == 0;
+            };
+
+            void* block = nullptr;
+            check(posix_memalign(&block, alignment, size) == 0 && on_boundary(block), "posix_memalign", alignment);
+            std::free(block);
+
+            // aligned_alloc wants a multiple of the alignment
+            block = std::aligned_alloc(alignment, (size + alignment - 1) & ~(alignment - 1));
+            check(on_boundary(block), "aligned_alloc", alignment);
+            std::free(block);
+
+            block = ::operator new(size, std::align_val_t(alignment));
+            check(on_boundary(block), "aligned operator new", alignment);
+            ::operator delete(block, size, std::align_val_t(alignment));
+
+            block = ::operator new(size, std::align_val_t(alignment), std::nothrow);
+            check(on_boundary(block), "aligned nothrow operator new", alignment);
+            ::operator delete(block, std::align_val_t(alignment), std::nothrow);
+        }
+    }
+
+    void* block = nullptr;
+    check(posix_memalign(&block, 24, 64) == EINVAL && !block, "posix_memalign rejects 24", 64);
+    check(posix_memalign(&block, 4, 64) == EINVAL && !block, "posix_memalign rejects 4", 64);
+
+    if (failures)
+        std::fprintf(stderr, "%d failures\n", failures);
+    return failures ? 1 : 0;
+}
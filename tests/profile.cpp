@@ -0,0 +1,116 @@
+// Built with JALLOC_PROFILE: every path that hands out a block has to run
+// the sample countdown, or the profile misses whole kinds of allocation.
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include "jalloc.hpp"
+
+static int failures = 0;
+
+static void check(const bool ok, const char* what, const size_t size)
+{
+    if (!ok)
+    {
+        std::fprintf(stderr, "FAIL: %s, size %zu\n", what, size);
+        ++failures;
+    }
+}
+
+// Live objects and bytes from the "heap profile: " line of a dump
+static bool live_samples(uint64_t& objects, uint64_t& bytes)
+{
+    char path[] = "/tmp/jalloc_profile_XXXXXX";
+    const int fd = mkstemp(path);
+    if (fd < 0)
+        return false;
+    unlink(path);
+
+    char text[256]{};
+    const bool ok = jalloc::dump_profile(fd) && lseek(fd, 0, SEEK_SET) == 0 &&
+                    read(fd, text, sizeof(text) - 1) > 0;
+    close(fd);
+    unsigned long long live_objects = 0, live_bytes = 0;
+    if (!ok || std::sscanf(text, "heap profile: %llu: %llu", &live_objects, &live_bytes) != 2)
+        return false;
+    objects = live_objects;
+    bytes = live_bytes;
+    return true;
+}
+
+static bool zeroed(const void* ptr, const size_t size)
+{
+    const auto* bytes = static_cast<const unsigned char*>(ptr);
+    for (size_t i = 0; i < size; i += 64)
+        if (bytes[i] != 0 || bytes[size - 1 - i] != 0)
+            return false;
+    return true;
+}
+
+// callocate past the medium range goes to spans and mappings directly
+static void test_calloc_sampling()
+{
+    constexpr size_t BLOCK = 64 * 1024;
+    constexpr size_t BLOCKS = 256;
+    void* blocks[BLOCKS];
+
+    uint64_t objects = 0, bytes = 0;
+    check(live_samples(objects, bytes) && objects == 0, "nothing sampled before the loop", 0);
+
+    // dirty the blocks first, a sampled calloc must not hand them back as is
+    for (auto& block : blocks)
+    {
+        block = jalloc::allocate(BLOCK);
+        std::memset(block, 0xAB, BLOCK);
+    }
+    for (const auto block : blocks)
+        jalloc::deallocate(block);
+
+    // 16 MB at the default 512 KB rate, 32 samples expected
+    for (auto& block : blocks)
+    {
+        block = jalloc::callocate(1, BLOCK);
+        check(block && zeroed(block, BLOCK), "calloc reads as zero", BLOCK);
+    }
+    check(live_samples(objects, bytes) && objects > 0 && bytes >= objects * BLOCK,
+          "64 KB callocs are sampled", BLOCK);
+
+    for (const auto block : blocks)
+        jalloc::deallocate(block);
+    check(live_samples(objects, bytes) && objects == 0, "freed samples leave the profile", BLOCK);
+}
+
+// A block reallocate() moves past the mid-size range skips allocate()
+static void test_realloc_sampling()
+{
+    constexpr size_t BLOCKS = 64;
+    void* blocks[BLOCKS];
+
+    // 64 moves from 256 KB into 512 KB mappings, 32 MB in all
+    for (auto& block : blocks)
+    {
+        block = jalloc::allocate(200 * 1024);
+        std::memset(block, 0x5A, 200 * 1024);
+        block = jalloc::reallocate(block, 512 * 1024);
+        check(block && static_cast<unsigned char*>(block)[200 * 1024 - 1] == 0x5A,
+              "realloc keeps the contents", 512 * 1024);
+    }
+
+    uint64_t objects = 0, bytes = 0;
+    check(live_samples(objects, bytes) && objects > 0, "realloc growth is sampled", 512 * 1024);
+
+    for (const auto block : blocks)
+        jalloc::deallocate(block);
+}
+
+int main()
+{
+    test_calloc_sampling();
+    test_realloc_sampling();
+
+    if (failures)
+        std::fprintf(stderr, "%d failures\n", failures);
+    return failures ? 1 : 0;
+}
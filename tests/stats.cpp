@@ -0,0 +1,267 @@
+// Built with JALLOC_STATS: known allocations have to move the counters of
+// their class by exactly what they asked for, whichever thread frees them.
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "jalloc.hpp"
+
+static int failures = 0;
+
+static void check(const bool ok, const char* what, const size_t size)
+{
+    if (!ok)
+    {
+        std::fprintf(stderr, "FAIL: %s, size %zu\n", what, size);
+        ++failures;
+    }
+}
+
+// Each test runs on a thread of its own, so no cache starts out warm
+template<typename Test>
+static void on_fresh_thread(Test test)
+{
+    std::thread(test).join();
+}
+
+// A mapping of its own: mapped once, kept by the large block cache on
+// free and handed out again, unmapped once the cache may keep none
+static void test_large()
+{
+    constexpr size_t SIZE = 3 << 20;
+    const jalloc::stats_snapshot before = jalloc::stats();
+    void* block = jalloc::allocate(SIZE);
+    const jalloc::stats_snapshot allocated = jalloc::stats();
+    const size_t mapped = allocated.large.allocated_bytes - before.large.allocated_bytes;
+    check(allocated.large.allocations == before.large.allocations + 1, "large allocation counted", SIZE);
+    // rounded up to the cache bins, never by more than a quarter
+    check(mapped >= SIZE && mapped <= SIZE + SIZE / 4 + PG_SIZE, "large allocated bytes", mapped);
+    check(allocated.large.mapped_bytes == before.large.mapped_bytes + mapped, "large mapped bytes", mapped);
+    check(allocated.map_calls == before.map_calls + 1, "one mmap", SIZE);
+
+    jalloc::deallocate(block);
+    const jalloc::stats_snapshot cached = jalloc::stats();
+    check(cached.large.deallocations == before.large.deallocations + 1, "large free counted", SIZE);
+    check(cached.large.allocated_bytes == before.large.allocated_bytes, "large allocated bytes back", SIZE);
+    check(cached.large.cached_bytes == before.large.cached_bytes + mapped, "large block cached", mapped);
+    check(cached.large.mapped_bytes == allocated.large.mapped_bytes, "cached mapping stays mapped", mapped);
+
+    block = jalloc::allocate(SIZE);
+    const jalloc::stats_snapshot reused = jalloc::stats();
+    check(reused.large.cache_hits == before.large.cache_hits + 1, "large cache hit", SIZE);
+    check(reused.large.cached_bytes == before.large.cached_bytes, "large cache emptied", SIZE);
+    check(reused.map_calls == allocated.map_calls, "no mmap for a cached block", SIZE);
+
+    jalloc::control("large_cache.depth", 0);
+    jalloc::deallocate(block);
+    jalloc::control("large_cache.depth", LARGE_CACHE_DEPTH);
+    const jalloc::stats_snapshot returned = jalloc::stats();
+    check(returned.large.returned_bytes == before.large.returned_bytes + mapped, "large returned bytes", mapped);
+    check(returned.large.mapped_bytes == before.large.mapped_bytes, "large mapped bytes back", mapped);
+    check(returned.unmap_calls == before.unmap_calls + 1, "one munmap", SIZE);
+}
+
+// A page span: the span cache keeps it, with no span cache it goes back
+// to the page heap
+static void test_span()
+{
+    constexpr size_t SIZE = 64 * 1024;
+    const size_t bytes = (SIZE + BLOCK_HEADER_SIZE + PG_SIZE - 1) / PG_SIZE * PG_SIZE;
+    const jalloc::stats_snapshot before = jalloc::stats();
+    void* block = jalloc::allocate(SIZE);
+    const jalloc::stats_snapshot allocated = jalloc::stats();
+    check(allocated.spans.allocations == before.spans.allocations + 1, "span allocation counted", SIZE);
+    check(allocated.spans.allocated_bytes == before.spans.allocated_bytes + bytes, "span allocated bytes", bytes);
+    check(allocated.spans.mapped_bytes == before.spans.mapped_bytes + bytes, "span mapped bytes", bytes);
+
+    jalloc::deallocate(block);
+    const jalloc::stats_snapshot cached = jalloc::stats();
+    check(cached.spans.deallocations == before.spans.deallocations + 1, "span free counted", SIZE);
+    check(cached.spans.allocated_bytes == before.spans.allocated_bytes, "span allocated bytes back", bytes);
+    check(cached.spans.cached_bytes == before.spans.cached_bytes + bytes, "span cached", bytes);
+
+    block = jalloc::allocate(SIZE);
+    const jalloc::stats_snapshot reused = jalloc::stats();
+    check(reused.spans.cache_hits == before.spans.cache_hits + 1, "span cache hit", SIZE);
+    check(reused.spans.cached_bytes == before.spans.cached_bytes, "span cache emptied", SIZE);
+    check(reused.spans.mapped_bytes == allocated.spans.mapped_bytes, "no new span", SIZE);
+
+    jalloc::control("span_cache.depth", 0);
+    jalloc::deallocate(block);
+    jalloc::control("span_cache.depth", SPAN_CACHE_DEPTH);
+    const jalloc::stats_snapshot returned = jalloc::stats();
+    check(returned.spans.returned_bytes == before.spans.returned_bytes + bytes, "span returned bytes", bytes);
+    check(returned.spans.mapped_bytes == before.spans.mapped_bytes, "span mapped bytes back", bytes);
+}
+
+// Pool blocks of one class, freed by the thread that took them and by a
+// thread that never allocates: the sums over all threads come out even
+static void test_small(const bool free_elsewhere)
+{
+    constexpr size_t SIZE = 48;
+    constexpr size_t BLOCKS = 300;
+    const size_t size_class = (SIZE - 1) >> 3;
+    std::vector<void*> blocks(BLOCKS);
+
+    const jalloc::stats_snapshot before = jalloc::stats();
+    check(before.classes[size_class].size == SIZE, "class size", SIZE);
+    for (auto& block : blocks)
+        block = jalloc::allocate(SIZE);
+    const jalloc::stats_snapshot allocated = jalloc::stats();
+    const jalloc::class_stats& counts = allocated.classes[size_class];
+    check(counts.allocations == before.classes[size_class].allocations + BLOCKS, "small allocations counted", SIZE);
+    check(counts.allocated_bytes == before.classes[size_class].allocated_bytes + BLOCKS * SIZE,
+          "small allocated bytes", BLOCKS * SIZE);
+    check(counts.mapped_bytes >= counts.allocated_bytes + counts.cached_bytes &&
+          counts.mapped_bytes % PG_SIZE == 0, "small blocks sit on mapped pages", counts.mapped_bytes);
+
+    jalloc::stats_snapshot freed{};
+    const auto free_all = [&]
+    {
+        for (const auto block : blocks)
+            jalloc::deallocate(block);
+        // taken before the thread exits and its counters are folded away
+        freed = jalloc::stats();
+    };
+    if (free_elsewhere)
+        std::thread(free_all).join();
+    else
+        free_all();
+
+    const jalloc::stats_snapshot after = jalloc::stats();
+    for (const jalloc::stats_snapshot* snapshot : {&std::as_const(freed), &after})
+    {
+        const jalloc::class_stats& now = snapshot->classes[size_class];
+        check(now.deallocations == before.classes[size_class].deallocations + BLOCKS, "small frees counted", SIZE);
+        check(now.allocated_bytes == before.classes[size_class].allocated_bytes, "small allocated bytes back", SIZE);
+    }
+}
+
+// Frees a churn of pool blocks of one class on a fresh thread, then
+// counts how many of the next few allocations the thread cache serves
+static uint64_t hits_after_churn()
+{
+    constexpr size_t SIZE = 128;
+    constexpr size_t BLOCKS = 200;
+    const size_t size_class = (SIZE - 1) >> 3;
+    uint64_t hits = 0;
+    on_fresh_thread([&]
+    {
+        std::vector<void*> blocks(BLOCKS);
+        for (auto& block : blocks)
+            block = jalloc::allocate(SIZE);
+        for (const auto block : blocks)
+            jalloc::deallocate(block);
+
+        const uint64_t before = jalloc::stats().classes[size_class].cache_hits;
+        for (size_t i = 0; i < 16; ++i)
+            blocks[i] = jalloc::allocate(SIZE);
+        hits = jalloc::stats().classes[size_class].cache_hits - before;
+        for (size_t i = 0; i < 16; ++i)
+            jalloc::deallocate(blocks[i]);
+    });
+    return hits;
+}
+
+// The cache limits set through control() as the counters see them
+static void test_tuning()
+{
+    const uint64_t deep = hits_after_churn();
+    check(deep == 16, "full depth keeps the churn", deep);
+
+    // one cached block at a time, so every other allocation refills
+    check(jalloc::control("thread_cache.depth", 1), "depth 1 accepted", 1);
+    const uint64_t shallow = hits_after_churn();
+    check(jalloc::control("thread_cache.depth", CACHE_SIZE), "depth restored", CACHE_SIZE);
+    check(shallow <= 8, "depth 1 keeps one block", shallow);
+
+    check(jalloc::control("thread_cache.budget", 0), "budget 0 accepted", 0);
+    const uint64_t unbudgeted = hits_after_churn();
+    check(jalloc::control("thread_cache.budget", THREAD_CACHE_BUDGET), "budget restored", THREAD_CACHE_BUDGET);
+    check(unbudgeted == 0, "no budget, no cache hits", unbudgeted);
+
+    constexpr size_t LARGE = 1 << 20;
+    on_fresh_thread([]
+    {
+        check(jalloc::control("large_cache.bytes", 0), "large cache bytes 0 accepted", 0);
+        const jalloc::stats_snapshot before = jalloc::stats();
+        jalloc::deallocate(jalloc::allocate(LARGE));
+        const jalloc::stats_snapshot after = jalloc::stats();
+        check(jalloc::control("large_cache.bytes", MAX_CACHE_SIZE), "large cache bytes restored", MAX_CACHE_SIZE);
+        check(after.large.cached_bytes == before.large.cached_bytes, "no large cache bytes, nothing kept", LARGE);
+        check(after.unmap_calls == before.unmap_calls + 1, "no large cache bytes, unmapped", LARGE);
+    });
+}
+
+// With a target of 0 every pass of the scavenger is over it. A worker
+// that left a span and a mapping in its caches drops both on its next
+// span or large allocation once a pass went by.
+static void test_scavenger()
+{
+    Jallocator::start_scavenger(0, std::chrono::milliseconds(5));
+    on_fresh_thread([]
+    {
+        constexpr size_t PROBE = 5 << 20;
+        const jalloc::stats_snapshot before = jalloc::stats();
+        for (int i = 0; i < 8; ++i)
+        {
+            void* span = jalloc::allocate(64 * 1024);
+            void* mapped = jalloc::allocate(1 << 20);
+            jalloc::deallocate(span);
+            jalloc::deallocate(mapped);
+        }
+        const jalloc::stats_snapshot cached = jalloc::stats();
+        check(cached.spans.cached_bytes > before.spans.cached_bytes, "worker caches a span", 64 * 1024);
+        check(cached.large.cached_bytes > before.large.cached_bytes, "worker caches a mapping", 1 << 20);
+
+        // probes stay allocated so they are never cached themselves
+        std::vector<void*> probes;
+        jalloc::stats_snapshot dropped{};
+        for (int wait = 0; wait < 400; ++wait)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            probes.push_back(jalloc::allocate(PROBE));
+            dropped = jalloc::stats();
+            if (dropped.spans.cached_bytes == before.spans.cached_bytes &&
+                dropped.large.cached_bytes == before.large.cached_bytes)
+                break;
+        }
+        check(dropped.spans.cached_bytes == before.spans.cached_bytes, "span cache dropped", 64 * 1024);
+        check(dropped.large.cached_bytes == before.large.cached_bytes, "large cache dropped", 1 << 20);
+        check(dropped.spans.returned_bytes > cached.spans.returned_bytes, "spans given back", 64 * 1024);
+        check(dropped.large.returned_bytes > cached.large.returned_bytes, "mappings given back", 1 << 20);
+        for (const auto probe : probes)
+            jalloc::deallocate(probe);
+    });
+
+    // stops at once however long the interval, and only once
+    Jallocator::start_scavenger(0, std::chrono::hours(1));
+    const auto start = std::chrono::steady_clock::now();
+    Jallocator::stop_scavenger();
+    Jallocator::stop_scavenger();
+    check(std::chrono::steady_clock::now() - start < std::chrono::seconds(5), "scavenger stops promptly", 0);
+    check(jalloc::control("scavenger.enabled", 0), "scavenger already stopped", 0);
+}
+
+int main()
+{
+    check(jalloc::stats().enabled, "stats enabled", 0);
+
+    on_fresh_thread(test_large);
+    on_fresh_thread(test_span);
+    on_fresh_thread([] { test_small(false); });
+    on_fresh_thread([] { test_small(true); });
+    test_tuning();
+    test_scavenger();
+
+    size_t reserved = 0;
+    for (const size_t bytes : jalloc::stats().segment_bytes)
+        reserved += bytes;
+    check(reserved >= SEGMENT_SIZE && reserved % SEGMENT_SIZE == 0, "segment bytes", reserved);
+
+    if (failures)
+        std::fprintf(stderr, "%d failures\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,175 @@
+// Built with JALLOC_TRACE: records a known sequence of calls on two
+// threads, reads the file back and checks every event. The trace is left
+// behind for jalloc_replay, which ctest runs on it next.
+//
+//   jalloc_trace_tests [TRACE]
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <thread>
+#include <vector>
+#include "jalloc.hpp"
+
+static int failures = 0;
+
+static void check(const bool ok, const char* what, const size_t size)
+{
+    if (!ok)
+    {
+        std::fprintf(stderr, "FAIL: %s, size %zu\n", what, size);
+        ++failures;
+    }
+}
+
+// As written by the recorder, see Jallocator::trace_recorder
+enum class op : uint8_t
+{
+    ALLOCATE,
+    ALLOCATE_ALIGNED,
+    CALLOCATE,
+    REALLOCATE,
+    DEALLOCATE,
+    DEALLOCATE_SIZED,
+};
+
+struct event
+{
+    uint64_t time;
+    uint64_t ptr;
+    uint64_t result;
+    uint64_t size;
+};
+
+// Churn past one chunk, so a thread's events span several of them
+static constexpr size_t CHURN = 2 * TRACE_CHUNK_EVENTS;
+static constexpr size_t CHURN_SIZE = 64;
+
+// Both threads make the same calls, sizes scaled by `base`
+static void calls(const size_t base)
+{
+    void* block = jalloc::allocate(base);
+    void* zeroed = jalloc::callocate(4, base / 4);
+    void* aligned = Jallocator::allocate_aligned(base, 256);
+    block = jalloc::reallocate(block, 3 * base);
+    jalloc::deallocate(block);
+    jalloc::deallocate(zeroed, base);
+    jalloc::deallocate(aligned);
+    for (size_t i = 0; i < CHURN / 2; ++i)
+        jalloc::deallocate(jalloc::allocate(CHURN_SIZE));
+}
+
+static op op_of(const event& e)
+{
+    return static_cast<op>(e.size >> 56);
+}
+
+static uint64_t size_of(const event& e)
+{
+    return e.size & ((1ULL << 56) - 1);
+}
+
+// One thread's events against what calls(base) made
+static void check_thread(const std::vector<event>& events, const size_t base)
+{
+    check(events.size() == 7 + CHURN, "event count", base);
+    if (events.size() != 7 + CHURN)
+        return;
+
+    const struct
+    {
+        op kind;
+        uint64_t size;
+    } expected[] = {
+        {op::ALLOCATE, base},
+        {op::CALLOCATE, base},
+        {op::ALLOCATE_ALIGNED, base},
+        {op::REALLOCATE, 3 * base},
+        {op::DEALLOCATE, 0},
+        {op::DEALLOCATE_SIZED, base},
+        {op::DEALLOCATE, 0},
+    };
+    for (size_t i = 0; i < 7; ++i)
+        check(op_of(events[i]) == expected[i].kind && size_of(events[i]) == expected[i].size,
+              "op and size", expected[i].size);
+
+    // blocks handed out by one call are the ones the later calls name
+    check(events[0].result && !events[0].ptr, "allocate result", base);
+    check(events[1].result && !events[1].ptr, "callocate result", base);
+    check(events[2].result && events[2].ptr == 256 && events[2].result % 256 == 0, "aligned result", base);
+    check(events[3].ptr == events[0].result && events[3].result, "realloc names the block", 3 * base);
+    check(events[4].ptr == events[3].result, "free names the realloc result", 3 * base);
+    check(events[5].ptr == events[1].result, "sized free names the calloc", base);
+    check(events[6].ptr == events[2].result, "free names the aligned block", base);
+
+    bool paired = true, ordered = true;
+    for (size_t i = 7; i < events.size(); i += 2)
+    {
+        paired &= op_of(events[i]) == op::ALLOCATE && size_of(events[i]) == CHURN_SIZE &&
+                  op_of(events[i + 1]) == op::DEALLOCATE && events[i + 1].ptr == events[i].result;
+    }
+    for (size_t i = 1; i < events.size(); ++i)
+        ordered &= events[i].time >= events[i - 1].time;
+    check(paired, "churn pairs", CHURN_SIZE);
+    check(ordered, "events in time order", events.size());
+}
+
+int main(const int argc, char** argv)
+{
+    const char* path = argc > 1 ? argv[1] : "jalloc_trace_test.trace";
+    check(jalloc::start_trace(path), "start_trace", 0);
+    check(!jalloc::start_trace(path), "one trace at a time", 0);
+
+    // the worker's chunk is handed over as it exits
+    calls(1000);
+    std::thread([] { calls(40000); }).join();
+    jalloc::stop_trace();
+
+    // not recorded
+    jalloc::deallocate(jalloc::allocate(100));
+
+    FILE* file = std::fopen(path, "rb");
+    check(file != nullptr, "trace file", 0);
+    if (!file)
+        return 1;
+
+    uint64_t header[2]{};
+    check(std::fread(header, sizeof(header), 1, file) == 1 && header[0] == TRACE_FILE_MAGIC && header[1] > 0,
+          "file header", sizeof(header));
+
+    struct
+    {
+        uint32_t magic;
+        uint32_t count;
+        uint64_t thread;
+    } chunk{};
+    std::map<uint64_t, std::vector<event>> threads;
+    size_t chunks = 0;
+    while (std::fread(&chunk, sizeof(chunk), 1, file) == 1)
+    {
+        check(chunk.magic == TRACE_CHUNK_MAGIC && chunk.count > 0 && chunk.count <= TRACE_CHUNK_EVENTS,
+              "chunk header", chunk.count);
+        if (chunk.magic != TRACE_CHUNK_MAGIC || chunk.count > TRACE_CHUNK_EVENTS)
+            break;
+        std::vector<event>& events = threads[chunk.thread];
+        const size_t used = events.size();
+        events.resize(used + chunk.count);
+        check(std::fread(events.data() + used, sizeof(event), chunk.count, file) == chunk.count,
+              "chunk events", chunk.count);
+        ++chunks;
+    }
+    std::fclose(file);
+
+    // a thread's chunks are written in the order they filled, so they
+    // concatenate; both threads went past one chunk
+    check(threads.size() == 2, "two threads", threads.size());
+    check(chunks >= 6, "several chunks per thread", chunks);
+    for (const auto& [thread, events] : threads)
+    {
+        check(thread != 0, "thread id", thread);
+        check_thread(events, !events.empty() && size_of(events[0]) == 40000 ? 40000 : 1000);
+    }
+
+    if (failures)
+        std::fprintf(stderr, "%d failures\n", failures);
+    return failures ? 1 : 0;
+}